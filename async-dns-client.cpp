@@ -2,267 +2,2071 @@
 
 #include "async-dns-client.hpp"
 
+#include "dns-message.hpp"
 #include "logging.hpp"
+#include "udp-batch.hpp"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/write.hpp>
 
+#include <algorithm>
 #include <chrono>
-#include <cstring>  // std::memset
+#include <cctype>   // std::tolower
+#include <cstdint>
+#include <cstring>  // std::strerror
+#include <exception>
+#include <future>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
 
-#include <resolv.h>
+#include <pthread.h>
+#include <sched.h>
 
 
 namespace {
 
-// Wrapper for libresolv's res_state to properly initialize and cleanup
-// the instance (as a thread-local variable).
-struct ResStateWrapper {
-  struct __res_state res;
-  bool initialized = false;
+// Datagrams received with a single recvmmsg().
+constexpr std::size_t RECEIVE_BATCH = 64;
 
-  res_state get() { return &res; }
+// Receive batches handled before the strand gets back to other work.
+constexpr std::size_t MAX_RECEIVE_ROUNDS = 16;
 
-  ResStateWrapper() {
-    std::memset(&res, 0, sizeof(res));
-    initialized = (res_ninit(&res) == 0);
+// Of the io_uring of a shard: the buffers of the multishot recvmsg (a power of 2) and the sends in
+// flight.
+constexpr std::size_t URING_BUFFERS = 1024;
+constexpr std::size_t URING_MAX_SENDS = 512;
+
+// Queries submitted to a shard but not taken over by its strand yet (a power of 2). Beyond that
+// each query gets a handler of its own.
+constexpr std::size_t SUBMISSION_RING_SIZE = 4096;
+
+// The in-flight index of a shard has 2^INFLIGHT_BUCKET_BITS buckets.
+constexpr unsigned int INFLIGHT_BUCKET_BITS = 12;
+
+// The TTL of the stale answers (RFC 8767).
+constexpr std::uint32_t STALE_TTL = 30;
+
+// Upper bound of the score of a nameserver timing out.
+constexpr std::chrono::microseconds MAX_SCORE = std::chrono::seconds(10);
+
+// The name without the trailing dot, if any, as the names of the cache keys (see
+// DnsCache::make_key()), so that both spellings land on the same shard and coalesce.
+std::string_view without_trailing_dot(std::string_view name)
+{
+  if (name.size() > 1 && name.back() == '.') {
+    name.remove_suffix(1);
+  }
+  return name;
+}
+
+// The number of queries a shard can take in flight and queued.
+std::size_t shard_capacity(std::size_t max_inflight, std::size_t max_inflight_per_upstream,
+                           std::size_t n_upstreams, std::size_t max_queued)
+{
+  if (max_inflight_per_upstream > 0 && max_inflight_per_upstream < max_inflight / n_upstreams) {
+    max_inflight = max_inflight_per_upstream * n_upstreams;
+  }
+  return max_queued > SIZE_MAX - max_inflight ? SIZE_MAX : max_inflight + max_queued;
+}
+
+// The CPUs of the workers: those given, or else the CPUs the process may run on (wrapping around
+// if there are fewer than workers).
+std::vector<unsigned int> worker_cpus(std::vector<unsigned int> cpus, std::size_t n_workers)
+{
+  if (cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    if (cpus.empty()) {
+      cpus.push_back(0);
+    }
+  }
+
+  for (auto cpu: cpus) {
+    if (cpu >= CPU_SETSIZE) {
+      throw std::invalid_argument("cpu " + std::to_string(cpu) + " out of range");
+    }
+  }
+
+  std::vector<unsigned int> result;
+  for (std::size_t i = 0; i < n_workers; ++i) {
+    result.push_back(cpus[i % cpus.size()]);
+  }
+  return result;
+}
+
+// Pins the calling thread.
+void pin_thread(unsigned int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (auto err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    WARN() << "pinning to cpu " << cpu << ": " << std::strerror(err);
+  }
+}
+
+}  // namespace
+
+
+AsyncDnsClient::AsyncDnsClient(
+        std::string_view ns_ip, unsigned short ns_port,
+        std::size_t n_workers,
+        unsigned int timeout_ms,
+        std::size_t n_shards)
+  : AsyncDnsClient(ns_ip, ns_port, Options{n_workers, n_shards, timeout_ms})
+{}
+
+AsyncDnsClient::AsyncDnsClient(
+        std::string_view ns_ip, unsigned short ns_port,
+        const Options& options)
+  : AsyncDnsClient({boost::asio::ip::udp::endpoint(boost::asio::ip::make_address(ns_ip), ns_port)}, options)
+{}
+
+AsyncDnsClient::AsyncDnsClient(
+        const std::vector<boost::asio::ip::udp::endpoint>& nameservers,
+        const Options& options)
+  : nameservers_(nameservers),
+    n_workers_(options.n_workers),
+    timeout_ms_(options.timeout_ms),
+    max_consecutive_timeouts_(std::max(options.max_consecutive_timeouts, 1u)),
+    down_time_ms_(options.down_time_ms),
+    max_retransmissions_(std::min<unsigned int>(options.max_retransmissions, MAX_ATTEMPTS - 2)),
+    initial_rto_(std::chrono::milliseconds(options.initial_rto_ms)),
+    min_rto_(std::chrono::milliseconds(options.min_rto_ms)),
+    max_rto_(std::chrono::milliseconds(std::max(options.max_rto_ms, options.min_rto_ms))),
+    hedge_(options.hedge),
+    tcp_idle_timeout_ms_(options.tcp_idle_timeout_ms),
+    edns_(options.edns),
+    max_inflight_(options.max_inflight == 0 ?
+                      QueryTable<QueryPtr>::SIZE :
+                      std::min<std::size_t>(options.max_inflight, QueryTable<QueryPtr>::SIZE)),
+    max_inflight_per_upstream_(options.max_inflight_per_nameserver),
+    max_queued_(options.max_queued),
+    capacity_(shard_capacity(max_inflight_, max_inflight_per_upstream_, nameservers.size(), max_queued_)),
+    refresh_ahead_(options.cache_size > 0 ? std::min(options.cache_refresh_ahead, 100u) : 0),
+    refresh_min_hits_(options.cache_refresh_min_hits),
+    serve_stale_(options.cache_size > 0 && options.cache_max_stale > 0),
+    per_core_(options.per_core),
+    io_(per_core_ ? 1 : BOOST_ASIO_CONCURRENCY_HINT_DEFAULT),
+    io_guard_(io_.get_executor())
+{
+  // A shard talks to all the nameservers over a single socket.
+  if (nameservers_.empty()) {
+    throw std::invalid_argument("no nameservers");
+  }
+  for (auto&& nameserver: nameservers_) {
+    if (nameserver.protocol() != nameservers_.front().protocol()) {
+      throw std::invalid_argument("nameservers of different address families");
+    }
+  }
+
+  if (!edns_.client_subnet.is_unspecified() &&
+      edns_.client_subnet_prefix > (edns_.client_subnet.is_v4() ? 32 : 128)) {
+    throw std::invalid_argument("client subnet prefix too long");
+  }
+
+  if (options.cache_size > 0) {
+    cache_ = std::make_unique<DnsCache>(
+        options.cache_size, options.cache_max_ttl, options.cache_max_negative_ttl, options.cache_max_stale);
+  }
+
+  auto n_shards = options.n_shards;
+  if (n_shards == 0 || per_core_) {
+    n_shards = std::max<std::size_t>(n_workers_, 1);
+  }
+
+  if (per_core_) {
+    cpus_ = worker_cpus(options.cpus, n_shards);
+    for (std::size_t i = 1; i < n_shards; ++i) {
+      contexts_.push_back(std::make_unique<boost::asio::io_context>(1));
+      context_guards_.push_back(boost::asio::make_work_guard(*contexts_.back()));
+    }
+  }
+
+  // The responses are no larger than advertised.
+  const std::size_t receive_size = std::max<std::size_t>(PACKETSZ, edns_.udp_size);
+
+  for (std::size_t i = 0; i < n_shards; ++i) {
+    auto& io = per_core_ ? worker_context(i) : io_;
+    if (per_core_ && options.numa_local) {
+      // The tables of the shard get touched first by a thread on its CPU.
+      std::exception_ptr error;
+      std::thread thread([&]() {
+        pin_thread(cpus_[i]);
+        try {
+          shards_.push_back(std::make_unique<Shard>(io, nameservers_.front(), nameservers_.size(), receive_size));
+        }
+        catch (...) {
+          error = std::current_exception();
+        }
+      });
+      thread.join();
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+    else {
+      shards_.push_back(std::make_unique<Shard>(io, nameservers_.front(), nameservers_.size(), receive_size));
+    }
+  }
+
+  if (options.io_uring) {
+    for (auto&& shard: shards_) {
+      shard->uring = std::make_unique<UdpUring>(
+          shard->strand.context(), RECEIVE_BATCH, URING_BUFFERS, receive_size, URING_MAX_SENDS);
+
+      boost::system::error_code err;
+      shard->uring->open(shard->socket, err);
+      if (err) {
+        WARN() << "io_uring: " << err.message() << ", falling back to the reactor";
+        for (auto&& other: shards_) {
+          other->uring.reset();
+        }
+        break;
+      }
+    }
+  }
+}
+
+void AsyncDnsClient::start()
+{
+  INFO() << "starting: shards=" << shards_.size() << (shards_.front()->uring ? ", io_uring" : "")
+         << (per_core_ ? ", per core" : "");
+
+  if (per_core_) {
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+      workers_.emplace_back([this, i]() {
+        pin_thread(cpus_[i]);
+        worker_context(i).run();
+      });
+    }
+  }
+  else {
+    for (std::size_t i = 0; i < n_workers_; ++i) {
+      workers_.emplace_back([this]() { io_.run(); });
+    }
+  }
+
+  for (auto&& shard: shards_) {
+    post(shard->strand, [this, &shard = *shard]() { start_receiving(shard); });
+  }
+}
+
+void AsyncDnsClient::stop()
+{
+  INFO() << "stopping";
+
+  accepting_ = false;
+
+  if (workers_.empty()) {
+    // Nothing runs the strands.
+    for (auto&& shard: shards_) {
+      close_shard(*shard);
+    }
+  }
+  else {
+    // The shards are closed by their strands, so each closes in parallel with the others, and
+    // nothing of the shard is touched by this thread.
+    std::vector<std::future<void>> closed;
+    for (auto&& shard: shards_) {
+      auto done = std::make_shared<std::promise<void>>();
+      closed.push_back(done->get_future());
+      post(shard->strand, [this, &shard = *shard, done]() {
+        close_shard(shard);
+        done->set_value();
+      });
+    }
+    for (auto&& done: closed) {
+      done.wait();
+    }
+  }
+
+  io_.stop();
+  for (auto&& io: contexts_) {
+    io->stop();
+  }
+
+  for (auto&& worker: workers_) {
+    worker.join();
+  }
+
+  workers_.clear();
+}
+
+void AsyncDnsClient::async_drain(std::chrono::steady_clock::time_point deadline, OnDrainedCallback on_drained_cb)
+{
+  INFO() << "draining";
+
+  accepting_ = false;
+
+  auto drain = std::make_shared<Drain>();
+  drain->cb = std::move(on_drained_cb);
+  drain->remaining = shards_.size();
+
+  for (auto&& shard: shards_) {
+    post(shard->strand, [this, &shard = *shard, drain, deadline]() {
+      // The queries submitted before still go out. Those that got past refuse_query() as the
+      // drain began must not: they may be counted in the load only after the shard is drained.
+      if (shard.n_submissions.load(std::memory_order_acquire) > 0) {
+        drain_submissions(shard);
+      }
+      shard.refusing = true;
+
+      shard.drain = drain;
+      if (shard.load.load(std::memory_order_relaxed) == 0) {
+        shard_drained(shard);
+        return;
+      }
+
+      shard.drain_timer.expires_at(deadline);
+      shard.drain_timer.async_wait(boost::asio::bind_executor(shard.strand, [this, &shard](auto err) {
+        if (err || !shard.drain) {
+          return;
+        }
+        WARN() << "drain: " << shard.load.load(std::memory_order_relaxed) << " queries of the shard left, cancelling";
+        shard.cancelling = true;
+        cancel_queries(shard);
+      }));
+    });
+  }
+}
+
+void AsyncDnsClient::shard_drained(Shard& shard)
+{
+  auto drain = std::move(shard.drain);
+  shard.drain_timer.cancel();
+
+  if (drain->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && drain->cb) {
+    INFO() << "drained";
+    drain->cb();
+  }
+}
+
+void AsyncDnsClient::cancel_queries(Shard& shard)
+{
+  // The queries in the ring are cancelled as they are registered.
+  if (shard.n_submissions.load(std::memory_order_acquire) > 0) {
+    drain_submissions(shard);
+  }
+
+  // All the queries registered and queued are in the wheel, the waiters hang on them.
+  shard.timeouts.clear([this, &shard](TimerWheel::Hook& hook) {
+    QueryPtr query(static_cast<Query*>(&hook));
+    if (!query->done) {
+      finish_query(shard, *query, RESULT_CANCELLED, {});
+    }
+  });
+  shard.pending.clear();
+}
+
+void AsyncDnsClient::close_shard(Shard& shard)
+{
+  shard.cancelling = true;
+  cancel_queries(shard);
+
+  shard.sends.clear();
+  shard.timeouts_timer.cancel();
+  shard.drain_timer.cancel();
+
+  boost::system::error_code err;
+  if (shard.uring) {
+    shard.uring->close();
+  }
+  shard.socket.close(err);
+  for (auto&& conn: shard.tcp) {
+    if (conn) {
+      tcp_close(*conn);
+    }
+  }
+}
+
+AsyncDnsClient::Stats AsyncDnsClient::stats() const
+{
+  Stats stats;
+
+  if (cache_) {
+    stats.cache_hits = cache_->hits();
+    stats.cache_misses = cache_->misses();
+  }
+  stats.cache_refreshes = refreshes_.load(std::memory_order_relaxed);
+
+  stats.nameservers.resize(nameservers_.size());
+  for (std::size_t i = 0; i < nameservers_.size(); ++i) {
+    stats.nameservers[i].endpoint = nameservers_[i];
+  }
+
+  for (auto&& shard: shards_) {
+    const auto& counters = shard->counters;
+    stats.queries += counters.queries.get();
+    stats.coalesced += counters.coalesced.get();
+    stats.sent += counters.sent.get();
+    stats.received += counters.received.get();
+    stats.timeouts += counters.timeouts.get();
+    stats.retransmissions += counters.retransmissions.get();
+    stats.send_errors += counters.send_errors.get();
+    stats.unknown_id += counters.unknown_id.get();
+    stats.unexpected_endpoint += counters.unexpected_endpoint.get();
+    stats.malformed += counters.malformed.get();
+    stats.truncated += counters.truncated.get();
+    stats.overloaded += counters.overloaded.get();
+    stats.stale_answers += counters.stale_answers.get();
+
+    for (std::size_t i = 0; i < nameservers_.size(); ++i) {
+      const auto& upstream = shard->upstreams[i];
+      stats.nameservers[i].sent += upstream.sent.get();
+      stats.nameservers[i].lost += upstream.lost.get();
+      stats.nameservers[i].rtt += upstream.rtt_histogram.snapshot();
+    }
+  }
+
+  return stats;
+}
+
+void AsyncDnsClient::Stats::write_prometheus(std::ostream& os, std::string_view prefix) const
+{
+  auto counter = [&os, prefix](const char* name, const char* help, std::uint64_t value) {
+    os << "# HELP " << prefix << "_" << name << " " << help << "\n"
+       << "# TYPE " << prefix << "_" << name << " counter\n"
+       << prefix << "_" << name << " " << value << "\n";
+  };
+
+  counter("queries_total", "Queries not answered by the cache.", queries);
+  counter("coalesced_total", "Queries joining a query in flight.", coalesced);
+  counter("cache_hits_total", "Queries answered by the cache.", cache_hits);
+  counter("cache_misses_total", "Queries not found in the cache.", cache_misses);
+  counter("cache_refreshes_total", "Queries refreshing a cache entry ahead of its expiry.", cache_refreshes);
+  counter("stale_answers_total", "Queries failed and answered by an expired cache entry.", stale_answers);
+  counter("sent_total", "Requests sent.", sent);
+  counter("received_total", "Responses received.", received);
+  counter("timeouts_total", "Queries timed out.", timeouts);
+  counter("retransmissions_total", "Requests retransmitted.", retransmissions);
+  counter("send_errors_total", "Requests failed to send.", send_errors);
+  counter("unknown_id_total", "Responses to no query in flight.", unknown_id);
+  counter("unexpected_endpoint_total", "Responses from other than a nameserver queried.", unexpected_endpoint);
+  counter("malformed_total", "Malformed responses.", malformed);
+  counter("truncated_total", "Truncated responses.", truncated);
+  counter("overloaded_total", "Queries refused as overloaded.", overloaded);
+
+  auto per_nameserver = [&](const char* name, const char* help, const char* type, auto&& write) {
+    os << "# HELP " << prefix << "_" << name << " " << help << "\n"
+       << "# TYPE " << prefix << "_" << name << " " << type << "\n";
+    for (auto&& nameserver: nameservers) {
+      std::ostringstream label;
+      label << "nameserver=\"" << nameserver.endpoint << "\"";
+      write(nameserver, label.str());
+    }
+  };
+
+  per_nameserver("nameserver_sent_total", "Requests sent to the nameserver.", "counter",
+                 [&](auto&& nameserver, auto&& label) {
+                   os << prefix << "_nameserver_sent_total{" << label << "} " << nameserver.sent << "\n";
+                 });
+  per_nameserver("nameserver_lost_total", "Requests not answered by the nameserver within the RTO.", "counter",
+                 [&](auto&& nameserver, auto&& label) {
+                   os << prefix << "_nameserver_lost_total{" << label << "} " << nameserver.lost << "\n";
+                 });
+
+  // The bucket bounds in microseconds.
+  static const std::uint64_t bounds[] = {
+      250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000};
+
+  per_nameserver("rtt_seconds", "Round-trip time of the nameserver.", "histogram",
+                 [&](auto&& nameserver, auto&& label) {
+                   for (auto bound: bounds) {
+                     os << prefix << "_rtt_seconds_bucket{" << label << ",le=\"" << bound / 1e6 << "\"} "
+                        << nameserver.rtt.count_up_to(bound) << "\n";
+                   }
+                   os << prefix << "_rtt_seconds_bucket{" << label << ",le=\"+Inf\"} " << nameserver.rtt.count << "\n"
+                      << prefix << "_rtt_seconds_sum{" << label << "} " << nameserver.rtt.sum / 1e6 << "\n"
+                      << prefix << "_rtt_seconds_count{" << label << "} " << nameserver.rtt.count << "\n";
+                 });
+}
+
+void AsyncDnsClient::async_query(std::string_view name, QueryType type, const OnFinishedCallback& on_finished_cb)
+{
+  async_query(name, type,
+      [on_finished_cb](QueryResult result, std::string_view name, QueryType type,
+                       const DnsResponseView& response) {
+        std::vector<std::pair<std::string, boost::asio::ip::address>> addrs;
+        std::vector<std::pair<std::string, std::string>> cnames;
+
+        for (auto&& rr: response.answers()) {
+          if (rr.type == ns_t_cname) {
+            cnames.emplace_back(rr.name.to_string(), rr.rdata_name().to_string());
+          }
+          else if (rr.type == ns_t_a || rr.type == ns_t_aaaa) {
+            auto addr = rr.address();
+            if (!addr.is_unspecified()) {
+              addrs.emplace_back(rr.name.to_string(), addr);
+            }
+          }
+        }
+
+        on_finished_cb(result, name, type, response.rcode(), std::move(addrs), std::move(cnames));
+      });
+}
+
+void AsyncDnsClient::async_query(std::string_view name, QueryType type, OnResponseCallback on_response_cb)
+{
+  if (refuse_query(name, type, on_response_cb)) {
+    return;
+  }
+  if (cache_ && query_cache(name, type, on_response_cb)) {
+    return;
+  }
+
+  auto& shard = *shards_[shard_index(name)];
+  auto query = make_query(shard, name, type, std::move(on_response_cb));
+
+  shard.load.fetch_add(1, std::memory_order_relaxed);
+  submit_query(shard, std::move(query));
+}
+
+bool AsyncDnsClient::try_async_query(std::string_view name, QueryType type, OnResponseCallback on_response_cb)
+{
+  if (refuse_query(name, type, on_response_cb) || (cache_ && query_cache(name, type, on_response_cb))) {
+    return true;
+  }
+
+  // The slot is reserved first, so that concurrent callers can't overshoot the capacity.
+  auto& shard = *shards_[shard_index(name)];
+  if (shard.load.fetch_add(1, std::memory_order_relaxed) >= capacity_) {
+    shard.load.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  auto query = make_query(shard, name, type, std::move(on_response_cb));
+
+  submit_query(shard, std::move(query));
+  return true;
+}
+
+AsyncDnsClient::PreparedQuery AsyncDnsClient::prepare(std::string_view name, QueryType type)
+{
+  auto key = DnsCache::key(name, type);
+
+  std::lock_guard<std::mutex> lock(prepared_mutex_);
+
+  auto& interned = prepared_[key];
+  if (auto t = interned.lock()) {
+    return PreparedQuery(std::move(t));
+  }
+
+  auto t = std::make_shared<PreparedQuery::Template>();
+  t->name.assign(name);
+  t->type = type;
+  t->hash = name_hash(name);
+  t->edns_offset = 0;
+  t->request_len = dns_encode_query(t->request.data(), t->request.size(), 0, name, type);
+  if (t->request_len == 0) {
+    prepared_.erase(key);
+    throw std::invalid_argument("invalid name: " + std::string(name));
+  }
+  if (edns_.udp_size > 0) {
+    auto len = dns_encode_opt(t->request.data(), t->request.size(), t->request_len, edns_);
+    if (len > 0) {
+      t->edns_offset = t->request_len;
+      t->request_len = len;
+    }
+  }
+  t->cache_key = std::move(key);
+  interned = t;
+
+  if (prepared_.size() >= prepared_sweep_at_) {
+    for (auto it = prepared_.begin(); it != prepared_.end();) {
+      it = it->second.expired() ? prepared_.erase(it) : std::next(it);
+    }
+    prepared_sweep_at_ = std::max<std::size_t>(2 * prepared_.size(), 64);
+  }
+
+  return PreparedQuery(std::move(t));
+}
+
+void AsyncDnsClient::async_query(const PreparedQuery& prepared, OnResponseCallback on_response_cb)
+{
+  if (refuse_query(prepared.name(), prepared.type(), on_response_cb)) {
+    return;
+  }
+  if (cache_ && query_cache(prepared, on_response_cb)) {
+    return;
+  }
+
+  auto& shard = *shards_[prepared.template_->hash % shards_.size()];
+  auto query = make_query(shard, prepared, std::move(on_response_cb));
+
+  shard.load.fetch_add(1, std::memory_order_relaxed);
+  submit_query(shard, std::move(query));
+}
+
+bool AsyncDnsClient::try_async_query(const PreparedQuery& prepared, OnResponseCallback on_response_cb)
+{
+  if (refuse_query(prepared.name(), prepared.type(), on_response_cb) ||
+      (cache_ && query_cache(prepared, on_response_cb))) {
+    return true;
+  }
+
+  auto& shard = *shards_[prepared.template_->hash % shards_.size()];
+  if (shard.load.fetch_add(1, std::memory_order_relaxed) >= capacity_) {
+    shard.load.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  auto query = make_query(shard, prepared, std::move(on_response_cb));
+
+  submit_query(shard, std::move(query));
+  return true;
+}
+
+void AsyncDnsClient::async_query_batch(
+        const std::string_view* names, std::size_t n_names,
+        QueryType type,
+        OnResponseCallback on_response_cb,
+        OnBatchFinishedCallback on_batch_finished_cb)
+{
+  // The state shared by all the queries of the batch.
+  struct Batch
+  {
+    OnResponseCallback cb;
+    OnBatchFinishedCallback finished_cb;
+    std::atomic<std::size_t> remaining;
+  };
+
+  if (n_names == 0) {
+    if (on_batch_finished_cb) {
+      post(io_, std::move(on_batch_finished_cb));
+    }
+    return;
+  }
+
+  auto batch = std::make_shared<Batch>();
+  batch->cb = std::move(on_response_cb);
+  batch->finished_cb = std::move(on_batch_finished_cb);
+  batch->remaining = n_names;
+
+  // Encode the whole batch first and hand it over to each shard at once.
+  std::vector<std::vector<QueryPtr>> shard_queries(shards_.size());
+
+  for (std::size_t i = 0; i < n_names; ++i) {
+    OnResponseCallback cb =
+        [batch](QueryResult result, std::string_view name, QueryType type, const DnsResponseView& response) {
+          batch->cb(result, name, type, response);
+          if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && batch->finished_cb) {
+            batch->finished_cb();
+          }
+        };
+
+    if (refuse_query(names[i], type, cb) || (cache_ && query_cache(names[i], type, cb))) {
+      continue;
+    }
+
+    auto index = shard_index(names[i]);
+    shard_queries[index].push_back(make_query(*shards_[index], names[i], type, std::move(cb)));
+    shards_[index]->load.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    if (shard_queries[i].empty()) {
+      continue;
+    }
+
+    auto& shard = *shards_[i];
+    post(shard.strand, [this, &shard, queries = std::move(shard_queries[i])]() {
+      for (auto&& query: queries) {
+        register_query(shard, query);
+      }
+    });
+  }
+}
+
+void AsyncDnsClient::async_query_addresses(std::string_view name, OnAddressesCallback on_addresses_cb)
+{
+  // The state shared by the two queries. The response coming first is copied, so that both can be
+  // passed to the callback at once. The queries land on the same shard, but either may be
+  // answered by the cache right away, hence the mutex.
+  struct Pair
+  {
+    OnAddressesCallback cb;
+    std::mutex mutex;
+    bool first_done = false;
+    QueryResult first_result = RESULT_ERROR;
+    DnsResponse first_response;
+  };
+
+  auto pair = std::make_shared<Pair>();
+  pair->cb = std::move(on_addresses_cb);
+
+  auto on_response = [pair](QueryResult result, std::string_view name, QueryType type,
+                            const DnsResponseView& response) {
+    std::unique_lock<std::mutex> lock(pair->mutex);
+
+    if (!pair->first_done) {
+      pair->first_done = true;
+      pair->first_result = result;
+      pair->first_response = DnsResponse(response);
+      return;
+    }
+    lock.unlock();
+
+    auto first = pair->first_response.view();
+    auto merged = result == RESULT_SUCCESS ? result : pair->first_result;
+
+    if (type == TYPE_A) {
+      pair->cb(merged, name, response, first);
+    }
+    else {
+      pair->cb(merged, name, first, response);
+    }
+  };
+
+  async_query(name, TYPE_A, on_response);
+  async_query(name, TYPE_AAAA, std::move(on_response));
+}
+
+AsyncDnsClient::QueryPtr AsyncDnsClient::make_query(
+        Shard& shard,
+        std::string_view name, QueryType type,
+        OnResponseCallback cb)
+{
+  auto query = shard.pool->acquire();
+  query->assign(name, type, std::move(cb));
+
+  //
+  // Construct the binary DNS request. The ID is patched in once the query is registered.
+  //
+  query->request_len = dns_encode_query(
+      query->request.data(), query->request.size(),
+      0,
+      query->name, query->type);
+  if (query->request_len == 0) {
+    ERR() << "dns_encode_query: " << *query << ": invalid name: " << query->name;
+  }
+  else if (edns_.udp_size > 0) {
+    auto len = dns_encode_opt(query->request.data(), query->request.size(), query->request_len, edns_);
+    if (len > 0) {
+      query->edns_offset = query->request_len;
+      query->request_len = len;
+    }
+  }
+
+  return query;
+}
+
+AsyncDnsClient::QueryPtr AsyncDnsClient::make_query(
+        Shard& shard,
+        const PreparedQuery& prepared,
+        OnResponseCallback cb)
+{
+  auto query = shard.pool->acquire();
+  query->assign(prepared.template_, std::move(cb));
+  return query;
+}
+
+void AsyncDnsClient::submit_query(Shard& shard, QueryPtr query)
+{
+  if (!shard.submissions.try_push(std::move(query))) {
+    // The strand is lagging far behind.
+    post(shard.strand, [this, &shard, query = std::move(query)]() { register_query(shard, query); });
+    return;
+  }
+
+  // The strand already woken up by a previous submission drains this one too.
+  if (shard.n_submissions.fetch_add(1, std::memory_order_acq_rel) == 0) {
+    post(shard.strand, [this, &shard]() { drain_submissions(shard); });
+  }
+}
+
+void AsyncDnsClient::drain_submissions(Shard& shard)
+{
+  // Only the submissions counted are taken, the ones pushed meanwhile are left for the next round
+  // (their submitters either see the count non-zero, or post the next round themselves).
+  auto n = shard.n_submissions.load(std::memory_order_acquire);
+
+  std::size_t drained = 0;
+  QueryPtr query;
+  while (drained < n && shard.submissions.try_pop(query)) {
+    register_query(shard, query);
+    ++drained;
+  }
+  query.reset();
+
+  // Some may be still being pushed, or submitted by the callbacks called meanwhile.
+  if (shard.n_submissions.fetch_sub(drained, std::memory_order_acq_rel) != drained) {
+    post(shard.strand, [this, &shard]() { drain_submissions(shard); });
+  }
+}
+
+void AsyncDnsClient::register_query(Shard& shard, const QueryPtr& query)
+{
+  if (shard.cancelling || shard.refusing) {
+    query->cb(RESULT_CANCELLED, query->name, query->type, {});
+    done_query(shard, *query);
+    return;
+  }
+
+  if (query->request_len == 0) {
+    // The request could not be constructed.
+    query->cb(RESULT_ERROR, query->name, query->type, {});
+    done_query(shard, *query);
+    return;
+  }
+
+  shard.counters.queries.add();
+
+  if (join_inflight(shard, query)) {
+    shard.counters.coalesced.add();
+    return;
+  }
+
+  dispatch_query(shard, query);
+}
+
+void AsyncDnsClient::dispatch_query(Shard& shard, const QueryPtr& query)
+{
+  auto now = TimerWheel::Clock::now();
+
+  query->n_attempts = 0;
+  query->retransmissions = 0;
+  query->deadline = now + std::chrono::milliseconds(timeout_ms_);
+  query->retransmit_at = TimerWheel::Clock::time_point::max();
+  query->hedge_at = TimerWheel::Clock::time_point::max();
+
+  // The queries finished while queued are dropped lazily.
+  while (!shard.pending.empty() && shard.pending.front()->done) {
+    shard.pending.pop_front();
+  }
+
+  // The queued queries go first.
+  if (shard.n_queued == 0 && can_dispatch(shard)) {
+    start_query(shard, query, now);
+    return;
+  }
+
+  // Not counting those finished while queued, they are still in the queue.
+  if (shard.n_queued >= max_queued_) {
+    DBG() << "query " << *query << ": overloaded";
+    shard.counters.overloaded.add();
+    finish_query(shard, *query, RESULT_OVERLOADED, {});
+    return;
+  }
+
+  // Wait for a query in flight to finish, but not longer than the timeout.
+  DBG() << "query " << *query << ": queued";
+  shard.pending.push_back(query);
+  query->queued = true;
+  ++shard.n_queued;
+  schedule_query(shard, *query);
+}
+
+bool AsyncDnsClient::can_dispatch(const Shard& shard) const
+{
+  if (shard.queries.size() >= max_inflight_) {
+    // Also when all the IDs are in use.
+    return false;
+  }
+  if (max_inflight_per_upstream_ == 0) {
+    return true;
+  }
+  return std::any_of(shard.upstreams.begin(), shard.upstreams.end(),
+                     [this](auto&& upstream) { return upstream.inflight < max_inflight_per_upstream_; });
+}
+
+void AsyncDnsClient::start_query(Shard& shard, const QueryPtr& query, TimerWheel::Clock::time_point now)
+{
+  // Register the query in the table under a fresh random ID. From now on it must be unregistered
+  // after its callback is called.
+  auto key = shard.queries.insert(query);
+
+  query->id = key->id;
+  query->generation = key->generation;
+  dns_put16(query->id, query->request.data());
+
+  auto upstream = select_upstream(shard, now, *query);
+
+  DBG() << "query " << *query
+        << ": name=" << query->name
+        << ", type=" << query->type
+        << ", nameserver=" << nameservers_[upstream];
+
+  send_attempt(shard, query, upstream, now);
+
+  const auto& state = shard.upstreams[upstream];
+  if (max_retransmissions_ > 0) {
+    query->retransmit_at = now + rto(state);
+  }
+  if (hedge_ && nameservers_.size() > 1) {
+    // Until there are enough samples for the percentile to mean anything, hedge after the RTO.
+    query->hedge_at = now + (state.n_samples >= Upstream::N_SAMPLES / 4 ? state.p95 : rto(state));
+  }
+
+  schedule_query(shard, *query);
+}
+
+bool AsyncDnsClient::send_attempt(
+        Shard& shard, const QueryPtr& query, std::size_t upstream, TimerWheel::Clock::time_point now)
+{
+  // Any of the retransmissions, the hedge and the retry without EDNS may take the last attempt.
+  if (query->n_attempts == MAX_ATTEMPTS) {
+    DBG() << "query " << *query << ": no attempts left";
+    return false;
+  }
+
+  if (!query->tried(upstream)) {
+    ++shard.upstreams[upstream].inflight;
+  }
+  query->attempts[query->n_attempts] = {upstream, now};
+
+  // Sends are batched: every attempt made until the flush gets to run goes out with it.
+  shard.sends.push_back({query, query->n_attempts++});
+  if (!shard.sends_scheduled) {
+    shard.sends_scheduled = true;
+    post(shard.strand, [this, &shard]() { flush_sends(shard); });
+  }
+  return true;
+}
+
+void AsyncDnsClient::schedule_query(Shard& shard, Query& query)
+{
+  // A query has a single timer for whatever comes first.
+  shard.timeouts.schedule(query, std::min({query.deadline, query.retransmit_at, query.hedge_at}));
+  if (!shard.timeouts_armed) {
+    arm_timeouts(shard);
+  }
+}
+
+void AsyncDnsClient::handle_query_timer(Shard& shard, const QueryPtr& query, TimerWheel::Clock::time_point now)
+{
+  if (now >= query->deadline) {
+    DBG() << "query " << *query << " timeouted";
+    shard.counters.timeouts.add();
+    if (query->n_attempts > 0) {
+      record_timeout(shard, query->attempts[query->n_attempts - 1].upstream, now);
+    }
+    finish_query(shard, *query, RESULT_TIMEOUT, {});
+    return;
+  }
+
+  if (now >= query->hedge_at) {
+    query->hedge_at = TimerWheel::Clock::time_point::max();
+
+    auto upstream = select_upstream(shard, now, *query, true);
+    if (upstream != nameservers_.size() && send_attempt(shard, query, upstream, now)) {
+      DBG() << "query " << *query << ": hedged to " << nameservers_[upstream];
+    }
+  }
+
+  if (now >= query->retransmit_at && query->n_attempts == MAX_ATTEMPTS) {
+    // The attempts left when the retransmission was scheduled were taken meanwhile (by the hedge
+    // or the retry without EDNS).
+    query->retransmit_at = TimerWheel::Clock::time_point::max();
+  }
+
+  if (now >= query->retransmit_at) {
+    // The last attempt is taken for lost. As that pushes the RTT of its nameserver up, the
+    // retransmission may go to another one.
+    record_timeout(shard, query->attempts[query->n_attempts - 1].upstream, now);
+
+    auto upstream = select_upstream(shard, now, *query);
+    ++query->retransmissions;
+    shard.counters.retransmissions.add();
+
+    DBG() << "query " << *query << ": retransmission " << query->retransmissions
+          << " to " << nameservers_[upstream];
+    send_attempt(shard, query, upstream, now);
+
+    query->retransmit_at =
+        query->retransmissions < max_retransmissions_ && query->n_attempts < MAX_ATTEMPTS ?
+            now + rto(shard.upstreams[upstream], query->retransmissions) :
+            TimerWheel::Clock::time_point::max();
+  }
+
+  schedule_query(shard, *query);
+}
+
+void AsyncDnsClient::flush_sends(Shard& shard)
+{
+  shard.sends_scheduled = false;
+
+  while (!shard.sends.empty()) {
+    // Queries may time out while waiting for the socket to become writable. Their IDs may be
+    // reused already, so they must not be sent.
+    shard.sends.erase(
+        std::remove_if(shard.sends.begin(), shard.sends.end(), [](auto&& send) { return send.query->done; }),
+        shard.sends.end());
+
+    auto now = TimerWheel::Clock::now();
+
+    shard.datagrams.clear();
+    for (auto&& send: shard.sends) {
+      auto& attempt = send.query->attempts[send.attempt];
+      shard.datagrams.push_back({send.query->request.data(), send.query->request_len,
+                                 &nameservers_[attempt.upstream]});
+      attempt.sent = now;
+    }
+
+    boost::system::error_code err;
+    auto sent = shard.uring ?
+        shard.uring->send(shard.datagrams.data(), shard.datagrams.size(), err) :
+        udp_send_batch(shard.socket, shard.datagrams.data(), shard.datagrams.size(), err);
+
+    shard.counters.sent.add(sent);
+    for (std::size_t i = 0; i < sent; ++i) {
+      shard.upstreams[shard.sends[i].query->attempts[shard.sends[i].attempt].upstream].sent.add();
+    }
+
+    if (sent == shard.sends.size()) {
+      shard.sends.clear();
+      break;
+    }
+
+    if (err == boost::asio::error::would_block && shard.uring) {
+      // All the sends of the ring are in flight; the rest goes once some complete, see
+      // receive_uring().
+      shard.sends.erase(shard.sends.begin(), shard.sends.begin() + sent);
+      shard.sends_scheduled = true;
+      return;
+    }
+
+    if (err == boost::asio::error::would_block) {
+      // Wait for the socket buffer to drain.
+      shard.sends.erase(shard.sends.begin(), shard.sends.begin() + sent);
+      shard.sends_scheduled = true;
+      shard.socket.async_wait(
+          boost::asio::ip::udp::socket::wait_write,
+          boost::asio::bind_executor(shard.strand, [this, &shard](auto err) {
+            if (err) {
+              if (err != boost::asio::error::operation_aborted) {
+                ERR() << "async_wait: " << err.message();
+              }
+              shard.sends_scheduled = false;
+              return;
+            }
+            flush_sends(shard);
+          }));
+      return;
+    }
+
+    // The query after the last one sent failed; the rest gets another try.
+    auto query = std::move(shard.sends[sent].query);
+    shard.sends.erase(shard.sends.begin(), shard.sends.begin() + sent + 1);
+
+    ERR() << "sendmmsg: " << *query << ": " << err.message();
+    shard.counters.send_errors.add();
+
+    if (!query->done) {
+      finish_query(shard, *query, RESULT_ERROR, {});
+    }
+  }
+}
+
+void AsyncDnsClient::finish_query(Shard& shard, Query& query, QueryResult result, const DnsResponseView& response)
+{
+  tcp_detach(shard, query);
+
+  // Lookups of the name from now on go out on their own.
+  remove_inflight(shard, query);
+
+  // Rather than failing, answer by the expired entry (RFC 8767), its lowest TTL at STALE_TTL.
+  std::shared_ptr<const DnsCache::Entry> stale;
+  if (serve_stale_ && result != RESULT_CANCELLED &&
+      (result != RESULT_SUCCESS || (!response.empty() && response.rcode() == ns_r_servfail)) &&
+      (stale = stale_entry(query))) {
+    DBG() << "query " << query << ": " << result << ", serving stale";
+    shard.counters.stale_answers.add();
+    auto view = DnsResponseView(stale->message, stale->ttl - std::min(stale->ttl, STALE_TTL));
+    finish_callbacks(shard, query, RESULT_SUCCESS, view);
+    return;
+  }
+
+  finish_callbacks(shard, query, result, response);
+}
+
+void AsyncDnsClient::finish_callbacks(Shard& shard, Query& query, QueryResult result, const DnsResponseView& response)
+{
+  query.cb(result, query.name, query.type, response);
+  done_query(shard, query);
+
+  // The waiters get the same response, under their own spelling of the name.
+  for (auto waiter = std::move(query.waiters); waiter; waiter = std::move(waiter->next_waiter)) {
+    waiter->cb(result, waiter->name, waiter->type, response);
+    done_query(shard, *waiter);
+  }
+
+  unregister_query(shard, query);
+}
+
+void AsyncDnsClient::done_query(Shard& shard, Query& query)
+{
+  query.done = true;
+  if (shard.load.fetch_sub(1, std::memory_order_relaxed) == 1 && shard.drain) {
+    shard_drained(shard);
+  }
+}
+
+void AsyncDnsClient::unregister_query(Shard& shard, Query& query)
+{
+  // Also a query finished while queued.
+  shard.timeouts.cancel(query);
+
+  if (query.queued) {
+    query.queued = false;
+    --shard.n_queued;
+  }
+
+  if (!shard.queries.erase(query.id, query.generation)) {
+    return;
+  }
+
+  for (std::size_t i = 0; i < query.n_attempts; ++i) {
+    auto upstream = query.attempts[i].upstream;
+    if (std::none_of(query.attempts.begin(), query.attempts.begin() + i,
+                     [upstream](auto&& attempt) { return attempt.upstream == upstream; })) {
+      --shard.upstreams[upstream].inflight;
+    }
+  }
+
+  // The released capacity is handed over to the queued queries.
+  while (!shard.cancelling && !shard.pending.empty() && can_dispatch(shard)) {
+    auto next = std::move(shard.pending.front());
+    shard.pending.pop_front();
+    if (!next->done) {
+      next->queued = false;
+      --shard.n_queued;
+      start_query(shard, next, TimerWheel::Clock::now());
+    }
+  }
+}
+
+std::size_t AsyncDnsClient::select_upstream(
+        Shard& shard, TimerWheel::Clock::time_point now, const Query& query, bool untried)
+{
+  auto& upstreams = shard.upstreams;
+
+  // A nameserver the query went to already does not take any more of the capacity.
+  auto eligible = [&](std::size_t upstream) {
+    if (query.tried(upstream)) {
+      return !untried;
+    }
+    return max_inflight_per_upstream_ == 0 || upstreams[upstream].inflight < max_inflight_per_upstream_;
+  };
+
+  // The best score of the nameservers up or, if all are down, the one to come up first. The score
+  // is the smoothed RTT, but doubled by every timeout and decaying while not selected.
+  auto best = upstreams.size();
+  for (std::size_t i = 0; i < upstreams.size(); ++i) {
+    if (!eligible(i)) {
+      continue;
+    }
+    if (best == upstreams.size()) {
+      best = i;
+      continue;
+    }
+
+    bool up = upstreams[i].down_until <= now;
+    bool best_up = upstreams[best].down_until <= now;
+
+    if (up != best_up ? up :
+        up ? upstreams[i].score < upstreams[best].score : upstreams[i].down_until < upstreams[best].down_until) {
+      best = i;
+    }
+  }
+
+  // Like in BIND, the scores of the nameservers not selected decay so that they get another chance.
+  for (std::size_t i = 0; i < upstreams.size(); ++i) {
+    if (i != best) {
+      upstreams[i].score -= upstreams[i].score / 50;
+    }
+  }
+
+  return best;
+}
+
+std::chrono::microseconds AsyncDnsClient::rto(const Upstream& upstream, unsigned int retransmissions) const
+{
+  auto rto = upstream.srtt.count() == 0 ? initial_rto_ : upstream.srtt + 4 * upstream.rttvar;
+  rto = std::clamp(rto, min_rto_, max_rto_);
+
+  // Exponential backoff, capped.
+  for (unsigned int i = 0; i < retransmissions && rto < max_rto_; ++i) {
+    rto *= 2;
+  }
+  return std::min(rto, max_rto_);
+}
+
+void AsyncDnsClient::record_timeout(Shard& shard, std::size_t upstream, TimerWheel::Clock::time_point now)
+{
+  auto& state = shard.upstreams[upstream];
+  state.lost.add();
+
+  // The nameserver loses the preference before it is considered down. The RTO is left alone, the
+  // retransmissions back off on their own.
+  state.score = std::min(std::max(2 * state.score, rto(state)), MAX_SCORE);
+
+  if (++state.timeouts >= max_consecutive_timeouts_) {
+    if (state.down_until <= now) {
+      ERR() << "nameserver " << nameservers_[upstream] << " down: "
+            << state.timeouts << " consecutive timeouts";
+    }
+    state.down_until = now + std::chrono::milliseconds(down_time_ms_);
+  }
+}
+
+void AsyncDnsClient::Upstream::add_rtt(std::chrono::microseconds rtt)
+{
+  // RFC 6298
+  if (srtt.count() == 0) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  }
+  else {
+    rttvar = (3 * rttvar + (srtt > rtt ? srtt - rtt : rtt - srtt)) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+  score = srtt;
+  timeouts = 0;
+  rtt_histogram.record(rtt.count());
+
+  samples[n_samples++ % N_SAMPLES] = std::min<std::int64_t>(rtt.count(), UINT32_MAX);
+
+  // Refresh the percentile every few samples only.
+  if (n_samples % (N_SAMPLES / 4) == 0) {
+    auto recent = samples;
+    auto n = std::min(n_samples, N_SAMPLES);
+    auto nth = recent.begin() + n * 95 / 100;
+    std::nth_element(recent.begin(), nth, recent.begin() + n);
+    p95 = std::chrono::microseconds(*nth);
+  }
+}
+
+AsyncDnsClient::Query*& AsyncDnsClient::inflight_bucket(Shard& shard, const Query& query)
+{
+  // The low bits of the hash pick the shard, so take the high ones (Fibonacci hashing).
+  std::uint32_t hash = (query.hash ^ query.type) * 2654435769u;
+  return shard.inflight[hash >> (32 - INFLIGHT_BUCKET_BITS)];
+}
+
+bool AsyncDnsClient::join_inflight(Shard& shard, const QueryPtr& query)
+{
+  auto& bucket = inflight_bucket(shard, *query);
+  const auto name = without_trailing_dot(query->name);
+
+  for (auto* other = bucket; other; other = other->inflight_next) {
+    const auto other_name = without_trailing_dot(other->name);
+    if ((other->prepared && other->prepared == query->prepared) ||
+        (other->hash == query->hash &&
+         other->type == query->type &&
+         std::equal(other_name.begin(), other_name.end(), name.begin(), name.end(),
+                    [](unsigned char a, unsigned char b) { return std::tolower(a) == std::tolower(b); }))) {
+      DBG() << "query " << *other << ": joined by " << query->name;
+      query->next_waiter = std::move(other->waiters);
+      other->waiters = query;
+      return true;
+    }
+  }
+
+  query->inflight = true;
+  query->inflight_next = bucket;
+  bucket = query.get();
+  return false;
+}
+
+void AsyncDnsClient::remove_inflight(Shard& shard, Query& query)
+{
+  if (!query.inflight) {
+    return;
+  }
+  query.inflight = false;
+
+  auto* link = &inflight_bucket(shard, query);
+  while (*link != &query) {
+    link = &(*link)->inflight_next;
+  }
+  *link = query.inflight_next;
+  query.inflight_next = nullptr;
+}
+
+void AsyncDnsClient::arm_timeouts(Shard& shard)
+{
+  // The wheel is driven by a single timer ticking while there is anything to time out.
+  shard.timeouts_armed = true;
+  shard.timeouts_timer.expires_after(shard.timeouts.resolution());
+  shard.timeouts_timer.async_wait(
+      boost::asio::bind_executor(shard.strand, [this, &shard](auto err) {
+        if (err) {
+          if (err != boost::asio::error::operation_aborted) {
+            ERR() << "async_wait: " << err.message();
+          }
+          shard.timeouts_armed = false;
+          return;
+        }
+
+        auto now = TimerWheel::Clock::now();
+        shard.timeouts.expire(now, [this, &shard, now](TimerWheel::Hook& hook) {
+          handle_query_timer(shard, QueryPtr(static_cast<Query*>(&hook)), now);
+        });
+
+        if (shard.timeouts.empty()) {
+          shard.timeouts_armed = false;
+          return;
+        }
+        arm_timeouts(shard);
+      }));
+}
+
+AsyncDnsClient::Query::Query(Shard& shard, QueryPool& pool)
+  : shard(shard),
+    pool(pool),
+    refs(0),
+    type(TYPE_A),
+    done(false),
+    queued(false),
+    request_len(0),
+    edns_offset(0),
+    id(0),
+    generation(0),
+    hash(0),
+    inflight(false),
+    inflight_next(nullptr),
+    n_attempts(0),
+    retransmissions(0),
+    tcp(nullptr),
+    tcp_index(0)
+{}
+
+void AsyncDnsClient::Query::assign(std::string_view name, QueryType type, OnResponseCallback cb)
+{
+  if (name.size() <= name_buf.size()) {
+    this->name = std::string_view(name_buf.data(), name.copy(name_buf.data(), name.size()));
+  }
+  else {
+    name_long.assign(name);
+    this->name = name_long;
   }
 
-  ~ResStateWrapper() {
-    if (initialized) {
-      res_nclose(&res);
-    }
+  this->type = type;
+  this->cb = std::move(cb);
+  done = false;
+  queued = false;
+  request_len = 0;
+  edns_offset = 0;
+  id = 0;
+  generation = 0;
+  hash = name_hash(this->name);
+  n_attempts = 0;
+  tcp = nullptr;
+}
+
+void AsyncDnsClient::Query::assign(
+        const std::shared_ptr<const PreparedQuery::Template>& prepared, OnResponseCallback cb)
+{
+  this->prepared = prepared;
+  name = prepared->name;
+  type = prepared->type;
+  this->cb = std::move(cb);
+  done = false;
+  queued = false;
+  std::memcpy(request.data(), prepared->request.data(), prepared->request_len);
+  request_len = prepared->request_len;
+  edns_offset = prepared->edns_offset;
+  id = 0;
+  generation = 0;
+  hash = prepared->hash;
+  n_attempts = 0;
+  tcp = nullptr;
+}
+
+bool AsyncDnsClient::Query::tried(std::size_t upstream) const
+{
+  return std::any_of(attempts.begin(), attempts.begin() + n_attempts,
+                     [upstream](auto&& attempt) { return attempt.upstream == upstream; });
+}
+
+AsyncDnsClient::QueryPtr AsyncDnsClient::QueryPool::acquire()
+{
+  Query* query;
+  if (free_.try_pop(query)) {
+    return QueryPtr(query);
   }
-};
 
-}  // namespace
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return QueryPtr(new Query(shard_, *this));
+}
 
+void AsyncDnsClient::QueryPool::release(Query* query)
+{
+  // Destroy whatever the callback captured right away. The waiters are left behind only by
+  // queries not finished, e.g. on shutdown; the chain may be long, so no recursion.
+  query->cb = nullptr;
+  query->prepared = nullptr;
+  for (auto waiter = std::move(query->waiters); waiter; waiter = std::move(waiter->next_waiter)) {}
 
-AsyncDnsClient::AsyncDnsClient(
-        std::string_view ns_ip, unsigned short ns_port,
-        std::size_t n_workers,
-        unsigned int timeout_ms)
-  : nameserver_(boost::asio::ip::make_address(ns_ip), ns_port),
-    n_workers_(n_workers),
-    timeout_ms_(timeout_ms),
-    io_guard_(io_.get_executor()),
-    io_strand_(io_),
-    socket_(io_, nameserver_.protocol())
-{}
+  if (orphaned_ || !free_.try_push(std::move(query))) {
+    destroy(query);
+  }
+}
 
-void AsyncDnsClient::start()
+void AsyncDnsClient::QueryPool::orphan()
 {
-  INFO() << "starting";
+  orphaned_ = true;
 
-  for (std::size_t i = 0; i < n_workers_; ++i) {
-    workers_.emplace_back([this]() { io_.run(); });
+  // The last of the queries being destroyed destroys the pool, so the pool holds one of its own
+  // meanwhile.
+  size_.fetch_add(1, std::memory_order_relaxed);
+  Query* query;
+  while (free_.try_pop(query)) {
+    destroy(query);
   }
+  destroy(nullptr);
+}
 
-  post(io_strand_, [this]() { start_receiving(); });
+void AsyncDnsClient::QueryPool::destroy(Query* query)
+{
+  delete query;
+  if (size_.fetch_sub(1, std::memory_order_acq_rel) == 1 && orphaned_) {
+    delete this;
+  }
 }
 
-void AsyncDnsClient::stop()
+AsyncDnsClient::Shard::Shard(
+        boost::asio::io_context& io,
+        const boost::asio::ip::udp::endpoint& nameserver,
+        std::size_t n_upstreams,
+        std::size_t receive_size)
+  : strand(io),
+    pool(new QueryPool(*this)),
+    socket(io, nameserver.protocol()),
+    load(0),
+    submissions(SUBMISSION_RING_SIZE),
+    n_submissions(0),
+    n_queued(0),
+    sends_scheduled(false),
+    receives(RECEIVE_BATCH, receive_size),
+    timeouts_timer(io),
+    timeouts_armed(false),
+    drain_timer(io),
+    cancelling(false),
+    refusing(false),
+    inflight(std::size_t(1) << INFLIGHT_BUCKET_BITS),
+    upstreams(n_upstreams),
+    tcp(n_upstreams)
 {
-  INFO() << "stopping";
+  socket.non_blocking(true);
+}
 
-  socket_.close();
-  io_.stop();
+AsyncDnsClient::TcpConnection::TcpConnection(boost::asio::io_context& io, std::size_t upstream)
+  : upstream(upstream),
+    socket(io),
+    idle_timer(io),
+    generation(0),
+    connecting(false),
+    connected(false),
+    answered(false),
+    writing(false),
+    buffer(NS_INT16SZ + 65535),
+    buffered(0)
+{}
 
-  for (auto&& worker: workers_) {
-    worker.join();
+bool AsyncDnsClient::refuse_query(std::string_view name, QueryType type, OnResponseCallback& cb)
+{
+  if (accepting_.load(std::memory_order_relaxed)) {
+    return false;
   }
+  cb(RESULT_CANCELLED, name, type, {});
+  return true;
+}
 
-  workers_.clear();
+bool AsyncDnsClient::query_cache(std::string_view name, QueryType type, OnResponseCallback& cb)
+{
+  auto now = DnsCache::Clock::now();
+
+  auto entry = cache_->lookup(name, type, now);
+  if (!entry) {
+    return false;
+  }
+
+  DBG() << "cache hit: name=" << name << ", type=" << type;
+  cb(RESULT_SUCCESS, name, type, DnsResponseView(entry->message, entry->age(now)));
+
+  if (refresh_due(*entry, now)) {
+    auto& shard = *shards_[shard_index(name)];
+    submit_refresh(shard, make_query(shard, name, type, refresh_done(entry)));
+  }
+  return true;
 }
 
-void AsyncDnsClient::async_query(std::string_view name, QueryType type, const OnFinishedCallback& on_finished_cb)
+bool AsyncDnsClient::query_cache(const PreparedQuery& prepared, OnResponseCallback& cb)
 {
-  auto query = std::make_shared<Query>(io_strand_, name, type, on_finished_cb);
+  auto now = DnsCache::Clock::now();
+
+  auto entry = cache_->lookup(prepared.template_->cache_key, now);
+  if (!entry) {
+    return false;
+  }
 
-  post(io_, [this, query]() {
-    //
-    // Construct the binary DNS request.
-    //
+  DBG() << "cache hit: name=" << prepared.name() << ", type=" << prepared.type();
+  cb(RESULT_SUCCESS, prepared.name(), prepared.type(), DnsResponseView(entry->message, entry->age(now)));
 
-    thread_local struct ResStateWrapper res;
-    if (!res.initialized)
-    {
-      ERR() << "res_ninit error: " << *query << ": " << hstrerror(res.get()->res_h_errno);
-      query->cb(RESULT_ERROR, query->name, query->type, {}, {}, {});
-      query->done = true;
-      return;
-    }
+  if (refresh_due(*entry, now)) {
+    auto& shard = *shards_[prepared.template_->hash % shards_.size()];
+    submit_refresh(shard, make_query(shard, prepared, refresh_done(entry)));
+  }
+  return true;
+}
 
-    int req_len = res_nmkquery(
-        res.get(),
-        ns_o_query,
-        query->name.c_str(), ns_c_in, (query->type == TYPE_A ? ns_t_a : ns_t_aaaa),
-        nullptr, 0,
-        nullptr,
-        query->request.data(), query->request.size());
-    if (req_len < 0) {
-      ERR() << "res_nmkquery: " << *query << ": " << hstrerror(res.get()->res_h_errno);
-      query->cb(RESULT_ERROR, query->name, query->type, {}, {}, {});
-      query->done = true;
-      return;
-    }
+bool AsyncDnsClient::refresh_due(const DnsCache::Entry& entry, DnsCache::Clock::time_point now) const
+{
+  if (refresh_ahead_ == 0 ||
+      entry.hits.load(std::memory_order_relaxed) < refresh_min_hits_ ||
+      (entry.expires - now) * 100 > std::chrono::seconds(entry.ttl) * refresh_ahead_) {
+    return false;
+  }
+  // One refresh at a time.
+  return !entry.refreshing.exchange(true, std::memory_order_relaxed);
+}
 
-    query->request.resize(req_len);
-    query->id = ns_get16(query->request.data());
-
-    DBG() << "query " << *query
-          << ": name=" << query->name
-          << ", type=" << query->type;
-
-    post(io_strand_,
-        [this, query]() {
-          // Register the query in the map. From now on it must be unregistered after its callback
-          // is called.
-          queries_[query->id] = query;
-
-          query->timer.expires_after(std::chrono::milliseconds(timeout_ms_));
-          query->timer.async_wait(
-              boost::asio::bind_executor(io_strand_, [this, query](auto err) {
-                if (!err && !query->done) {
-                  DBG() << "query " << *query << " timeouted";
-                  query->cb(RESULT_TIMEOUT, query->name, query->type, {}, {}, {});
-                  query->done = true;
-                  queries_.erase(query->id);
-                }
-                else if (err != boost::asio::error::operation_aborted) {
-                  ERR() << "async_wait: " << *query << ": " << err.message();
-                }
-              }));
-
-          socket_.async_send_to(
-              boost::asio::buffer(query->request),
-              nameserver_,
-              0,
-              boost::asio::bind_executor(io_strand_, [this, query](auto err, auto written) {
-                if (err) {
-                  ERR() << "async_send_to: " << *query << ": " << err.message();
-
-                  if (!query->done) {
-                    query->timer.cancel();
-                    query->cb(RESULT_ERROR, query->name, query->type, {}, {}, {});
-                    query->done = true;
-                    queries_.erase(query->id);
-                  }
-                }
-              }));
-        });
+AsyncDnsClient::OnResponseCallback AsyncDnsClient::refresh_done(std::shared_ptr<const DnsCache::Entry> entry)
+{
+  // Succeeded, the entry is replaced already; failed, it may be refreshed again.
+  return OnResponseCallback([entry = std::move(entry)](QueryResult, std::string_view, QueryType, const DnsResponseView&) {
+    entry->refreshing.store(false, std::memory_order_relaxed);
   });
 }
 
-AsyncDnsClient::Query::Query(
-        boost::asio::io_context::strand& strand,
-        std::string_view name, QueryType type,
-        OnFinishedCallback cb)
-  : name(name),
-    type(type),
-    cb(cb),
-    timer(strand.context()),
-    done(false),
-    request(PACKETSZ),
-    id(0)
-{}
+void AsyncDnsClient::submit_refresh(Shard& shard, QueryPtr query)
+{
+  // Not admitted beyond the capacity, as it is no caller's query.
+  if (shard.load.fetch_add(1, std::memory_order_relaxed) >= capacity_) {
+    shard.load.fetch_sub(1, std::memory_order_relaxed);
+    query->cb(RESULT_OVERLOADED, query->name, query->type, {});
+    return;
+  }
+
+  DBG() << "cache refresh: name=" << query->name << ", type=" << query->type;
+  refreshes_.fetch_add(1, std::memory_order_relaxed);
+  submit_query(shard, std::move(query));
+}
+
+std::shared_ptr<const DnsCache::Entry> AsyncDnsClient::stale_entry(const Query& query) const
+{
+  auto now = DnsCache::Clock::now();
+  return query.prepared ?
+      cache_->lookup_stale(query.prepared->cache_key, now) :
+      cache_->lookup_stale(query.name, query.type, now);
+}
+
+std::uint32_t AsyncDnsClient::name_hash(std::string_view name)
+{
+  // FNV-1a over the case-folded name, but the trailing dot.
+  std::uint32_t hash = 2166136261u;
+  for (unsigned char c: without_trailing_dot(name)) {
+    hash = (hash ^ std::tolower(c)) * 16777619u;
+  }
+  return hash;
+}
+
+boost::asio::io_context& AsyncDnsClient::worker_context(std::size_t worker)
+{
+  return worker == 0 ? io_ : *contexts_[worker - 1];
+}
+
+std::size_t AsyncDnsClient::shard_index(std::string_view name) const
+{
+  // The same name always lands on the same shard.
+  return name_hash(name) % shards_.size();
+}
 
-void AsyncDnsClient::start_receiving()
+void AsyncDnsClient::start_receiving(Shard& shard)
 {
-    socket_.async_receive_from(
-        boost::asio::buffer(response_),
-        remote_,
-        0,
-        boost::asio::bind_executor(io_strand_, [this](auto err, auto received) {
+  if (shard.uring) {
+    // The first receive arms the ring.
+    receive_uring(shard);
+    return;
+  }
+
+  shard.socket.async_wait(
+      boost::asio::ip::udp::socket::wait_read,
+      boost::asio::bind_executor(shard.strand, [this, &shard](auto err) {
+        if (err) {
+          if (err != boost::asio::error::operation_aborted) {
+            ERR() << "async_wait: " << err.message();
+          }
+          return;
+        }
+
+        // Drain the socket, but only so much that the other work of the strand does not starve.
+        for (std::size_t round = 0; round < MAX_RECEIVE_ROUNDS; ++round) {
+          auto received = shard.receives.receive(shard.socket, err);
           if (err) {
-            if (err != boost::asio::error::operation_aborted) {
-              ERR() << "async_receive_from: " << err.message();
+            if (err != boost::asio::error::would_block) {
+              ERR() << "recvmmsg: " << err.message();
             }
-            return;
+            break;
           }
 
-          if (remote_ != nameserver_) {
-            ERR() << "async_receive_from: unexpected endpoint";
-            start_receiving();
-            return;
+          for (std::size_t i = 0; i < received; ++i) {
+            handle_response(shard, shard.receives.data(i), shard.receives.size(i), shard.receives.truncated(i),
+                            shard.receives.remote(i));
           }
 
-          //
-          // Parse the binary DNS response.
-          //
-          ns_msg handle;
-
-          if (ns_initparse(response_.data(), received, &handle) != 0) {
-            ERR() << "ns_initparse: " << std::strerror(errno);
-            start_receiving();
-            return;
+          if (received < shard.receives.capacity()) {
+            break;
           }
+        }
+
+        start_receiving(shard);
+      }));
+}
+
+void AsyncDnsClient::wait_uring(Shard& shard)
+{
+  shard.uring->async_wait(boost::asio::bind_executor(shard.strand, [this, &shard](auto err) {
+    if (err) {
+      if (err != boost::asio::error::operation_aborted) {
+        ERR() << "io_uring wait: " << err.message();
+      }
+      return;
+    }
+    receive_uring(shard);
+  }));
+}
+
+void AsyncDnsClient::receive_uring(Shard& shard)
+{
+  // Closed by stop() meanwhile.
+  if (!shard.socket.is_open()) {
+    return;
+  }
+
+  auto& uring = *shard.uring;
+  bool drained = false;
+
+  for (std::size_t round = 0; round < MAX_RECEIVE_ROUNDS && !drained; ++round) {
+    boost::system::error_code err;
+    auto received = uring.receive(err);
+    if (err) {
+      if (err != boost::asio::error::would_block) {
+        ERR() << "io_uring receive: " << err.message();
+      }
+      drained = true;
+      break;
+    }
+
+    for (std::size_t i = 0; i < received; ++i) {
+      handle_response(shard, uring.data(i), uring.size(i), uring.truncated(i), uring.remote(i));
+    }
+
+    drained = received < uring.capacity();
+  }
+
+  if (auto failed = uring.take_send_errors()) {
+    ERR() << "io_uring: " << failed << " sends failed";
+    shard.counters.send_errors.add(failed);
+  }
+
+  // The sends left over for the lack of room in the ring.
+  if (shard.sends_scheduled && !shard.sends.empty()) {
+    flush_sends(shard);
+  }
+
+  if (drained) {
+    wait_uring(shard);
+  }
+  else {
+    // The completions reaped already do not signal again.
+    post(shard.strand, [this, &shard]() { receive_uring(shard); });
+  }
+}
+
+void AsyncDnsClient::handle_response(
+        Shard& shard,
+        const unsigned char* data, std::size_t size, bool truncated,
+        const boost::asio::ip::udp::endpoint& remote)
+{
+  shard.counters.received.add();
+
+  if (std::find(nameservers_.begin(), nameservers_.end(), remote) == nameservers_.end()) {
+    ERR() << "query response: unexpected endpoint " << remote;
+    shard.counters.unexpected_endpoint.add();
+    return;
+  }
+
+  //
+  // Parse the binary DNS response.
+  //
+  DnsMessage msg;
+
+  if (!msg.parse(data, size)) {
+    ERR() << "query response: malformed header or question";
+    shard.counters.malformed.add();
+    return;
+  }
+
+  auto id = msg.id();
+
+  DBG() << "query response: id=" << id
+        << ", qr=" << msg.qr()
+        << ", aa=" << msg.aa()
+        << ", tc=" << msg.tc()
+        << ", rcode=" << msg.rcode()
+        << ", #qd=" << msg.count(ns_s_qd)
+        << ", #an=" << msg.count(ns_s_an);
+
+  auto* slot = shard.queries.find(id);
+  if (!slot) {
+    DBG() << "query with id " << id << " not found";
+    shard.counters.unknown_id.add();
+    return;
+  }
+
+  auto query = *slot;
+  if (query->done) {
+    DBG() << "query with id " << id << " already timeouted";
+    shard.counters.unknown_id.add();
+    return;
+  }
 
-          auto id = ns_get16(response_.data());
-          int rcode = ns_msg_getflag(handle, ns_f_rcode);
-
-          DBG() << "query response: id=" << id
-                << ", qr=" << ns_msg_getflag(handle, ns_f_qr)
-                << ", aa=" << ns_msg_getflag(handle, ns_f_aa)
-                << ", tc=" << ns_msg_getflag(handle, ns_f_tc)
-                << ", rcode=" << rcode
-                << ", #qd=" << ns_msg_count(handle, ns_s_qd)
-                << ", #an=" << ns_msg_count(handle, ns_s_an);
-
-          auto query_it = queries_.find(id);
-          if (query_it == queries_.end()) {
-            DBG() << "query with id " << id << " not found";
-            start_receiving();
+  // Accept the response only from a nameserver queried.
+  const Query::Attempt* attempt = nullptr;
+  std::size_t n_sent = 0;
+  for (std::size_t i = 0; i < query->n_attempts; ++i) {
+    if (nameservers_[query->attempts[i].upstream] == remote) {
+      attempt = &query->attempts[i];
+      ++n_sent;
+    }
+  }
+  if (!attempt) {
+    DBG() << "query " << *query << ": response from " << remote << " not queried";
+    shard.counters.unexpected_endpoint.add();
+    return;
+  }
+
+  // Nor a response to another question (e.g. spoofed, guessing the ID), which would end up in the
+  // cache. A nameserver not supporting EDNS may leave the question out of its FORMERR, which just
+  // gets the query retried without EDNS below.
+  const bool no_edns =
+      (msg.rcode() == ns_r_formerr || msg.rcode() == ns_r_notimpl) &&
+      query->edns_offset > 0 && query->n_attempts < MAX_ATTEMPTS && !msg.has_opt();
+  if (!msg.qr() ||
+      !(msg.matches_question(query->request.data(), query->request_len) ||
+        (no_edns && msg.count(ns_s_qd) == 0))) {
+    ERR() << "query " << *query << ": response from " << remote << " not to the question";
+    shard.counters.malformed.add();
+    return;
+  }
+
+  auto& upstream = shard.upstreams[attempt->upstream];
+  if (n_sent == 1) {
+    upstream.add_rtt(std::chrono::duration_cast<std::chrono::microseconds>(TimerWheel::Clock::now() - attempt->sent));
+  }
+  else {
+    // Karn's algorithm: which of the requests was answered is unknown, so there is no sample.
+    upstream.timeouts = 0;
+  }
+
+  if (msg.tc() || truncated) {
+    // The complete response has to be fetched over TCP (unless already being fetched).
+    shard.counters.truncated.add();
+    if (!query->tcp) {
+      query_over_tcp(shard, query, attempt->upstream);
+    }
+    return;
+  }
+
+  if (no_edns) {
+    // The nameserver does not support EDNS (RFC 6891, 7).
+    DBG() << "query " << *query << ": no EDNS support by " << remote << ", retrying without";
+    query->request_len = query->edns_offset;
+    query->edns_offset = 0;
+    dns_put16(0, query->request.data() + 10);  // ARCOUNT
+    send_attempt(shard, query, attempt->upstream, TimerWheel::Clock::now());
+    return;
+  }
+
+  complete_query(shard, query, msg);
+}
+
+void AsyncDnsClient::handle_tcp_response(
+        Shard& shard, TcpConnection& conn,
+        const unsigned char* data, std::size_t size)
+{
+  shard.counters.received.add();
+
+  DnsMessage msg;
+
+  if (!msg.parse(data, size)) {
+    ERR() << "tcp query response: malformed header or question";
+    shard.counters.malformed.add();
+    return;
+  }
+
+  auto id = msg.id();
+
+  DBG() << "tcp query response: id=" << id
+        << ", qr=" << msg.qr()
+        << ", aa=" << msg.aa()
+        << ", tc=" << msg.tc()
+        << ", rcode=" << msg.rcode()
+        << ", #qd=" << msg.count(ns_s_qd)
+        << ", #an=" << msg.count(ns_s_an);
+
+  conn.answered = true;
+
+  auto* slot = shard.queries.find(id);
+  if (!slot || (*slot)->tcp != &conn) {
+    DBG() << "tcp query with id " << id << " not found";
+    shard.counters.unknown_id.add();
+    return;
+  }
+
+  auto query = *slot;
+  if (!msg.qr() || !msg.matches_question(query->request.data(), query->request_len)) {
+    ERR() << "tcp query " << *query << ": response not to the question";
+    shard.counters.malformed.add();
+    return;
+  }
+
+  complete_query(shard, query, msg);
+}
+
+void AsyncDnsClient::complete_query(Shard& shard, const QueryPtr& query, const DnsMessage& msg)
+{
+  if (cache_) {
+    if (query->prepared) {
+      cache_->insert(query->prepared->cache_key, msg, DnsCache::Clock::now());
+    }
+    else {
+      cache_->insert(query->name, query->type, msg, DnsCache::Clock::now());
+    }
+  }
+
+  finish_query(shard, *query, RESULT_SUCCESS, DnsResponseView(msg));
+}
+
+void AsyncDnsClient::query_over_tcp(Shard& shard, const QueryPtr& query, std::size_t upstream)
+{
+  auto& conn = shard.tcp[upstream];
+  if (!conn) {
+    conn = std::make_unique<TcpConnection>(shard.strand.context(), upstream);
+  }
+
+  DBG() << "query " << *query << ": truncated, retrying over tcp to " << nameservers_[upstream];
+
+  // No more retransmissions nor hedging, just the deadline.
+  query->retransmit_at = TimerWheel::Clock::time_point::max();
+  query->hedge_at = TimerWheel::Clock::time_point::max();
+  schedule_query(shard, *query);
+
+  query->tcp = conn.get();
+  query->tcp_index = conn->outstanding.size();
+  conn->outstanding.push_back(query);
+  conn->queued.push_back(query);
+
+  if (!conn->connected) {
+    if (!conn->connecting) {
+      tcp_connect(shard, *conn);
+    }
+    return;
+  }
+  if (!conn->writing) {
+    tcp_write(shard, *conn);
+  }
+}
+
+void AsyncDnsClient::tcp_detach(Shard& shard, Query& query)
+{
+  auto* conn = query.tcp;
+  if (!conn) {
+    return;
+  }
+  query.tcp = nullptr;
+
+  // Fill the hole with the last one (the caller holds a reference to the query).
+  auto last = std::move(conn->outstanding.back());
+  conn->outstanding.pop_back();
+  if (last.get() != &query) {
+    last->tcp_index = query.tcp_index;
+    conn->outstanding[query.tcp_index] = std::move(last);
+  }
+
+  if (!conn->outstanding.empty() || !conn->connected) {
+    return;
+  }
+
+  conn->idle_timer.expires_after(std::chrono::milliseconds(tcp_idle_timeout_ms_));
+  conn->idle_timer.async_wait(
+      boost::asio::bind_executor(shard.strand, [this, conn, generation = conn->generation](auto err) {
+        if (err || generation != conn->generation || !conn->outstanding.empty()) {
+          return;
+        }
+        DBG() << "tcp " << nameservers_[conn->upstream] << ": idle, closing";
+        tcp_close(*conn);
+      }));
+}
+
+void AsyncDnsClient::tcp_connect(Shard& shard, TcpConnection& conn)
+{
+  const auto& nameserver = nameservers_[conn.upstream];
+
+  conn.connecting = true;
+  conn.socket.async_connect(
+      boost::asio::ip::tcp::endpoint(nameserver.address(), nameserver.port()),
+      boost::asio::bind_executor(shard.strand, [this, &shard, &conn, generation = conn.generation](auto err) {
+        if (generation != conn.generation) {
+          return;
+        }
+        conn.connecting = false;
+
+        if (err) {
+          tcp_fail(shard, conn, err);
+          return;
+        }
+
+        DBG() << "tcp " << nameservers_[conn.upstream] << ": connected";
+        conn.connected = true;
+        conn.answered = false;
+        conn.socket.set_option(boost::asio::ip::tcp::no_delay(true), err);
+
+        tcp_read(shard, conn);
+        tcp_write(shard, conn);
+      }));
+}
+
+void AsyncDnsClient::tcp_write(Shard& shard, TcpConnection& conn)
+{
+  // Everything queued goes out with a single write, each request prefixed with its length.
+  conn.written.clear();
+  conn.buffers.clear();
+  for (auto&& query: conn.queued) {
+    if (query->done) {
+      continue;
+    }
+    dns_put16(query->request_len, query->tcp_length.data());
+    conn.buffers.emplace_back(query->tcp_length.data(), query->tcp_length.size());
+    conn.buffers.emplace_back(query->request.data(), query->request_len);
+    conn.written.push_back(std::move(query));
+  }
+  conn.queued.clear();
+
+  if (conn.written.empty()) {
+    return;
+  }
+
+  conn.writing = true;
+  boost::asio::async_write(
+      conn.socket, conn.buffers,
+      boost::asio::bind_executor(shard.strand, [this, &shard, &conn, generation = conn.generation](auto err, auto) {
+        if (generation != conn.generation) {
+          return;
+        }
+        conn.writing = false;
+
+        if (err) {
+          conn.written.clear();
+          tcp_fail(shard, conn, err);
+          return;
+        }
+
+        shard.counters.sent.add(conn.written.size());
+        shard.upstreams[conn.upstream].sent.add(conn.written.size());
+        conn.written.clear();
+        if (!conn.queued.empty()) {
+          tcp_write(shard, conn);
+        }
+      }));
+}
+
+void AsyncDnsClient::tcp_read(Shard& shard, TcpConnection& conn)
+{
+  conn.socket.async_read_some(
+      boost::asio::buffer(conn.buffer.data() + conn.buffered, conn.buffer.size() - conn.buffered),
+      boost::asio::bind_executor(shard.strand, [this, &shard, &conn, generation = conn.generation](auto err, std::size_t n) {
+        if (generation != conn.generation) {
+          return;
+        }
+
+        if (err) {
+          if (err == boost::asio::error::eof && conn.outstanding.empty()) {
+            DBG() << "tcp " << nameservers_[conn.upstream] << ": closed by the nameserver";
+            tcp_close(conn);
             return;
           }
+          tcp_fail(shard, conn, err);
+          return;
+        }
 
-          auto& query = query_it->second;
-          if (query->done) {
-            DBG() << "query with id " << id << " already timeouted";
-            start_receiving();
-            return;
+        // Handle the complete messages and keep the rest for the next read. The buffer fits the
+        // largest message possible.
+        conn.buffered += n;
+
+        std::size_t pos = 0;
+        while (conn.buffered - pos >= NS_INT16SZ) {
+          std::size_t len = dns_get16(&conn.buffer[pos]);
+          if (conn.buffered - pos < NS_INT16SZ + len) {
+            break;
           }
+          handle_tcp_response(shard, conn, &conn.buffer[pos + NS_INT16SZ], len);
+          pos += NS_INT16SZ + len;
+        }
 
-          std::vector<std::pair<std::string, boost::asio::ip::address>> addrs;
-          std::vector<std::pair<std::string, std::string>> cnames;
+        std::copy(conn.buffer.begin() + pos, conn.buffer.begin() + conn.buffered, conn.buffer.begin());
+        conn.buffered -= pos;
 
-          for (std::size_t i = 0; i < ns_msg_count(handle, ns_s_an); ++i) {
-            ns_rr rr;
+        tcp_read(shard, conn);
+      }));
+}
 
-            if (ns_parserr(&handle, ns_s_an, i, &rr) != 0) {
-              ERR() << "query " << *query << ": ns_parserr: rr=" << i << ": " << std::strerror(errno);
-              continue;
-            }
+void AsyncDnsClient::tcp_close(TcpConnection& conn)
+{
+  ++conn.generation;
+  conn.connecting = false;
+  conn.connected = false;
+  conn.answered = false;
+  conn.writing = false;
+  conn.written.clear();
+  conn.buffered = 0;
 
-            if (ns_rr_type(rr) == ns_t_cname) {
-              char dname[MAXDNAME];
+  boost::system::error_code err;
+  conn.socket.close(err);
+  conn.idle_timer.cancel();
+}
 
-              if (ns_name_uncompress(ns_msg_base(handle), ns_msg_end(handle), ns_rr_rdata(rr),
-                                     dname, sizeof(dname)) == -1) {
-                ERR() << "query " << *query << ": ns_name_uncompress: rr=" << i << ": " << std::strerror(errno);
-                continue;
-              }
+void AsyncDnsClient::tcp_fail(Shard& shard, TcpConnection& conn, const boost::system::error_code& err)
+{
+  if (err == boost::asio::error::operation_aborted) {
+    // Closed by stop().
+    return;
+  }
 
-              cnames.push_back(std::make_pair(ns_rr_name(rr), std::move(dname)));
-            }
-            else if (ns_rr_type(rr) == ns_t_a) {
-              auto addr = boost::asio::ip::address_v4(ns_get32(ns_rr_rdata(rr)));
-              addrs.push_back(std::make_pair(ns_rr_name(rr), std::move(addr)));
-            }
-            else if (ns_rr_type(rr) == ns_t_aaaa) {
-              auto addr = boost::asio::ip::address_v6(
-                  *reinterpret_cast<const boost::asio::ip::address_v6::bytes_type*>(ns_rr_rdata(rr)));
-              addrs.push_back(std::make_pair(ns_rr_name(rr), std::move(addr)));
-            }
-          }
+  ERR() << "tcp " << nameservers_[conn.upstream] << ": " << err.message();
+
+  // A connection that used to work may have been just closed by the nameserver, so reconnect once
+  // and write all the queries not answered again.
+  bool reconnect = conn.answered;
+  tcp_close(conn);
+
+  if (reconnect && !conn.outstanding.empty()) {
+    conn.queued = conn.outstanding;
+    tcp_connect(shard, conn);
+    return;
+  }
 
-          query->timer.cancel();
-          query->cb(RESULT_SUCCESS, query->name, query->type,
-                    rcode, std::move(addrs), std::move(cnames));
-          query->done = true;
-          queries_.erase(query->id);
+  auto queries = std::move(conn.outstanding);
+  conn.outstanding.clear();
+  conn.queued.clear();
 
-          start_receiving();
-        }));
+  for (auto&& query: queries) {
+    query->tcp = nullptr;
+    if (!query->done) {
+      finish_query(shard, *query, RESULT_ERROR, {});
+    }
+  }
 }
 
 std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::Query& query)
@@ -276,13 +2080,107 @@ std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::QueryType& type
     case AsyncDnsClient::QueryType::TYPE_A:
       os << "A";
       break;
+    case AsyncDnsClient::QueryType::TYPE_NS:
+      os << "NS";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_CNAME:
+      os << "CNAME";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_SOA:
+      os << "SOA";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_PTR:
+      os << "PTR";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_MX:
+      os << "MX";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_TXT:
+      os << "TXT";
+      break;
     case AsyncDnsClient::QueryType::TYPE_AAAA:
       os << "AAAA";
       break;
+    case AsyncDnsClient::QueryType::TYPE_SRV:
+      os << "SRV";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_SVCB:
+      os << "SVCB";
+      break;
+    case AsyncDnsClient::QueryType::TYPE_HTTPS:
+      os << "HTTPS";
+      break;
+    default:
+      // RFC 3597
+      os << "TYPE" << static_cast<unsigned int>(type);
+      break;
   };
   return os;
 }
 
+const boost::system::error_category& AsyncDnsClient::error_category()
+{
+  struct Category : boost::system::error_category
+  {
+    const char* name() const noexcept override { return "dns"; }
+
+    std::string message(int value) const override
+    {
+      switch (value) {
+        case RESULT_SUCCESS:
+          return "success";
+        case RESULT_TIMEOUT:
+          return "query timed out";
+        case RESULT_ERROR:
+          return "query failed";
+        case RESULT_OVERLOADED:
+          return "too many queries";
+        case RESULT_CANCELLED:
+          return "query cancelled";
+      }
+      return "unknown error";
+    }
+  };
+
+  static const Category category;
+  return category;
+}
+
+std::optional<AsyncDnsClient::QueryType> parse_query_type(std::string_view str)
+{
+  using QueryType = AsyncDnsClient::QueryType;
+
+  auto iequals = [](std::string_view a, std::string_view b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [](unsigned char x, unsigned char y) { return std::tolower(x) == std::tolower(y); });
+  };
+
+  for (auto type: {QueryType::TYPE_A, QueryType::TYPE_NS, QueryType::TYPE_CNAME, QueryType::TYPE_SOA,
+                   QueryType::TYPE_PTR, QueryType::TYPE_MX, QueryType::TYPE_TXT, QueryType::TYPE_AAAA,
+                   QueryType::TYPE_SRV, QueryType::TYPE_SVCB, QueryType::TYPE_HTTPS}) {
+    std::ostringstream os;
+    os << type;
+    if (iequals(os.str(), str)) {
+      return type;
+    }
+  }
+
+  if (str.size() > 4 && iequals(str.substr(0, 4), "TYPE")) {
+    str.remove_prefix(4);
+  }
+
+  unsigned long value = 0;
+  for (auto c: str) {
+    if (c < '0' || c > '9' || (value = 10 * value + (c - '0')) > 0xffff) {
+      return std::nullopt;
+    }
+  }
+  if (str.empty() || value == 0) {
+    return std::nullopt;
+  }
+  return QueryType(value);
+}
+
 std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::QueryResult& result)
 {
   switch (result) {
@@ -295,6 +2193,12 @@ std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::QueryResult& re
     case AsyncDnsClient::QueryResult::RESULT_ERROR:
       os << "ERROR";
       break;
+    case AsyncDnsClient::QueryResult::RESULT_OVERLOADED:
+      os << "OVERLOADED";
+      break;
+    case AsyncDnsClient::QueryResult::RESULT_CANCELLED:
+      os << "CANCELLED";
+      break;
   }
   return os;
 }
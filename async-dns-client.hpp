@@ -2,20 +2,45 @@
 
 #pragma once
 
+#include "dns-cache.hpp"
+#include "dns-message.hpp"
+#include "mpmc-ring.hpp"
+#include "mpsc-ring.hpp"
+#include "query-table.hpp"
+#include "stats.hpp"
+#include "timer-wheel.hpp"
+#include "udp-batch.hpp"
+#include "udp-uring.hpp"
+#include "unique-function.hpp"
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <boost/system/error_code.hpp>
 
+#include <chrono>
 #include <string_view>
 #include <string>
 #include <functional>
+#include <iosfwd>
 #include <memory>
 #include <thread>
 #include <vector>
 #include <array>
-#include <map>
+#include <cstdint>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
 
 #include <arpa/nameser.h>
 
@@ -25,9 +50,37 @@
 class AsyncDnsClient
 {
 public:
-  enum QueryType { TYPE_A, TYPE_AAAA };
+  // The values are the RR types, so any type can be queried, e.g. QueryType(ns_t_caa).
+  enum QueryType : std::uint16_t
+  {
+    TYPE_A = ns_t_a,
+    TYPE_NS = ns_t_ns,
+    TYPE_CNAME = ns_t_cname,
+    TYPE_SOA = ns_t_soa,
+    TYPE_PTR = ns_t_ptr,
+    TYPE_MX = ns_t_mx,
+    TYPE_TXT = ns_t_txt,
+    TYPE_AAAA = ns_t_aaaa,
+    TYPE_SRV = ns_t_srv,
+    TYPE_SVCB = 64,
+    TYPE_HTTPS = 65,
+  };
+
+  // RESULT_OVERLOADED: the query was not sent, as the shard had too many queries in flight and
+  // queued already, see Options::max_queued. RESULT_CANCELLED: the query was cut short (or not
+  // taken at all) by async_drain() or stop().
+  enum QueryResult { RESULT_SUCCESS, RESULT_TIMEOUT, RESULT_ERROR, RESULT_OVERLOADED, RESULT_CANCELLED };
 
-  enum QueryResult { RESULT_SUCCESS, RESULT_TIMEOUT, RESULT_ERROR };
+  // The results are error codes too (RESULT_SUCCESS == no error).
+  static const boost::system::error_category& error_category();
+
+  friend boost::system::error_code make_error_code(QueryResult result)
+  {
+    return {int(result), error_category()};
+  }
+
+  // Signature of the completion handlers of the completion token flavor of async_query.
+  using QuerySignature = void(boost::system::error_code err, DnsResponse response);
 
   using OnFinishedCallback = std::function<
       void(QueryResult result,
@@ -37,47 +90,656 @@ public:
            std::vector<std::pair<std::string, boost::asio::ip::address>>&& addrs,
            std::vector<std::pair<std::string, std::string>>&& cnames)>;
 
+  // Zero-copy alternative to OnFinishedCallback. The response view borrows the receive buffer,
+  // so it must not be used after the callback returns. Unlike std::function the callback is
+  // move-only and small callables are stored without allocation.
+  using OnResponseCallback = UniqueFunction<
+      void(QueryResult result,
+           std::string_view name,
+           QueryType type,
+           const DnsResponseView& response)>;
+
+  using OnBatchFinishedCallback = UniqueFunction<void()>;
+
+  using OnDrainedCallback = UniqueFunction<void()>;
+
+  // Callback of async_query_addresses() with the responses to both the A and the AAAA query.
+  // Either view may be empty, e.g. if its query timed out.
+  using OnAddressesCallback = UniqueFunction<
+      void(QueryResult result,
+           std::string_view name,
+           const DnsResponseView& a_response,
+           const DnsResponseView& aaaa_response)>;
+
+  struct Options
+  {
+    std::size_t n_workers = 1;
+
+    // Independent shards, each with its own UDP socket, strand and query table, so the shards do
+    // not serialize on each other (0 == n_workers).
+    std::size_t n_shards = 0;
+
+    unsigned int timeout_ms = 500;
+
+    // Maximum number of responses cached (0 == no cache). A cache hit calls the callback right
+    // away, from within async_query.
+    std::size_t cache_size = 0;
+    std::uint32_t cache_max_ttl = 86400;  // seconds
+    std::uint32_t cache_max_negative_ttl = 3600;  // seconds
+
+    // Refresh-ahead: a cache hit within the last cache_refresh_ahead percent of the TTL of an
+    // entry hit cache_refresh_min_hits times or more sends a query in the background (one at a
+    // time), so the popular entries get replaced before they expire (0 == no refreshing). Both
+    // refresh-ahead and serve-stale below are of the cache, i.e. off without it.
+    unsigned int cache_refresh_ahead = 0;
+    unsigned int cache_refresh_min_hits = 2;
+
+    // Serve-stale (RFC 8767): a query failing (e.g. timing out, or answered by SERVFAIL) is answered
+    // by the cache entry of the name expired for up to cache_max_stale seconds, if any, its
+    // lowest TTL at 30 seconds (or the original, if lower) (0 == no serving stale).
+    std::uint32_t cache_max_stale = 0;  // seconds
+
+    // A nameserver timing out so many queries in a row is considered down for down_time_ms, i.e.
+    // it is not queried while other nameservers are up.
+    unsigned int max_consecutive_timeouts = 3;
+    unsigned int down_time_ms = 5000;
+
+    // A query not answered within the retransmission timeout is sent again, possibly to another
+    // nameserver, up to max_retransmissions (at most 6) times. The RTO of a nameserver is
+    // srtt + 4 * rttvar (RFC 6298) clamped to [min_rto_ms, max_rto_ms], initial_rto_ms until its
+    // RTT is known, and it doubles with every retransmission. timeout_ms still bounds the query.
+    unsigned int max_retransmissions = 2;
+    unsigned int initial_rto_ms = 200;
+    unsigned int min_rto_ms = 50;
+    unsigned int max_rto_ms = 2000;
+
+    // Hedging: a query not answered within the 95th percentile of the recent RTTs of the
+    // nameserver goes to another nameserver as well; the first response wins.
+    bool hedge = false;
+
+    // Truncated responses are retried over TCP connections kept open for this long when idle.
+    unsigned int tcp_idle_timeout_ms = 10000;
+
+    // EDNS(0) of the queries (edns.udp_size == 0 disables it). A query answered by FORMERR or
+    // NOTIMP without EDNS is retried without it.
+    DnsEdns edns;
+
+    // Admission control: a shard keeps at most max_inflight queries in flight (0 == one per ID,
+    // i.e. 65536) and at most max_inflight_per_nameserver (0 == unlimited) of them at any one
+    // nameserver. The queries over the limits wait in a FIFO queue of up to max_queued queries
+    // (the wait counts towards timeout_ms), the queries beyond that are finished right away with
+    // RESULT_OVERLOADED. Lookups joining a query in flight count towards neither limit.
+    std::size_t max_inflight = 0;
+    std::size_t max_inflight_per_nameserver = 0;
+    std::size_t max_queued = SIZE_MAX;
+
+    // UDP over io_uring (Linux 6.0 and later): the responses are received by a multishot recvmsg
+    // into provided buffers, without a syscall per batch, and the sends of a batch are submitted
+    // at once. Without the kernel support the shards fall back to the reactor (with a warning).
+    bool io_uring = false;
+
+    // Thread per core: each worker runs an io_context of its own, pinned to a CPU, with a shard of
+    // its own (n_shards is ignored), so the state of a query stays in the caches of one core. The
+    // CPUs are cpus[i] of worker i (empty == the CPUs the process may run on, in order). With
+    // numa_local the shards are allocated by their pinned threads, i.e. (first touch) on the NUMA
+    // node of their CPUs. With RFS enabled the kernel steers the responses to the CPU receiving.
+    bool per_core = false;
+    std::vector<unsigned int> cpus;
+    bool numa_local = false;
+  };
+
+  //
+  // Snapshot of the statistics
+  //
+  // The counters are summed over the shards; each is consistent on its own, but not necessarily
+  // with the others.
+  //
+  struct Stats
+  {
+    std::uint64_t queries = 0;  // not answered by the cache, coalesced included
+    std::uint64_t coalesced = 0;  // joined a query in flight
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    std::uint64_t cache_refreshes = 0;  // queries sent ahead of the expiry of an entry
+    std::uint64_t stale_answers = 0;  // queries failed and answered by an expired entry
+    std::uint64_t sent = 0;  // requests, retransmissions and hedges included
+    std::uint64_t received = 0;  // responses, duplicate and unexpected included
+    std::uint64_t timeouts = 0;  // queries timed out
+    std::uint64_t retransmissions = 0;
+    std::uint64_t send_errors = 0;
+    std::uint64_t unknown_id = 0;  // responses to no query in flight
+    std::uint64_t unexpected_endpoint = 0;  // responses from other than a nameserver queried
+    std::uint64_t malformed = 0;  // responses, or not to the question of their query
+    std::uint64_t truncated = 0;  // responses retried over TCP
+    std::uint64_t overloaded = 0;  // queries refused, see Options::max_queued
+
+    struct Nameserver
+    {
+      boost::asio::ip::udp::endpoint endpoint;
+      std::uint64_t sent = 0;
+      std::uint64_t lost = 0;  // requests not answered within the RTO
+      LatencyHistogram::Snapshot rtt;  // in microseconds, of the unambiguous samples only
+    };
+
+    std::vector<Nameserver> nameservers;
+
+    // Writes the statistics in the Prometheus text exposition format, the names prefixed.
+    void write_prometheus(std::ostream& os, std::string_view prefix = "dns_client") const;
+  };
+
+  //
+  // Prepared query
+  //
+  // A name and type encoded once, by prepare(), into the template of the request: querying it
+  // copies the template rather than encoding the name, and skips hashing and case folding it for
+  // the shard, the in-flight index and the cache. Preparing the same name (in any case) and type
+  // again while prepared gives the same template, so prepared queries compare and hash by the
+  // identity of their template, cheaply. A prepared query is a reference to the template, cheap
+  // to copy, and may be used with the client that prepared it only.
+  //
+  class PreparedQuery
+  {
+  public:
+    PreparedQuery() = default;
+
+    explicit operator bool() const { return bool(template_); }
+
+    std::string_view name() const { return template_->name; }
+    QueryType type() const { return template_->type; }
+
+    friend bool operator==(const PreparedQuery& a, const PreparedQuery& b) { return a.template_ == b.template_; }
+    friend bool operator!=(const PreparedQuery& a, const PreparedQuery& b) { return a.template_ != b.template_; }
+
+  private:
+    friend class AsyncDnsClient;
+    friend struct std::hash<PreparedQuery>;
+
+    struct Template
+    {
+      std::string name;
+      QueryType type;
+      std::uint32_t hash;  // of the name, see name_hash()
+      std::string cache_key;  // also the key of the interning
+      std::array<unsigned char, PACKETSZ> request;  // with the ID 0
+      std::size_t request_len;
+      std::size_t edns_offset;
+    };
+
+    explicit PreparedQuery(std::shared_ptr<const Template> t) : template_(std::move(t)) {}
+
+    std::shared_ptr<const Template> template_;
+  };
+
+  // Each query goes to the nameserver with the lowest smoothed RTT (penalized by timeouts) of
+  // those up. The RTTs of the other nameservers decay meanwhile, so they get queried again from
+  // time to time. All the nameservers must be of the same address family.
+  AsyncDnsClient(const std::vector<boost::asio::ip::udp::endpoint>& nameservers, const Options& options);
+
+  AsyncDnsClient(std::string_view ns_ip, unsigned short ns_port, const Options& options);
+
   AsyncDnsClient(std::string_view ns_ip, unsigned short ns_port = 53,
                  std::size_t n_workers = 1,
-                 unsigned int timeout_ms = 500);
+                 unsigned int timeout_ms = 500,
+                 std::size_t n_shards = 0);
 
   void start();
+
+  // Finishes the queries not finished yet with RESULT_CANCELLED, each shard on its own strand (so
+  // the shards are torn down in parallel), then stops the workers. No more queries are taken.
   void stop();
 
+  // Stops taking queries (from now on they finish right away with RESULT_CANCELLED) and waits for
+  // the queries in flight to finish, but only until the deadline: those still in flight then are
+  // finished with RESULT_CANCELLED. The callback is called once all the shards are done, from the
+  // strand of the last one, so it must not call stop() itself (which joins the workers), but
+  // stop() still has to be called afterwards. A query submitted concurrently is either waited for
+  // or cancelled (then possibly after the callback), it does not go out once its shard is done.
+  // May be called from any thread, once.
+  void async_drain(std::chrono::steady_clock::time_point deadline, OnDrainedCallback on_drained_cb);
+
+  // May be called from any thread.
+  Stats stats() const;
+
+  // As created: Options::n_shards, or one per worker (by default, and with Options::per_core).
+  std::size_t n_shards() const { return shards_.size(); }
+
+  // The callback is called on the strand of the shard the query landed on,
+  // i.e. callbacks of different queries may be called concurrently.
   void async_query(std::string_view name, QueryType type, const OnFinishedCallback& on_finished_cb);
+  void async_query(std::string_view name, QueryType type, OnResponseCallback on_response_cb);
+
+  // Completion token flavor, e.g. async_query(name, type, use_future) or, with C++20 coroutines,
+  // co_await async_query(name, type, use_awaitable). The handler gets the result as an error code
+  // and an owning copy of the response, and is invoked through its associated executor. The name
+  // need not outlive the initiation.
+  template<typename CompletionToken,
+           typename = std::enable_if_t<!std::is_constructible_v<OnResponseCallback, CompletionToken> &&
+                                       !std::is_constructible_v<OnFinishedCallback, CompletionToken>>>
+  auto async_query(std::string_view name, QueryType type, CompletionToken&& token)
+  {
+    return boost::asio::async_initiate<CompletionToken, QuerySignature>(
+        [this](auto handler, std::string_view name, QueryType type) {
+          // The handler goes into the callback as it is, no std::function.
+          auto work = boost::asio::make_work_guard(handler);
+          async_query(name, type, OnResponseCallback(
+              [handler = std::move(handler), work = std::move(work)](
+                  QueryResult result, std::string_view, QueryType, const DnsResponseView& response) mutable {
+                auto executor = work.get_executor();
+                boost::asio::dispatch(
+                    executor,
+                    [handler = std::move(handler), err = make_error_code(result), response = DnsResponse(response)]()
+                    mutable { handler(err, std::move(response)); });
+                work.reset();
+              }));
+        },
+        token, name, type);
+  }
+
+  // Like async_query, but only if the shard of the name has room for the query (in flight or
+  // queued), so unless mixed with async_query it never finishes with RESULT_OVERLOADED. Returns
+  // false, without calling the callback, if the query was not accepted. Once draining, it is
+  // finished right away with RESULT_CANCELLED, like by async_query.
+  bool try_async_query(std::string_view name, QueryType type, OnResponseCallback on_response_cb);
+
+  // Encodes the query of the name and type for repeated lookups, see PreparedQuery. Throws
+  // std::invalid_argument if the name is not a valid domain name. May be called from any thread.
+  PreparedQuery prepare(std::string_view name, QueryType type);
+
+  // Like the above, for a prepared query.
+  void async_query(const PreparedQuery& prepared, OnResponseCallback on_response_cb);
+  bool try_async_query(const PreparedQuery& prepared, OnResponseCallback on_response_cb);
+
+  // Resolves many names at once: the batch is encoded in one pass and handed over to each shard
+  // at once, so its sends get batched too. The response callback is called for every name (like
+  // with async_query, possibly concurrently for names landing on different shards), the batch
+  // finished callback after the last of them. The names need not outlive the call.
+  void async_query_batch(const std::string_view* names, std::size_t n_names,
+                         QueryType type,
+                         OnResponseCallback on_response_cb,
+                         OnBatchFinishedCallback on_batch_finished_cb = nullptr);
+
+  // Queries the A and AAAA records of the name concurrently; the callback is called once both are
+  // done. The result is RESULT_SUCCESS if either query succeeded.
+  void async_query_addresses(std::string_view name, OnAddressesCallback on_addresses_cb);
+
+  void async_query_batch(const std::vector<std::string_view>& names,
+                         QueryType type,
+                         OnResponseCallback on_response_cb,
+                         OnBatchFinishedCallback on_batch_finished_cb = nullptr)
+  {
+    async_query_batch(names.data(), names.size(), type,
+                      std::move(on_response_cb), std::move(on_batch_finished_cb));
+  }
 
 private:
-  struct Query
+  struct Shard;
+  struct Query;
+  struct TcpConnection;
+  class QueryPool;
+
+  // Of async_drain(), shared by the shards.
+  struct Drain
   {
-    Query(boost::asio::io_context::strand& io, std::string_view name, QueryType type, OnFinishedCallback cb);
+    OnDrainedCallback cb;
+    std::atomic<std::size_t> remaining;  // shards not drained yet
+  };
+
+  // Of a query: the initial send, the retransmissions and the hedge.
+  static constexpr std::size_t MAX_ATTEMPTS = 8;
 
-    const std::string name;
-    const QueryType type;
-    OnFinishedCallback cb;
-    boost::asio::steady_timer timer;
+  using QueryPtr = boost::intrusive_ptr<Query>;
+
+  //
+  // Query
+  //
+  // Queries are recycled by the pool of their shard and reference counted by QueryPtr; the query
+  // gets back to the pool once the last reference is dropped. A registered query is scheduled
+  // in the timeout wheel of its shard (it is the wheel's hook).
+  //
+  // A lookup of a name and type already in flight on the shard does not go out on its own but
+  // joins the in-flight query as a waiter, and gets the same result (and the same timeout).
+  //
+  struct Query : TimerWheel::Hook
+  {
+    Query(Shard& shard, QueryPool& pool);
+
+    // Prepares a recycled query for a new lookup.
+    void assign(std::string_view name, QueryType type, OnResponseCallback cb);
+    void assign(const std::shared_ptr<const PreparedQuery::Template>& prepared, OnResponseCallback cb);
+
+    // Whether any attempt went to the nameserver.
+    bool tried(std::size_t upstream) const;
+
+    Shard& shard;
+    QueryPool& pool;
+    std::atomic<unsigned int> refs;
+
+    std::string_view name;  // stored in name_buf (or name_long if it does not fit)
+    QueryType type;
+    OnResponseCallback cb;
     bool done;
-    std::vector<unsigned char> request;
+    bool queued;  // in the pending queue of the shard and counted in Shard::n_queued
+    std::array<unsigned char, PACKETSZ> request;
+    std::size_t request_len;
+    std::size_t edns_offset;  // of the OPT RR in the request (0 == none)
     unsigned int id;
+    std::uint32_t generation;  // of the query table slot
+
+    std::array<char, 256> name_buf;
+    std::string name_long;
+    std::shared_ptr<const PreparedQuery::Template> prepared;  // the name is in it, if prepared
+
+    std::uint32_t hash;  // of the name, see name_hash()
+    bool inflight;  // in the in-flight index of the shard, i.e. can be joined
+    Query* inflight_next;  // in the index bucket
+    QueryPtr waiters;  // joined lookups, most recent first
+    QueryPtr next_waiter;
+
+    struct Attempt
+    {
+      std::size_t upstream;  // the nameserver queried
+      TimerWheel::Clock::time_point sent;
+    };
+
+    std::array<Attempt, MAX_ATTEMPTS> attempts;
+    std::size_t n_attempts;
+    unsigned int retransmissions;
+    TimerWheel::Clock::time_point deadline;  // of the whole query
+    TimerWheel::Clock::time_point retransmit_at;  // max() == no more retransmissions
+    TimerWheel::Clock::time_point hedge_at;  // max() == no hedge
+
+    TcpConnection* tcp;  // the connection of the query gone over TCP
+    std::size_t tcp_index;  // in tcp->outstanding
+    std::array<unsigned char, NS_INT16SZ> tcp_length;  // the framing of the request
+
+    friend void intrusive_ptr_add_ref(Query* query)
+    {
+      query->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    friend void intrusive_ptr_release(Query* query)
+    {
+      if (query->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        query->pool.release(query);
+      }
+    }
+  };
+
+  //
+  // Pool of recycled queries of a shard
+  //
+  // The queries are acquired by the threads submitting them and released mostly by the strand of
+  // the shard, so the free queries are kept in a lock-free ring. The pool grows to the peak
+  // number of queries in use; those released when the ring is full (more than STOCK_SIZE free)
+  // are freed. As the last reference to a query may be dropped by a handler destroyed together
+  // with io_, i.e. after the shards, the pool is not destroyed by its shard but orphaned and
+  // freed once all its queries are back. That all happens once the workers are stopped, so the
+  // pool is orphaned by a single thread and released to by it only.
+  //
+  class QueryPool
+  {
+  public:
+    explicit QueryPool(Shard& shard) : shard_(shard), free_(STOCK_SIZE) {}
+
+    QueryPtr acquire();
+    void release(Query* query);
+
+    struct Orphan
+    {
+      void operator()(QueryPool* pool) const { pool->orphan(); }
+    };
+
+  private:
+    static constexpr std::size_t STOCK_SIZE = 16384;
+
+    void orphan();
+    void destroy(Query* query);
+
+    Shard& shard_;
+    MpmcRing<Query*> free_;
+    std::atomic<std::size_t> size_{0};  // of the queries, in use or free
+    bool orphaned_ = false;
+  };
+
+  //
+  // Persistent TCP connection of a shard to a nameserver
+  //
+  // The queries are pipelined (RFC 7766): they are written as they come, without waiting for the
+  // responses, and the responses coming in any order are matched by the ID through the query
+  // table of the shard. The connection is made on demand and closed when idle for a while.
+  //
+  struct TcpConnection
+  {
+    TcpConnection(boost::asio::io_context& io, std::size_t upstream);
+
+    const std::size_t upstream;  // the nameserver
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::steady_timer idle_timer;
+    unsigned int generation;  // bumped on close, so that stale handlers can tell
+    bool connecting;
+    bool connected;
+    bool answered;  // since connected
+    bool writing;
+    std::vector<QueryPtr> outstanding;  // not answered, written or not
+    std::vector<QueryPtr> queued;  // waiting for the next write
+    std::vector<QueryPtr> written;  // by the write in progress
+    std::vector<boost::asio::const_buffer> buffers;  // of the write in progress
+    std::vector<unsigned char> buffer;  // of the read in progress
+    std::size_t buffered;
+  };
+
+  //
+  // Nameserver as seen by a shard
+  //
+  struct Upstream
+  {
+    static constexpr std::size_t N_SAMPLES = 64;
+
+    // Adds an RTT sample to the estimates.
+    void add_rtt(std::chrono::microseconds rtt);
+
+    std::chrono::microseconds srtt{0};  // smoothed RTT, 0 until measured
+    std::chrono::microseconds rttvar{0};
+    std::chrono::microseconds score{0};  // the lower the better, see select_upstream()
+    unsigned int timeouts = 0;  // consecutive
+    TimerWheel::Clock::time_point down_until;
+    std::size_t inflight = 0;  // queries with an attempt to the nameserver
+
+    Counter sent;
+    Counter lost;
+    LatencyHistogram rtt_histogram;
+
+    std::array<std::uint32_t, N_SAMPLES> samples{};  // recent RTTs in microseconds (a ring)
+    std::size_t n_samples = 0;
+    std::chrono::microseconds p95{0};  // of the samples, recomputed every few samples
+  };
+
+  //
+  // Shard
+  //
+  // All the state of a shard is accessed from its strand only, but the submissions (and the load).
+  // The queries submitted go through a lock-free ring drained by the strand in batches. The strand
+  // is woken up only by the submission to an empty ring, see submit_query().
+  //
+  struct Shard
+  {
+    Shard(boost::asio::io_context& io,
+          const boost::asio::ip::udp::endpoint& nameserver,
+          std::size_t n_upstreams,
+          std::size_t receive_size);
+
+    boost::asio::io_context::strand strand;
+    std::unique_ptr<QueryPool, QueryPool::Orphan> pool;
+    boost::asio::ip::udp::socket socket;
+    QueryTable<QueryPtr> queries;
+    std::atomic<std::size_t> load;  // queries submitted and not finished, waiters included
+    MpscRing<QueryPtr> submissions;
+    std::atomic<std::size_t> n_submissions;  // pushed to the ring and not drained yet
+    std::deque<QueryPtr> pending;  // waiting for admission, see can_dispatch()
+    std::size_t n_queued;  // of the pending queries, those not finished yet
+    struct Send
+    {
+      QueryPtr query;
+      std::size_t attempt;
+    };
+
+    std::vector<Send> sends;  // waiting for the next flush
+    std::vector<UdpDatagram> datagrams;  // of the flush in progress
+    bool sends_scheduled;
+    UdpReceiveBatch receives;
+    std::unique_ptr<UdpUring> uring;  // in place of the socket's reactor, see Options::io_uring
+    TimerWheel timeouts;
+    boost::asio::steady_timer timeouts_timer;  // drives the wheel
+    bool timeouts_armed;
+    std::shared_ptr<Drain> drain;  // while draining, see async_drain()
+    boost::asio::steady_timer drain_timer;  // the deadline of the drain
+    bool cancelling;  // the queries finish with RESULT_CANCELLED rather than go out
+    bool refusing;  // draining: the queries registered from now on are cancelled, see async_drain()
+    std::vector<Query*> inflight;  // buckets of the in-flight index, by name and type
+    std::vector<Upstream> upstreams;  // by the index of the nameserver
+    std::vector<std::unique_ptr<TcpConnection>> tcp;  // by the index of the nameserver, on demand
+
+    // See Stats.
+    struct Counters
+    {
+      Counter queries;
+      Counter coalesced;
+      Counter sent;
+      Counter received;
+      Counter timeouts;
+      Counter retransmissions;
+      Counter send_errors;
+      Counter unknown_id;
+      Counter unexpected_endpoint;
+      Counter malformed;
+      Counter truncated;
+      Counter overloaded;
+      Counter stale_answers;
+    };
+
+    Counters counters;
   };
 
   friend std::ostream& operator<<(std::ostream& os, const Query& query);
 
-  void start_receiving();
+  static std::uint32_t name_hash(std::string_view name);
 
-  const boost::asio::ip::udp::endpoint nameserver_;
+  boost::asio::io_context& worker_context(std::size_t worker);
+
+  bool refuse_query(std::string_view name, QueryType type, OnResponseCallback& cb);
+  bool query_cache(std::string_view name, QueryType type, OnResponseCallback& cb);
+  bool query_cache(const PreparedQuery& prepared, OnResponseCallback& cb);
+  bool refresh_due(const DnsCache::Entry& entry, DnsCache::Clock::time_point now) const;
+  OnResponseCallback refresh_done(std::shared_ptr<const DnsCache::Entry> entry);
+  void submit_refresh(Shard& shard, QueryPtr query);
+  std::shared_ptr<const DnsCache::Entry> stale_entry(const Query& query) const;
+  std::size_t shard_index(std::string_view name) const;
+  QueryPtr make_query(Shard& shard, std::string_view name, QueryType type, OnResponseCallback cb);
+  QueryPtr make_query(Shard& shard, const PreparedQuery& prepared, OnResponseCallback cb);
+  void submit_query(Shard& shard, QueryPtr query);
+  void drain_submissions(Shard& shard);
+  void register_query(Shard& shard, const QueryPtr& query);
+  void dispatch_query(Shard& shard, const QueryPtr& query);
+  bool can_dispatch(const Shard& shard) const;
+  void start_query(Shard& shard, const QueryPtr& query, TimerWheel::Clock::time_point now);
+  void done_query(Shard& shard, Query& query);
+  void cancel_queries(Shard& shard);
+  void close_shard(Shard& shard);
+  void shard_drained(Shard& shard);
+  void finish_query(Shard& shard, Query& query, QueryResult result, const DnsResponseView& response);
+  void finish_callbacks(Shard& shard, Query& query, QueryResult result, const DnsResponseView& response);
+  void unregister_query(Shard& shard, Query& query);
+  Query*& inflight_bucket(Shard& shard, const Query& query);
+  bool join_inflight(Shard& shard, const QueryPtr& query);
+  void remove_inflight(Shard& shard, Query& query);
+  bool send_attempt(Shard& shard, const QueryPtr& query, std::size_t upstream, TimerWheel::Clock::time_point now);
+  void schedule_query(Shard& shard, Query& query);
+  void handle_query_timer(Shard& shard, const QueryPtr& query, TimerWheel::Clock::time_point now);
+  std::size_t select_upstream(Shard& shard, TimerWheel::Clock::time_point now, const Query& query,
+                              bool untried = false);
+  std::chrono::microseconds rto(const Upstream& upstream, unsigned int retransmissions = 0) const;
+  void record_timeout(Shard& shard, std::size_t upstream, TimerWheel::Clock::time_point now);
+  void query_over_tcp(Shard& shard, const QueryPtr& query, std::size_t upstream);
+  void tcp_detach(Shard& shard, Query& query);
+  void tcp_connect(Shard& shard, TcpConnection& conn);
+  void tcp_write(Shard& shard, TcpConnection& conn);
+  void tcp_read(Shard& shard, TcpConnection& conn);
+  void tcp_close(TcpConnection& conn);
+  void tcp_fail(Shard& shard, TcpConnection& conn, const boost::system::error_code& err);
+  void flush_sends(Shard& shard);
+  void arm_timeouts(Shard& shard);
+  void start_receiving(Shard& shard);
+  void wait_uring(Shard& shard);
+  void receive_uring(Shard& shard);
+  void handle_response(Shard& shard,
+                       const unsigned char* data, std::size_t size, bool truncated,
+                       const boost::asio::ip::udp::endpoint& remote);
+  void handle_tcp_response(Shard& shard, TcpConnection& conn, const unsigned char* data, std::size_t size);
+  void complete_query(Shard& shard, const QueryPtr& query, const DnsMessage& msg);
+
+  const std::vector<boost::asio::ip::udp::endpoint> nameservers_;
   const std::size_t n_workers_;
   const unsigned int timeout_ms_;
+  const unsigned int max_consecutive_timeouts_;
+  const unsigned int down_time_ms_;
+  const unsigned int max_retransmissions_;
+  const std::chrono::microseconds initial_rto_;
+  const std::chrono::microseconds min_rto_;
+  const std::chrono::microseconds max_rto_;
+  const bool hedge_;
+  const unsigned int tcp_idle_timeout_ms_;
+  const DnsEdns edns_;
+  const std::size_t max_inflight_;
+  const std::size_t max_inflight_per_upstream_;
+  const std::size_t max_queued_;
+  const std::size_t capacity_;  // of a shard, see try_async_query()
+
+  std::unique_ptr<DnsCache> cache_;
+  const unsigned int refresh_ahead_;
+  const unsigned int refresh_min_hits_;
+  const bool serve_stale_;
+  std::atomic<bool> accepting_{true};  // queries, see async_drain()
+  std::atomic<std::uint64_t> refreshes_{0};  // submitted from any thread, unlike the counters
+
+  const bool per_core_;
+  std::vector<unsigned int> cpus_;  // of the workers, per_core_ only
 
-  boost::asio::io_context io_;
+  boost::asio::io_context io_;  // of all the workers, or of the first one if per_core_
   boost::asio::executor_work_guard<boost::asio::io_context::executor_type> io_guard_;
-  boost::asio::io_context::strand io_strand_;
-  boost::asio::ip::udp::socket socket_;
+  std::vector<std::unique_ptr<boost::asio::io_context>> contexts_;  // of the other workers, per_core_
+  std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> context_guards_;
+  std::vector<std::unique_ptr<Shard>> shards_;
   std::vector<std::thread> workers_;
-  std::map<int, std::shared_ptr<Query>> queries_;
-  std::array<unsigned char, PACKETSZ> response_;
-  boost::asio::ip::udp::endpoint remote_;
+
+  // The templates prepared, by the cache key; the expired ones are swept as the map doubles.
+  std::mutex prepared_mutex_;
+  std::unordered_map<std::string, std::weak_ptr<const PreparedQuery::Template>> prepared_;
+  std::size_t prepared_sweep_at_ = 64;
 };
 
+namespace boost::system {
+
+template<>
+struct is_error_code_enum<AsyncDnsClient::QueryResult> : std::true_type {};
+
+}  // namespace boost::system
+
+namespace std {
+
+template<>
+struct hash<AsyncDnsClient::PreparedQuery>
+{
+  std::size_t operator()(const AsyncDnsClient::PreparedQuery& prepared) const
+  {
+    return std::hash<const void*>()(prepared.template_.get());
+  }
+};
+
+}  // namespace std
+
 std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::Query& query);
 std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::QueryType& type);
+
+// Parses a type mnemonic (case insensitive, e.g. "mx"), or a number (RFC 3597 TYPE<n> too).
+std::optional<AsyncDnsClient::QueryType> parse_query_type(std::string_view str);
 std::ostream& operator<<(std::ostream& os, const AsyncDnsClient::QueryResult& result);
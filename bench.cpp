@@ -0,0 +1,310 @@
+// bench.cpp
+//
+// Micro-benchmarks (Google Benchmark) of the hot paths: encoding the queries,
+// parsing the responses, the query table, and a whole round trip against an
+// in-process FakeResponder, so that none of them depends on a real resolver.
+
+#include "async-dns-client.hpp"
+#include "dns-message.hpp"
+#include "fake-responder.hpp"
+#include "logging.hpp"
+#include "mpmc-ring.hpp"
+#include "query-table.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_context.hpp>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+std::vector<std::string> make_names(std::size_t n, const std::string& prefix = "host")
+{
+  std::vector<std::string> names;
+  for (std::size_t i = 0; i < n; ++i) {
+    names.push_back(prefix + std::to_string(i) + ".bench.example.com");
+  }
+  return names;
+}
+
+// A response of the fake zone as received, i.e. with the question of the query.
+std::vector<unsigned char> make_response(std::string_view name, std::uint16_t qtype, std::size_t n_addresses)
+{
+  unsigned char query[NS_PACKETSZ];
+  auto len = dns_encode_query(query, sizeof(query), 0x1234, name, qtype);
+
+  std::vector<unsigned char> response(NS_PACKETSZ);
+  response.resize(FakeResponder::answer(query, len, response.data(), response.size(), n_addresses));
+  return response;
+}
+
+//
+// Encoder
+//
+
+void BM_EncodeQuery(benchmark::State& state)
+{
+  auto names = make_names(1024);
+  unsigned char buf[NS_PACKETSZ];
+  std::size_t i = 0;
+
+  for (auto _: state) {
+    auto len = dns_encode_query(buf, sizeof(buf), i, names[i % names.size()], ns_t_a);
+    benchmark::DoNotOptimize(len);
+    ++i;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeQuery);
+
+void BM_EncodeQueryEdns(benchmark::State& state)
+{
+  auto names = make_names(1024);
+  unsigned char buf[NS_PACKETSZ];
+  DnsEdns edns;
+  std::size_t i = 0;
+
+  for (auto _: state) {
+    auto len = dns_encode_query(buf, sizeof(buf), i, names[i % names.size()], ns_t_a);
+    len = dns_encode_opt(buf, sizeof(buf), len, edns);
+    benchmark::DoNotOptimize(len);
+    ++i;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeQueryEdns);
+
+//
+// Parser, as in handle_response(): the header and the question, then a walk over the RRs
+//
+
+void BM_ParseResponse(benchmark::State& state)
+{
+  auto response = make_response("www.bench.example.com", ns_t_a, state.range(0));
+
+  for (auto _: state) {
+    DnsMessage msg;
+    if (!msg.parse(response.data(), response.size())) {
+      state.SkipWithError("malformed response");
+      break;
+    }
+    DnsRecordReader reader(msg);
+    DnsRecord rr;
+    std::size_t n = 0;
+    while (reader.next(rr)) {
+      n += rr.rdlength;
+    }
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * response.size());
+}
+BENCHMARK(BM_ParseResponse)->Arg(1)->Arg(4)->Arg(16);
+
+// The addresses decoded too, following a CNAME chain.
+void BM_ParseResponseAddresses(benchmark::State& state)
+{
+  auto response = make_response("cname.cname.www.bench.example.com", ns_t_a, state.range(0));
+  char name[NS_MAXDNAME];
+
+  for (auto _: state) {
+    DnsMessage msg;
+    msg.parse(response.data(), response.size());
+    DnsResponseView view(msg);
+    std::size_t n = 0;
+    for (auto&& rr: view.answers()) {
+      if (rr.type == ns_t_cname) {
+        n += rr.target()->decode(name, sizeof(name));
+      }
+      else {
+        n += rr.address().is_v4();
+      }
+    }
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ParseResponseAddresses)->Arg(1)->Arg(4);
+
+//
+// Query table
+//
+
+void BM_QueryTableInsertErase(benchmark::State& state)
+{
+  // range(0) queries in flight all the time.
+  QueryTable<int*> table;
+  std::vector<QueryTable<int*>::Key> keys;
+  int value = 0;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    keys.push_back(*table.insert(&value));
+  }
+  std::size_t i = 0;
+
+  for (auto _: state) {
+    auto& key = keys[i++ % keys.size()];
+    table.erase(key.id, key.generation);
+    key = *table.insert(&value);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryTableInsertErase)->Arg(1)->Arg(1024)->Arg(60000);
+
+void BM_QueryTableFind(benchmark::State& state)
+{
+  QueryTable<int*> table;
+  std::vector<QueryTable<int*>::Key> keys;
+  int value = 0;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    keys.push_back(*table.insert(&value));
+  }
+  std::size_t i = 0;
+
+  for (auto _: state) {
+    const auto& key = keys[i++ % keys.size()];
+    benchmark::DoNotOptimize(table.find(key.id, key.generation));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryTableFind)->Arg(1024)->Arg(60000);
+
+//
+// Free list of the query pool, popped and pushed back by the threads
+//
+
+struct MutexFreeList
+{
+  std::mutex mutex;
+  std::vector<int*> free;
+
+  bool pop(int*& p)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free.empty()) {
+      return false;
+    }
+    p = free.back();
+    free.pop_back();
+    return true;
+  }
+
+  void push(int* p)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    free.push_back(p);
+  }
+};
+
+struct RingFreeList
+{
+  MpmcRing<int*> ring{16384};
+
+  bool pop(int*& p) { return ring.try_pop(p); }
+  void push(int* p) { ring.try_push(std::move(p)); }
+};
+
+template<typename FreeList>
+void BM_FreeList(benchmark::State& state)
+{
+  // Shared by the threads, and by the runs.
+  static int values[1024];
+  static FreeList& list = *[]() {
+    static FreeList list;
+    for (auto& value: values) {
+      list.push(&value);
+    }
+    return &list;
+  }();
+
+  for (auto _: state) {
+    int* p;
+    if (list.pop(p)) {
+      benchmark::DoNotOptimize(p);
+      list.push(p);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_FreeList, MutexFreeList)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FreeList, RingFreeList)->ThreadRange(1, 8)->UseRealTime();
+
+//
+// Round trip over the loopback, range(0) queries outstanding, prepared if range(1)
+//
+
+void BM_RoundTrip(benchmark::State& state)
+{
+  boost::asio::io_context io;
+  FakeResponder responder(io, {boost::asio::ip::make_address("127.0.0.1"), 0}, FakeResponder::Options());
+  responder.start();
+  std::thread thread([&io]() { io.run(); });
+
+  AsyncDnsClient::Options options;
+  options.n_workers = 1;
+  AsyncDnsClient dns({responder.endpoint()}, options);
+  dns.start();
+
+  auto names = make_names(4096);
+  std::vector<AsyncDnsClient::PreparedQuery> prepared;
+  if (state.range(1)) {
+    for (auto&& name: names) {
+      prepared.push_back(dns.prepare(name, AsyncDnsClient::TYPE_A));
+    }
+  }
+  const std::size_t window = state.range(0);
+  std::atomic<std::size_t> outstanding{0};
+  std::atomic<std::size_t> failed{0};
+  std::size_t i = 0;
+
+  for (auto _: state) {
+    while (outstanding.load(std::memory_order_acquire) >= window) {
+      std::this_thread::yield();
+    }
+    outstanding.fetch_add(1, std::memory_order_relaxed);
+    AsyncDnsClient::OnResponseCallback cb([&](auto result, auto, auto, const DnsResponseView&) {
+      if (result != AsyncDnsClient::RESULT_SUCCESS) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+      }
+      outstanding.fetch_sub(1, std::memory_order_release);
+    });
+    if (prepared.empty()) {
+      dns.async_query(names[i++ % names.size()], AsyncDnsClient::TYPE_A, std::move(cb));
+    }
+    else {
+      dns.async_query(prepared[i++ % prepared.size()], std::move(cb));
+    }
+  }
+  while (outstanding.load(std::memory_order_acquire) > 0) {
+    std::this_thread::yield();
+  }
+
+  dns.stop();
+  responder.stop();
+  thread.join();
+
+  state.SetItemsProcessed(state.iterations());
+  state.counters["failed"] = failed.load();
+}
+BENCHMARK(BM_RoundTrip)->ArgsProduct({{1, 16, 256}, {0, 1}})->UseRealTime();
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+  Logger::instance().set_threshold(Logger::Level::ERROR);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
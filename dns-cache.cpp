@@ -0,0 +1,198 @@
+// dns-cache.cpp
+
+#include "dns-cache.hpp"
+
+#include <algorithm>
+#include <cctype>      // std::tolower
+#include <functional>  // std::hash
+
+
+DnsCache::DnsCache(std::size_t max_entries,
+                   std::uint32_t max_ttl, std::uint32_t max_negative_ttl,
+                   std::uint32_t max_stale,
+                   std::size_t n_shards)
+  : max_ttl_(max_ttl),
+    max_negative_ttl_(max_negative_ttl),
+    max_stale_(max_stale)
+{
+  n_shards = std::max<std::size_t>(std::min(n_shards, max_entries), 1);
+
+  for (std::size_t i = 0; i < n_shards; ++i) {
+    auto shard = std::make_unique<Shard>();
+    shard->slots.resize(std::max<std::size_t>((max_entries + n_shards - 1) / n_shards, 1));
+    shard->index.reserve(shard->slots.size());
+    shards_.push_back(std::move(shard));
+  }
+}
+
+const std::string& DnsCache::make_key(std::string_view name, std::uint16_t type)
+{
+  thread_local std::string key;
+
+  // All the spellings of a name share the entry: no trailing dot and lower case.
+  if (name.size() > 1 && name.back() == '.') {
+    name.remove_suffix(1);
+  }
+
+  key.resize(2 + name.size());
+  key[0] = type >> 8;
+  key[1] = type & 0xff;
+  std::transform(name.begin(), name.end(), key.begin() + 2,
+                 [](unsigned char c) { return std::tolower(c); });
+  return key;
+}
+
+DnsCache::Shard& DnsCache::shard(const std::string& key)
+{
+  return *shards_[std::hash<std::string>()(key) % shards_.size()];
+}
+
+std::shared_ptr<const DnsCache::Entry> DnsCache::lookup(
+        std::string_view name, std::uint16_t type, Clock::time_point now)
+{
+  return lookup(make_key(name, type), now);
+}
+
+std::shared_ptr<const DnsCache::Entry> DnsCache::lookup(const std::string& key, Clock::time_point now)
+{
+  auto& shard = this->shard(key);
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  auto& slot = shard.slots[it->second];
+  if (slot.entry->expires <= now) {
+    // Leave it to the CLOCK to evict.
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  slot.referenced = true;
+  slot.entry->hits.fetch_add(1, std::memory_order_relaxed);
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  return slot.entry;
+}
+
+std::shared_ptr<const DnsCache::Entry> DnsCache::lookup_stale(
+        std::string_view name, std::uint16_t type, Clock::time_point now)
+{
+  return lookup_stale(make_key(name, type), now);
+}
+
+std::shared_ptr<const DnsCache::Entry> DnsCache::lookup_stale(const std::string& key, Clock::time_point now)
+{
+  auto& shard = this->shard(key);
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    return nullptr;
+  }
+
+  auto& slot = shard.slots[it->second];
+  if (slot.entry->expires + max_stale_ <= now) {
+    return nullptr;
+  }
+  return slot.entry;
+}
+
+void DnsCache::insert(
+        std::string_view name, std::uint16_t type, const DnsMessage& response, Clock::time_point now)
+{
+  insert(make_key(name, type), response, now);
+}
+
+void DnsCache::insert(const std::string& key, const DnsMessage& response, Clock::time_point now)
+{
+  auto ttl = response_ttl(response, max_ttl_, max_negative_ttl_);
+  if (ttl == 0) {
+    return;
+  }
+
+  // Copy the response outside of the lock.
+  auto entry = std::make_shared<Entry>();
+  entry->key = key;
+  entry->response.assign(response.data(), response.data() + response.size());
+  entry->message.parse(entry->response.data(), entry->response.size());
+  entry->stored = now;
+  entry->expires = now + std::chrono::seconds(ttl);
+  entry->ttl = ttl;
+
+  auto& shard = this->shard(entry->key);
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.index.find(entry->key);
+  if (it != shard.index.end()) {
+    // Refresh the existing entry in place.
+    shard.slots[it->second] = {std::move(entry), true};
+    return;
+  }
+
+  // Advance the hand to a slot that is either free, expired (past serving stale)
+  // or not referenced since the hand passed it last time.
+  for (;;) {
+    auto& slot = shard.slots[shard.hand];
+    if (!slot.entry || slot.entry->expires + max_stale_ <= now || !slot.referenced) {
+      break;
+    }
+    slot.referenced = false;
+    shard.hand = (shard.hand + 1) % shard.slots.size();
+  }
+
+  auto& slot = shard.slots[shard.hand];
+  if (slot.entry) {
+    shard.index.erase(slot.entry->key);
+  }
+  shard.index.emplace(entry->key, shard.hand);
+  slot = {std::move(entry), false};
+  shard.hand = (shard.hand + 1) % shard.slots.size();
+}
+
+std::uint32_t DnsCache::response_ttl(
+        const DnsMessage& response, std::uint32_t max_ttl, std::uint32_t max_negative_ttl)
+{
+  if (response.tc() || (response.rcode() != ns_r_noerror && response.rcode() != ns_r_nxdomain)) {
+    return 0;
+  }
+
+  DnsRecordReader reader(response);
+  DnsRecord rr;
+  std::uint32_t ttl = UINT32_MAX;
+  bool answers = false;
+
+  while (reader.next(rr)) {
+    if (reader.section() == ns_s_an) {
+      answers = true;
+      ttl = std::min(ttl, rr.ttl);
+    }
+    else if (reader.section() == ns_s_ns && !answers) {
+      if (rr.type != ns_t_soa) {
+        continue;
+      }
+
+      // Negative response: the lower of the SOA's TTL and its MINIMUM field.
+      auto soa = rr.soa();
+      if (!soa) {
+        return 0;
+      }
+      ttl = std::min({ttl, rr.ttl, soa->minimum});
+      return std::min(ttl, max_negative_ttl);
+    }
+    else {
+      break;
+    }
+  }
+
+  if (reader.error() || !answers || response.rcode() != ns_r_noerror) {
+    // Negative responses without SOA are not cached.
+    return 0;
+  }
+  return std::min(ttl, max_ttl);
+}
@@ -0,0 +1,115 @@
+// dns-cache.hpp
+
+#pragma once
+
+#include "dns-message.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+//
+// Response cache
+//
+// Caches whole responses in the wire format, keyed by the (case-insensitive)
+// name and the query type. Positive responses are cached for the lowest TTL
+// of their answers, negative ones (NXDOMAIN and NODATA) for the SOA minimum
+// as per RFC 2308; anything else is not cached.
+//
+// The cache is split into independently locked shards, each holding a fixed
+// number of entries evicted with the CLOCK (second chance) policy, so a hit
+// only sets a flag instead of reordering a list. Expired entries are kept
+// (as long as the CLOCK spares them, as they get no hits) for up to
+// max_stale seconds, to be served stale (RFC 8767) by lookup_stale().
+//
+class DnsCache
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry
+  {
+    std::string key;
+    std::vector<unsigned char> response;
+    DnsMessage message;  // parsed response
+    Clock::time_point stored;
+    Clock::time_point expires;
+    std::uint32_t ttl;  // seconds stored for
+
+    // Of the users of the cache, e.g. to refresh popular entries ahead of their expiry.
+    mutable std::atomic<std::uint32_t> hits{0};
+    mutable std::atomic<bool> refreshing{false};
+
+    // Seconds the entry has spent in the cache, to be subtracted from the TTLs.
+    std::uint32_t age(Clock::time_point now) const
+    {
+      return std::chrono::duration_cast<std::chrono::seconds>(now - stored).count();
+    }
+  };
+
+  DnsCache(std::size_t max_entries,
+           std::uint32_t max_ttl = 86400,
+           std::uint32_t max_negative_ttl = 3600,
+           std::uint32_t max_stale = 0,
+           std::size_t n_shards = 16);
+
+  // Returns the unexpired entry or nullptr. The entry stays valid as long as
+  // it is referenced, even if evicted meanwhile.
+  std::shared_ptr<const Entry> lookup(std::string_view name, std::uint16_t type, Clock::time_point now);
+
+  // Stores the response if it is cacheable.
+  void insert(std::string_view name, std::uint16_t type, const DnsMessage& response, Clock::time_point now);
+
+  // The key of the entry of a name and type, and the above by the key, e.g. kept by the caller to
+  // look a name up repeatedly without folding it each time.
+  static std::string key(std::string_view name, std::uint16_t type) { return make_key(name, type); }
+  std::shared_ptr<const Entry> lookup(const std::string& key, Clock::time_point now);
+  void insert(const std::string& key, const DnsMessage& response, Clock::time_point now);
+
+  // Returns the entry, expired for up to max_stale seconds or not, or nullptr. Counts neither as
+  // a hit nor as a miss.
+  std::shared_ptr<const Entry> lookup_stale(std::string_view name, std::uint16_t type, Clock::time_point now);
+  std::shared_ptr<const Entry> lookup_stale(const std::string& key, Clock::time_point now);
+
+  std::size_t hits() const { return hits_.load(std::memory_order_relaxed); }
+  std::size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+  // Returns for how long the response may be cached (0 == not cacheable).
+  static std::uint32_t response_ttl(const DnsMessage& response,
+                                    std::uint32_t max_ttl, std::uint32_t max_negative_ttl);
+
+private:
+  struct Slot
+  {
+    std::shared_ptr<const Entry> entry;
+    bool referenced = false;
+  };
+
+  struct Shard
+  {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::size_t> index;  // key -> slot
+    std::vector<Slot> slots;  // the CLOCK ring
+    std::size_t hand = 0;
+  };
+
+  // Builds the key into a thread-local buffer, so lookups do not allocate.
+  static const std::string& make_key(std::string_view name, std::uint16_t type);
+
+  Shard& shard(const std::string& key);
+
+  const std::uint32_t max_ttl_;
+  const std::uint32_t max_negative_ttl_;
+  const std::chrono::seconds max_stale_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<std::size_t> hits_{0};
+  std::atomic<std::size_t> misses_{0};
+};
@@ -0,0 +1,571 @@
+// dns-message.cpp
+
+#include "dns-message.hpp"
+
+#include <algorithm>
+#include <cstring>  // std::memset, std::memcpy
+
+
+std::size_t dns_encode_name(unsigned char* buf, std::size_t size, std::string_view name)
+{
+  // The root name is either empty or a single dot.
+  if (name == ".") {
+    name = {};
+  }
+
+  const std::size_t max = std::min<std::size_t>(size, NS_MAXCDNAME);
+  if (max == 0) {
+    return 0;
+  }
+
+  std::size_t label = 0;  // offset of the current label's length octet
+  std::size_t pos = 1;
+
+  for (std::size_t i = 0; i < name.size(); ++i) {
+    unsigned char c = name[i];
+
+    if (c == '.') {
+      // Empty labels are not allowed (the trailing dot is fine though).
+      if (pos - label == 1) {
+        return 0;
+      }
+      buf[label] = pos - label - 1;
+      label = pos++;
+      if (pos > max) {
+        return 0;
+      }
+      continue;
+    }
+
+    if (c == '\\') {
+      if (++i == name.size()) {
+        return 0;
+      }
+      c = name[i];
+      if (c >= '0' && c <= '9') {
+        // \DDD
+        if (i + 2 >= name.size()) {
+          return 0;
+        }
+        unsigned int v = 0;
+        for (std::size_t j = 0; j < 3; ++j) {
+          char d = name[i + j];
+          if (d < '0' || d > '9') {
+            return 0;
+          }
+          v = v * 10 + (d - '0');
+        }
+        if (v > 255) {
+          return 0;
+        }
+        i += 2;
+        c = v;
+      }
+    }
+
+    if (pos - label - 1 == NS_MAXLABEL || pos >= max) {
+      return 0;
+    }
+    buf[pos++] = c;
+  }
+
+  // Close the last label unless the name ended with a dot.
+  if (pos - label > 1) {
+    if (pos >= max) {
+      return 0;
+    }
+    buf[label] = pos - label - 1;
+    label = pos++;
+  }
+  buf[label] = 0;
+
+  return pos;
+}
+
+std::size_t dns_encode_query(unsigned char* buf, std::size_t size,
+                             std::uint16_t id,
+                             std::string_view name,
+                             std::uint16_t qtype,
+                             std::uint16_t qclass)
+{
+  if (size < NS_HFIXEDSZ + NS_QFIXEDSZ) {
+    return 0;
+  }
+
+  std::memset(buf, 0, NS_HFIXEDSZ);
+  dns_put16(id, buf);
+  buf[2] = 0x01;  // QR=0, OPCODE=QUERY, RD=1
+  dns_put16(1, buf + 4);  // QDCOUNT
+
+  auto name_len = dns_encode_name(buf + NS_HFIXEDSZ, size - NS_HFIXEDSZ - NS_QFIXEDSZ, name);
+  if (name_len == 0) {
+    return 0;
+  }
+
+  auto* p = buf + NS_HFIXEDSZ + name_len;
+  dns_put16(qtype, p);
+  dns_put16(qclass, p + 2);
+
+  return NS_HFIXEDSZ + name_len + NS_QFIXEDSZ;
+}
+
+std::size_t dns_encode_opt(unsigned char* buf, std::size_t size, std::size_t len, const DnsEdns& edns)
+{
+  // The optional ECS option: FAMILY, SOURCE PREFIX-LENGTH, SCOPE PREFIX-LENGTH and as many octets
+  // of ADDRESS as the prefix covers.
+  unsigned char ecs[NS_INT16SZ + 2 + NS_IN6ADDRSZ];
+  std::size_t ecs_len = 0;
+
+  if (!edns.client_subnet.is_unspecified()) {
+    const auto& subnet = edns.client_subnet;
+    const unsigned int prefix = edns.client_subnet_prefix;
+
+    if (prefix > (subnet.is_v4() ? 32 : 128)) {
+      return 0;
+    }
+
+    if (subnet.is_v4()) {
+      auto bytes = subnet.to_v4().to_bytes();
+      std::memcpy(ecs + 4, bytes.data(), bytes.size());
+      dns_put16(1, ecs);  // FAMILY: IPv4
+    }
+    else {
+      auto bytes = subnet.to_v6().to_bytes();
+      std::memcpy(ecs + 4, bytes.data(), bytes.size());
+      dns_put16(2, ecs);  // FAMILY: IPv6
+    }
+
+    ecs[2] = prefix;
+    ecs[3] = 0;
+
+    auto addr_len = (prefix + 7) / 8;
+    if (prefix % 8) {
+      ecs[4 + addr_len - 1] &= 0xff << (8 - prefix % 8);
+    }
+    ecs_len = 4 + addr_len;
+  }
+
+  const std::size_t rdlength = ecs_len ? 2 * NS_INT16SZ + ecs_len : 0;
+  if (len < NS_HFIXEDSZ || len + 1 + NS_RRFIXEDSZ + rdlength > size) {
+    return 0;
+  }
+
+  // The root owner, TYPE, CLASS == UDP payload size, TTL == extended RCODE, VERSION and flags.
+  auto* p = buf + len;
+  p[0] = 0;
+  dns_put16(ns_t_opt, p + 1);
+  dns_put16(edns.udp_size, p + 3);
+  p[5] = 0;
+  p[6] = 0;
+  dns_put16(edns.dnssec_ok ? NS_OPT_DNSSEC_OK : 0, p + 7);
+  dns_put16(rdlength, p + 9);
+  p += 1 + NS_RRFIXEDSZ;
+
+  if (ecs_len) {
+    dns_put16(8, p);  // OPTION-CODE: edns-client-subnet
+    dns_put16(ecs_len, p + 2);
+    std::memcpy(p + 4, ecs, ecs_len);
+  }
+
+  dns_put16(dns_get16(buf + 10) + 1, buf + 10);  // ARCOUNT
+  return len + 1 + NS_RRFIXEDSZ + rdlength;
+}
+
+std::size_t dns_skip_name(const unsigned char* msg, std::size_t len, std::size_t offset)
+{
+  while (offset < len) {
+    unsigned char l = msg[offset];
+
+    if ((l & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+      // A pointer ends the name.
+      return offset + 2 <= len ? offset + 2 : 0;
+    }
+    if (l & NS_CMPRSFLGS) {
+      // Reserved label types.
+      return 0;
+    }
+    if (l == 0) {
+      return offset + 1;
+    }
+    offset += 1 + l;
+  }
+  return 0;
+}
+
+std::size_t DnsName::decode(char* buf, std::size_t size) const
+{
+  std::size_t offset = offset_;
+  std::size_t pos = 0;
+  std::size_t wire_len = 0;
+
+  while (offset < msg_len_) {
+    unsigned char l = msg_[offset];
+
+    if ((l & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+      if (offset + 2 > msg_len_) {
+        return 0;
+      }
+      // Only pointers to prior data are allowed, which also rules out loops.
+      std::size_t target = dns_get16(msg_ + offset) & 0x3fff;
+      if (target >= offset) {
+        return 0;
+      }
+      offset = target;
+      continue;
+    }
+    if (l & NS_CMPRSFLGS) {
+      return 0;
+    }
+
+    if (l == 0) {
+      if (pos == 0) {
+        if (size < 1) {
+          return 0;
+        }
+        buf[pos++] = '.';
+      }
+      return pos;
+    }
+
+    // The labels and the root label must fit in NS_MAXCDNAME octets.
+    wire_len += 1 + l;
+    if (wire_len >= NS_MAXCDNAME || offset + 1 + l > msg_len_) {
+      return 0;
+    }
+
+    if (pos > 0) {
+      if (pos >= size) {
+        return 0;
+      }
+      buf[pos++] = '.';
+    }
+
+    for (const unsigned char* p = msg_ + offset + 1; p < msg_ + offset + 1 + l; ++p) {
+      unsigned char c = *p;
+
+      // Escape the same characters as ns_name_ntop() does.
+      if (c == '.' || c == ';' || c == '\\' || c == '(' || c == ')' ||
+          c == '@' || c == '$' || c == '"') {
+        if (pos + 2 > size) {
+          return 0;
+        }
+        buf[pos++] = '\\';
+        buf[pos++] = c;
+      }
+      else if (c <= 0x20 || c >= 0x7f) {
+        if (pos + 4 > size) {
+          return 0;
+        }
+        buf[pos++] = '\\';
+        buf[pos++] = '0' + c / 100;
+        buf[pos++] = '0' + (c / 10) % 10;
+        buf[pos++] = '0' + c % 10;
+      }
+      else {
+        if (pos >= size) {
+          return 0;
+        }
+        buf[pos++] = c;
+      }
+    }
+
+    offset += 1 + l;
+  }
+
+  return 0;
+}
+
+std::string DnsName::to_string() const
+{
+  char buf[NS_MAXDNAME];
+  return std::string(buf, decode(buf, sizeof(buf)));
+}
+
+bool DnsMessage::parse(const unsigned char* msg, std::size_t len)
+{
+  if (len < NS_HFIXEDSZ) {
+    return false;
+  }
+
+  msg_ = msg;
+  len_ = len;
+
+  // Skip the question section.
+  std::size_t pos = NS_HFIXEDSZ;
+  for (std::size_t i = 0; i < count(ns_s_qd); ++i) {
+    pos = dns_skip_name(msg_, len_, pos);
+    if (pos == 0 || pos + NS_QFIXEDSZ > len_) {
+      return false;
+    }
+    pos += NS_QFIXEDSZ;
+  }
+
+  records_ = pos;
+  return true;
+}
+
+bool DnsRecordReader::next(DnsRecord& rr)
+{
+  if (error_) {
+    return false;
+  }
+
+  // Move on to the next non-empty section.
+  while (index_ == msg_->count(section_)) {
+    if (section_ == ns_s_ar) {
+      return false;
+    }
+    section_ = ns_sect(section_ + 1);
+    index_ = 0;
+  }
+
+  const auto* msg = msg_->data();
+  const auto len = msg_->size();
+
+  auto pos = dns_skip_name(msg, len, pos_);
+  if (pos == 0 || pos + NS_RRFIXEDSZ > len) {
+    error_ = true;
+    return false;
+  }
+
+  rr.msg = msg;
+  rr.msg_len = len;
+  rr.name = DnsName(msg, len, pos_);
+  rr.type = dns_get16(msg + pos);
+  rr.rclass = dns_get16(msg + pos + 2);
+  rr.ttl = dns_get32(msg + pos + 4);
+  rr.rdlength = dns_get16(msg + pos + 8);
+  rr.rdata = msg + pos + NS_RRFIXEDSZ;
+
+  pos += NS_RRFIXEDSZ + rr.rdlength;
+  if (pos > len) {
+    error_ = true;
+    return false;
+  }
+
+  pos_ = pos;
+  ++index_;
+  return true;
+}
+
+bool DnsMessage::has_opt() const
+{
+  DnsRecordReader reader(*this);
+  DnsRecord rr;
+
+  while (reader.next(rr)) {
+    if (reader.section() == ns_s_ar && rr.type == ns_t_opt) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DnsMessage::matches_question(const unsigned char* query, std::size_t query_len) const
+{
+  if (count(ns_s_qd) != 1 || query_len < NS_HFIXEDSZ) {
+    return false;
+  }
+
+  const auto end = dns_skip_name(query, query_len, NS_HFIXEDSZ);
+  if (end == 0 || end + NS_QFIXEDSZ > query_len || records_ != end + NS_QFIXEDSZ) {
+    return false;
+  }
+
+  // The name of the query is not compressed, nor can the name of the response be (there is
+  // nothing before it to point to), so the labels line up octet by octet. The length octets
+  // (at most 63) are no letters, i.e. the same folded.
+  auto fold = [](unsigned char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; };
+  for (std::size_t i = NS_HFIXEDSZ; i < end; ++i) {
+    if (fold(msg_[i]) != fold(query[i])) {
+      return false;
+    }
+  }
+  return std::memcmp(msg_ + end, query + end, NS_QFIXEDSZ) == 0;  // QTYPE and QCLASS
+}
+
+DnsResponse::DnsResponse(const DnsResponseView& response)
+{
+  if (!response.empty()) {
+    assign(response.message().data(), response.message().size());
+    age_ = response.age();
+  }
+}
+
+DnsResponse::DnsResponse(const DnsResponse& other)
+  : age_(other.age_)
+{
+  assign(other.data_.data(), other.data_.size());
+}
+
+DnsResponse& DnsResponse::operator=(const DnsResponse& other)
+{
+  if (this != &other) {
+    assign(other.data_.data(), other.data_.size());
+    age_ = other.age_;
+  }
+  return *this;
+}
+
+void DnsResponse::assign(const unsigned char* data, std::size_t size)
+{
+  data_.assign(data, data + size);
+  msg_ = DnsMessage();
+
+  // The message was parsed already, so this can't fail.
+  if (!data_.empty()) {
+    msg_.parse(data_.data(), data_.size());
+  }
+}
+
+boost::asio::ip::address DnsRecord::address() const
+{
+  if (type == ns_t_a && rdlength == NS_INADDRSZ) {
+    return boost::asio::ip::address_v4(dns_get32(rdata));
+  }
+  if (type == ns_t_aaaa && rdlength == NS_IN6ADDRSZ) {
+    boost::asio::ip::address_v6::bytes_type bytes;
+    std::memcpy(bytes.data(), rdata, bytes.size());
+    return boost::asio::ip::address_v6(bytes);
+  }
+  return {};
+}
+
+std::size_t DnsRecord::skip_rdata_name(std::size_t offset) const
+{
+  auto begin = std::size_t(rdata - msg);
+  auto end = dns_skip_name(msg, begin + rdlength, begin + offset);
+  return end ? end - begin : 0;
+}
+
+std::optional<DnsName> DnsRecord::target() const
+{
+  if ((type != ns_t_cname && type != ns_t_dname && type != ns_t_ns && type != ns_t_ptr) ||
+      skip_rdata_name(0) != rdlength) {
+    return std::nullopt;
+  }
+  return rdata_name();
+}
+
+std::optional<DnsMx> DnsRecord::mx() const
+{
+  if (type != ns_t_mx || rdlength < NS_INT16SZ || skip_rdata_name(NS_INT16SZ) != rdlength) {
+    return std::nullopt;
+  }
+  return DnsMx{dns_get16(rdata), rdata_name(NS_INT16SZ)};
+}
+
+std::optional<DnsSrv> DnsRecord::srv() const
+{
+  if (type != ns_t_srv || rdlength < 3 * NS_INT16SZ || skip_rdata_name(3 * NS_INT16SZ) != rdlength) {
+    return std::nullopt;
+  }
+  return DnsSrv{dns_get16(rdata), dns_get16(rdata + 2), dns_get16(rdata + 4), rdata_name(3 * NS_INT16SZ)};
+}
+
+std::optional<DnsSoa> DnsRecord::soa() const
+{
+  if (type != ns_t_soa) {
+    return std::nullopt;
+  }
+
+  auto rname = skip_rdata_name(0);
+  auto numbers = rname ? skip_rdata_name(rname) : 0;
+  if (numbers == 0 || numbers + 5 * NS_INT32SZ != rdlength) {
+    return std::nullopt;
+  }
+
+  const auto* p = rdata + numbers;
+  return DnsSoa{rdata_name(0), rdata_name(rname),
+                dns_get32(p), dns_get32(p + 4), dns_get32(p + 8), dns_get32(p + 12), dns_get32(p + 16)};
+}
+
+std::optional<DnsTxtRange> DnsRecord::txt() const
+{
+  if (type != ns_t_txt) {
+    return std::nullopt;
+  }
+
+  // Validate the whole rdata up front, so that the iteration does not end early.
+  std::size_t pos = 0;
+  while (pos < rdlength) {
+    pos += 1 + rdata[pos];
+  }
+  if (pos != rdlength) {
+    return std::nullopt;
+  }
+  return DnsTxtRange{{rdata, rdata + rdlength}, {}};
+}
+
+std::optional<DnsSvcb> DnsRecord::svcb() const
+{
+  if ((type != 64 && type != 65) || rdlength < NS_INT16SZ) {  // SVCB, HTTPS
+    return std::nullopt;
+  }
+
+  auto params = skip_rdata_name(NS_INT16SZ);
+  if (params == 0) {
+    return std::nullopt;
+  }
+
+  // Validate the params up front, so that the iteration does not end early.
+  std::size_t pos = params;
+  while (pos + 2 * NS_INT16SZ <= rdlength) {
+    pos += 2 * NS_INT16SZ + dns_get16(rdata + pos + 2);
+  }
+  if (pos != rdlength) {
+    return std::nullopt;
+  }
+  return DnsSvcb{dns_get16(rdata), rdata_name(NS_INT16SZ), {{rdata + params, rdata + rdlength}, {}}};
+}
+
+std::size_t dns_decode_character_string(const unsigned char* p, const unsigned char* end, std::string_view& item)
+{
+  std::size_t len = p[0];
+  if (p + 1 + len > end) {
+    return 0;
+  }
+  item = std::string_view(reinterpret_cast<const char*>(p + 1), len);
+  return 1 + len;
+}
+
+std::size_t dns_decode_svc_param(const unsigned char* p, const unsigned char* end, DnsSvcParam& item)
+{
+  if (p + 2 * NS_INT16SZ > end) {
+    return 0;
+  }
+
+  item.key = dns_get16(p);
+  item.length = dns_get16(p + 2);
+  item.value = p + 2 * NS_INT16SZ;
+  if (item.value + item.length > end) {
+    return 0;
+  }
+  return 2 * NS_INT16SZ + item.length;
+}
+
+DnsRecordIterator::DnsRecordIterator(const DnsMessage& msg, ns_sect section, std::uint32_t age)
+  : reader_(std::in_place, msg),
+    section_(section),
+    age_(age),
+    end_(false)
+{
+  // Skip the RRs of the preceding sections.
+  while (reader_->next(rr_)) {
+    if (reader_->section() >= section_) {
+      end_ = (reader_->section() != section_);
+      rr_.ttl -= std::min(rr_.ttl, age_);
+      return;
+    }
+  }
+  end_ = true;
+}
+
+void DnsRecordIterator::advance()
+{
+  if (!reader_->next(rr_) || reader_->section() != section_) {
+    end_ = true;
+    return;
+  }
+  rr_.ttl -= std::min(rr_.ttl, age_);
+}
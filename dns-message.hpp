@@ -0,0 +1,459 @@
+// dns-message.hpp
+
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <arpa/nameser.h>
+
+
+//
+// DNS wire format encoding
+//
+// The functions write into a caller supplied buffer and never allocate.
+// They return the number of bytes written or 0 if the input is invalid or
+// does not fit into the buffer.
+//
+
+// Encodes the presentation format name (e.g. "www.example.com", optionally
+// with the trailing dot and \X or \DDD escapes) into the wire format.
+std::size_t dns_encode_name(unsigned char* buf, std::size_t size, std::string_view name);
+
+// Encodes a recursive (RD=1) query with a single question.
+std::size_t dns_encode_query(unsigned char* buf, std::size_t size,
+                             std::uint16_t id,
+                             std::string_view name,
+                             std::uint16_t qtype,
+                             std::uint16_t qclass = ns_c_in);
+
+// EDNS(0) parameters of a query (RFC 6891).
+struct DnsEdns
+{
+  // The UDP payload size advertised (0 == no EDNS). The default avoids IP fragmentation, as
+  // recommended by the DNS flag day 2020.
+  std::uint16_t udp_size = 1232;
+
+  bool dnssec_ok = false;  // the DO bit
+
+  // EDNS Client Subnet (RFC 7871), unless unspecified. The address is cut to the prefix.
+  boost::asio::ip::address client_subnet;
+  std::uint8_t client_subnet_prefix = 0;
+};
+
+// Appends an OPT RR to the message of len bytes in buf and bumps its ARCOUNT.
+// Returns the new length of the message.
+std::size_t dns_encode_opt(unsigned char* buf, std::size_t size, std::size_t len, const DnsEdns& edns);
+
+// Big-endian accessors of the wire format fields.
+inline std::uint16_t dns_get16(const unsigned char* p)
+{
+  return (std::uint16_t(p[0]) << 8) | p[1];
+}
+
+inline std::uint32_t dns_get32(const unsigned char* p)
+{
+  return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | p[3];
+}
+
+inline void dns_put16(std::uint16_t v, unsigned char* p)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+
+//
+// DNS wire format decoding
+//
+// DnsMessage validates the header and skips the question section of a
+// message; DnsRecordReader then walks the remaining sections in a single
+// pass, one RR at a time. Everything is bounds-checked and refers to the
+// message buffer, which must outlive the views. Names are not decoded
+// until asked for.
+//
+
+// A possibly compressed name inside a message.
+class DnsName
+{
+public:
+  DnsName() = default;
+  DnsName(const unsigned char* msg, std::size_t msg_len, std::size_t offset)
+    : msg_(msg), msg_len_(msg_len), offset_(offset)
+  {}
+
+  // Decodes the name into the presentation format (no trailing dot, "." for
+  // the root) without allocating. Returns the length of the decoded name or
+  // 0 if the name is malformed or does not fit. The buffer is not
+  // NUL-terminated.
+  std::size_t decode(char* buf, std::size_t size) const;
+
+  // Returns the decoded name or an empty string if the name is malformed.
+  std::string to_string() const;
+
+private:
+  const unsigned char* msg_ = nullptr;
+  std::size_t msg_len_ = 0;
+  std::size_t offset_ = 0;
+};
+
+// Forward iterator over the items packed in an rdata, e.g. the
+// character-strings of a TXT RR. DECODE reads the item at p (not past end)
+// and returns its size, or 0 if it is malformed, which ends the iteration.
+template<typename T, std::size_t (*DECODE)(const unsigned char* p, const unsigned char* end, T& item)>
+class DnsRdataIterator
+{
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const T*;
+  using reference = const T&;
+
+  // End iterator.
+  DnsRdataIterator() = default;
+
+  DnsRdataIterator(const unsigned char* p, const unsigned char* end) : p_(p), end_(end) { decode(); }
+
+  reference operator*() const { return item_; }
+  pointer operator->() const { return &item_; }
+
+  DnsRdataIterator& operator++()
+  {
+    p_ += size_;
+    decode();
+    return *this;
+  }
+
+  DnsRdataIterator operator++(int)
+  {
+    auto it = *this;
+    ++*this;
+    return it;
+  }
+
+  bool operator==(const DnsRdataIterator& other) const { return p_ == other.p_; }
+  bool operator!=(const DnsRdataIterator& other) const { return !(*this == other); }
+
+private:
+  void decode()
+  {
+    size_ = p_ < end_ ? DECODE(p_, end_, item_) : 0;
+    if (size_ == 0) {
+      p_ = nullptr;  // the end
+    }
+  }
+
+  const unsigned char* p_ = nullptr;
+  const unsigned char* end_ = nullptr;
+  std::size_t size_ = 0;
+  T item_{};
+};
+
+template<typename Iterator>
+struct DnsRdataRange
+{
+  Iterator first;
+  Iterator last;
+
+  Iterator begin() const { return first; }
+  Iterator end() const { return last; }
+  bool empty() const { return first == last; }
+};
+
+std::size_t dns_decode_character_string(const unsigned char* p, const unsigned char* end, std::string_view& item);
+
+// Key and value of a SvcParam of a SVCB or HTTPS RR (RFC 9460).
+struct DnsSvcParam
+{
+  std::uint16_t key;
+  const unsigned char* value;
+  std::uint16_t length;
+};
+
+std::size_t dns_decode_svc_param(const unsigned char* p, const unsigned char* end, DnsSvcParam& item);
+
+using DnsTxtRange = DnsRdataRange<DnsRdataIterator<std::string_view, dns_decode_character_string>>;
+using DnsSvcParamRange = DnsRdataRange<DnsRdataIterator<DnsSvcParam, dns_decode_svc_param>>;
+
+// Typed rdata of the common RR types.
+struct DnsMx
+{
+  std::uint16_t preference;
+  DnsName exchange;
+};
+
+struct DnsSrv
+{
+  std::uint16_t priority;
+  std::uint16_t weight;
+  std::uint16_t port;
+  DnsName target;
+};
+
+struct DnsSoa
+{
+  DnsName mname;
+  DnsName rname;
+  std::uint32_t serial;
+  std::uint32_t refresh;
+  std::uint32_t retry;
+  std::uint32_t expire;
+  std::uint32_t minimum;
+};
+
+struct DnsSvcb
+{
+  std::uint16_t priority;  // 0 == AliasMode
+  DnsName target;
+  DnsSvcParamRange params;
+};
+
+struct DnsRecord
+{
+  DnsName name;
+  std::uint16_t type;
+  std::uint16_t rclass;
+  std::uint32_t ttl;
+  const unsigned char* rdata;
+  std::uint16_t rdlength;
+
+  const unsigned char* msg;  // the message the RR is part of
+  std::size_t msg_len;
+
+  // Name stored in the rdata at the offset, e.g. the target of a CNAME.
+  DnsName rdata_name(std::size_t offset = 0) const
+  {
+    return DnsName(msg, msg_len, rdata - msg + offset);
+  }
+
+  // Address of an A or AAAA RR, unspecified address for anything else.
+  boost::asio::ip::address address() const;
+
+  // The typed rdata decoders return nullopt if the RR is of another type or
+  // its rdata is malformed.
+
+  // The name of a CNAME, DNAME, NS or PTR RR.
+  std::optional<DnsName> target() const;
+
+  std::optional<DnsMx> mx() const;
+  std::optional<DnsSrv> srv() const;
+  std::optional<DnsSoa> soa() const;
+
+  // The character-strings of a TXT RR.
+  std::optional<DnsTxtRange> txt() const;
+
+  // SVCB or HTTPS RR.
+  std::optional<DnsSvcb> svcb() const;
+
+private:
+  // Offset just after the name at the offset of the rdata, 0 if the name does
+  // not end within the rdata.
+  std::size_t skip_rdata_name(std::size_t offset) const;
+};
+
+class DnsMessage
+{
+public:
+  // Returns false if the message is malformed.
+  bool parse(const unsigned char* msg, std::size_t len);
+
+  const unsigned char* data() const { return msg_; }
+  std::size_t size() const { return len_; }
+
+  std::uint16_t id() const { return dns_get16(msg_); }
+  bool qr() const { return msg_[2] & 0x80; }
+  unsigned int opcode() const { return (msg_[2] >> 3) & 0x0f; }
+  bool aa() const { return msg_[2] & 0x04; }
+  bool tc() const { return msg_[2] & 0x02; }
+  bool rd() const { return msg_[2] & 0x01; }
+  bool ra() const { return msg_[3] & 0x80; }
+  unsigned int rcode() const { return msg_[3] & 0x0f; }
+
+  std::uint16_t count(ns_sect section) const { return dns_get16(msg_ + 4 + 2 * section); }
+
+  // Offset of the first RR after the question section.
+  std::size_t records_offset() const { return records_; }
+
+  // Whether the additional section has an OPT RR, i.e. the sender supports EDNS.
+  bool has_opt() const;
+
+  // Whether the question section is the single question of the query of query_len bytes, as
+  // encoded by dns_encode_query() (the names compared case-insensitively).
+  bool matches_question(const unsigned char* query, std::size_t query_len) const;
+
+private:
+  const unsigned char* msg_ = nullptr;
+  std::size_t len_ = 0;
+  std::size_t records_ = 0;
+};
+
+class DnsRecordReader
+{
+public:
+  explicit DnsRecordReader(const DnsMessage& msg)
+    : msg_(&msg), pos_(msg.records_offset())
+  {}
+
+  // Reads the next RR of the answer, authority or additional section.
+  // Returns false at the end or if the RR is malformed (see error()).
+  bool next(DnsRecord& rr);
+
+  // Section of the RR last read.
+  ns_sect section() const { return section_; }
+
+  bool error() const { return error_; }
+
+private:
+  const DnsMessage* msg_;
+  std::size_t pos_;
+  ns_sect section_ = ns_s_an;
+  std::size_t index_ = 0;  // within the section
+  bool error_ = false;
+};
+
+// Forward iterator over the RRs of one section.
+class DnsRecordIterator
+{
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = DnsRecord;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const DnsRecord*;
+  using reference = const DnsRecord&;
+
+  // End iterator.
+  DnsRecordIterator() = default;
+
+  // Iterator to the first RR of the section. The age (in seconds) is
+  // subtracted from the TTLs, e.g. of a cached response.
+  DnsRecordIterator(const DnsMessage& msg, ns_sect section, std::uint32_t age = 0);
+
+  reference operator*() const { return rr_; }
+  pointer operator->() const { return &rr_; }
+
+  DnsRecordIterator& operator++()
+  {
+    advance();
+    return *this;
+  }
+
+  DnsRecordIterator operator++(int)
+  {
+    auto it = *this;
+    advance();
+    return it;
+  }
+
+  bool operator==(const DnsRecordIterator& other) const
+  {
+    return end_ == other.end_ && (end_ || rr_.rdata == other.rr_.rdata);
+  }
+
+  bool operator!=(const DnsRecordIterator& other) const { return !(*this == other); }
+
+private:
+  void advance();
+
+  std::optional<DnsRecordReader> reader_;
+  ns_sect section_ = ns_s_an;
+  std::uint32_t age_ = 0;
+  DnsRecord rr_{};
+  bool end_ = true;
+};
+
+struct DnsRecordRange
+{
+  DnsRecordIterator first;
+  DnsRecordIterator last;
+
+  DnsRecordIterator begin() const { return first; }
+  DnsRecordIterator end() const { return last; }
+  bool empty() const { return first == last; }
+};
+
+//
+// Response view
+//
+// Non-owning view of a response passed to the query callbacks. It borrows
+// the receive buffer (or the cache entry), so it (and everything obtained
+// from it) is only valid for the duration of the callback. A default
+// constructed view is empty (there is no response, e.g. the query timed out).
+//
+class DnsResponseView
+{
+public:
+  DnsResponseView() = default;
+  explicit DnsResponseView(const DnsMessage& msg, std::uint32_t age = 0) : msg_(&msg), age_(age) {}
+
+  bool empty() const { return msg_ == nullptr; }
+
+  // Message of a non-empty view.
+  const DnsMessage& message() const { return *msg_; }
+
+  int rcode() const { return msg_ ? msg_->rcode() : 0; }
+  bool truncated() const { return msg_ && msg_->tc(); }
+
+  // Seconds since the response was received (0 unless it comes from the cache).
+  std::uint32_t age() const { return age_; }
+
+  // The TTLs of the RRs are decreased by the age.
+  DnsRecordRange records(ns_sect section) const
+  {
+    return msg_ ? DnsRecordRange{DnsRecordIterator(*msg_, section, age_), {}} : DnsRecordRange{};
+  }
+
+  DnsRecordRange answers() const { return records(ns_s_an); }
+
+private:
+  const DnsMessage* msg_ = nullptr;
+  std::uint32_t age_ = 0;
+};
+
+//
+// Owning copy of a response
+//
+// Unlike DnsResponseView it may outlive the callback, e.g. to be handed over
+// to a completion handler. A copy of an empty view is empty.
+//
+class DnsResponse
+{
+public:
+  DnsResponse() = default;
+  explicit DnsResponse(const DnsResponseView& response);
+
+  DnsResponse(const DnsResponse& other);
+  DnsResponse& operator=(const DnsResponse& other);
+
+  // The message keeps pointing to the moved buffer.
+  DnsResponse(DnsResponse&&) noexcept = default;
+  DnsResponse& operator=(DnsResponse&&) noexcept = default;
+
+  bool empty() const { return data_.empty(); }
+
+  DnsResponseView view() const { return empty() ? DnsResponseView() : DnsResponseView(msg_, age_); }
+  operator DnsResponseView() const { return view(); }
+
+  int rcode() const { return view().rcode(); }
+  std::uint32_t age() const { return age_; }
+  DnsRecordRange records(ns_sect section) const { return view().records(section); }
+  DnsRecordRange answers() const { return view().answers(); }
+
+private:
+  void assign(const unsigned char* data, std::size_t size);
+
+  std::vector<unsigned char> data_;
+  DnsMessage msg_;
+  std::uint32_t age_ = 0;
+};
+
+// Returns the offset just after the (possibly compressed) name at the offset
+// or 0 if the name runs past the end of the message.
+std::size_t dns_skip_name(const unsigned char* msg, std::size_t len, std::size_t offset);
@@ -0,0 +1,421 @@
+// fake-responder.cpp
+
+#include "fake-responder.hpp"
+#include "dns-message.hpp"
+#include "logging.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+#include <cstring>  // std::memcpy
+#include <string_view>
+
+
+namespace {
+
+// Rounds of receiving a batch before yielding to the other handlers.
+constexpr std::size_t MAX_RECEIVE_ROUNDS = 8;
+
+void put32(std::uint32_t v, unsigned char* p)
+{
+  dns_put16(v >> 16, p);
+  dns_put16(v, p + 2);
+}
+
+// Whether the label at the offset of the message starts with the (lowercase) prefix.
+bool label_starts_with(const unsigned char* msg, std::size_t offset, std::string_view prefix)
+{
+  std::size_t n = msg[offset];
+  if (n < prefix.size() || n > NS_MAXLABEL) {
+    return false;
+  }
+  for (std::size_t i = 0; i < prefix.size(); ++i) {
+    unsigned char c = msg[offset + 1 + i];
+    if ((c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c) != prefix[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// FNV-1a of the (uncompressed) name at the offset, case-insensitive.
+std::uint32_t name_hash(const unsigned char* msg, std::size_t len, std::size_t offset)
+{
+  std::uint32_t h = 2166136261u;
+  for (; offset < len && msg[offset] != 0; ++offset) {
+    unsigned char c = msg[offset];
+    h = (h ^ (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c)) * 16777619u;
+  }
+  return h;
+}
+
+}  // namespace
+
+
+struct FakeResponder::TcpConnection
+{
+  explicit TcpConnection(boost::asio::io_context& io) : socket(io) {}
+
+  boost::asio::ip::tcp::socket socket;
+  std::array<unsigned char, 2> length;
+  std::array<unsigned char, MAX_TCP_SIZE> request;
+  std::array<unsigned char, 2 + MAX_TCP_SIZE> response;
+};
+
+FakeResponder::FakeResponder(boost::asio::io_context& io,
+                             const boost::asio::ip::udp::endpoint& endpoint,
+                             const Options& options)
+  : io_(io),
+    options_(options),
+    socket_(io, endpoint),
+    acceptor_(io),
+    receives_(BATCH_SIZE, MAX_UDP_SIZE),
+    delay_timer_(io),
+    rng_(options.seed ? options.seed : std::random_device()())
+{
+  socket_.non_blocking(true);
+  endpoint_ = socket_.local_endpoint();
+
+  // The same port for TCP, as the clients expect.
+  boost::asio::ip::tcp::endpoint tcp_endpoint(endpoint_.address(), endpoint_.port());
+  acceptor_.open(tcp_endpoint.protocol());
+  acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  acceptor_.bind(tcp_endpoint);
+  acceptor_.listen();
+}
+
+void FakeResponder::start()
+{
+  start_receiving();
+  start_accepting();
+}
+
+void FakeResponder::stop()
+{
+  boost::asio::post(io_, [this]() {
+    socket_.close();
+    acceptor_.close();
+    delay_timer_.cancel();
+    delayed_.clear();
+    for (auto&& conn: connections_) {
+      conn->socket.close();
+    }
+    connections_.clear();
+  });
+}
+
+std::size_t FakeResponder::answer(const unsigned char* query, std::size_t len,
+                                  unsigned char* buf, std::size_t size,
+                                  std::size_t n_addresses, std::uint32_t ttl)
+{
+  DnsMessage msg;
+  if (!msg.parse(query, len) || msg.qr() || msg.count(ns_s_qd) != 1) {
+    return 0;
+  }
+
+  // The header and the question go back as they are.
+  const std::size_t question_end = msg.records_offset();
+  if (question_end > size) {
+    return 0;
+  }
+  std::memcpy(buf, query, question_end);
+
+  const std::uint16_t qtype = dns_get16(query + question_end - 4);
+  std::size_t pos = question_end;
+  std::uint16_t ancount = 0;
+  int rcode = msg.opcode() == ns_o_query ? ns_r_noerror : ns_r_notimpl;
+  bool truncated = false;
+
+  // The owner names point into the question, a CNAME target being a suffix of it.
+  std::size_t owner = NS_HFIXEDSZ;
+
+  auto add_rr = [&](std::uint16_t type, const unsigned char* rdata, std::uint16_t rdlength) {
+    if (pos + 2 + NS_RRFIXEDSZ + rdlength > size) {
+      truncated = true;
+      return false;
+    }
+    dns_put16(0xc000 | owner, buf + pos);
+    dns_put16(type, buf + pos + 2);
+    dns_put16(ns_c_in, buf + pos + 4);
+    put32(ttl, buf + pos + 6);
+    dns_put16(rdlength, buf + pos + 10);
+    std::memcpy(buf + pos + 12, rdata, rdlength);
+    pos += 2 + NS_RRFIXEDSZ + rdlength;
+    ++ancount;
+    return true;
+  };
+
+  while (rcode == ns_r_noerror && !truncated) {
+    if (label_starts_with(query, owner, "nx")) {
+      rcode = ns_r_nxdomain;
+      break;
+    }
+
+    auto target = owner + 1 + query[owner];
+    if (!label_starts_with(query, owner, "cname") || target >= question_end || query[target] == 0) {
+      break;
+    }
+
+    unsigned char rdata[2];
+    dns_put16(0xc000 | target, rdata);
+    if (!add_rr(ns_t_cname, rdata, sizeof(rdata)) || qtype == ns_t_cname) {
+      break;
+    }
+    owner = target;
+  }
+
+  if (rcode == ns_r_noerror && !truncated && (qtype == ns_t_a || qtype == ns_t_aaaa)) {
+    auto h = name_hash(query, question_end, owner);
+
+    for (std::size_t i = 0; i < n_addresses; ++i) {
+      std::uint32_t v = h + i;
+      if (qtype == ns_t_a) {
+        unsigned char rdata[4] = { 10, (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+        if (!add_rr(ns_t_a, rdata, sizeof(rdata))) {
+          break;
+        }
+      }
+      else {
+        unsigned char rdata[16] = { 0xfd };
+        put32(v, rdata + 12);
+        if (!add_rr(ns_t_aaaa, rdata, sizeof(rdata))) {
+          break;
+        }
+      }
+    }
+  }
+
+  if (truncated) {
+    pos = question_end;
+    ancount = 0;
+  }
+
+  // QR and AA set, the opcode and RD kept, RA clear.
+  buf[2] = 0x80 | 0x04 | (truncated ? 0x02 : 0) | (query[2] & 0x79);
+  buf[3] = rcode;
+  dns_put16(ancount, buf + 6);
+  dns_put16(0, buf + 8);
+  dns_put16(0, buf + 10);
+  return pos;
+}
+
+void FakeResponder::start_receiving()
+{
+  socket_.async_wait(boost::asio::ip::udp::socket::wait_read, [this](auto err) {
+    if (err) {
+      if (err != boost::asio::error::operation_aborted) {
+        ERR() << "fake responder: async_wait: " << err.message();
+      }
+      return;
+    }
+
+    for (std::size_t round = 0; round < MAX_RECEIVE_ROUNDS; ++round) {
+      auto received = receives_.receive(socket_, err);
+      if (err) {
+        if (err != boost::asio::error::would_block) {
+          ERR() << "fake responder: recvmmsg: " << err.message();
+        }
+        break;
+      }
+
+      for (std::size_t i = 0; i < received; ++i) {
+        handle_query(receives_.data(i), receives_.size(i), receives_.remote(i));
+      }
+      flush_sends();
+
+      if (received < receives_.capacity()) {
+        break;
+      }
+    }
+
+    arm_delay_timer();
+    start_receiving();
+  });
+}
+
+void FakeResponder::handle_query(const unsigned char* data, std::size_t size,
+                                 const boost::asio::ip::udp::endpoint& remote)
+{
+  received_.add();
+
+  if (roll(options_.loss)) {
+    dropped_.add();
+    return;
+  }
+
+  Delayed* delayed = nullptr;
+  unsigned char* buf;
+  if (options_.delay.count() > 0) {
+    delayed = &delayed_.emplace_back();
+    buf = delayed->data.data();
+  }
+  else {
+    buf = responses_[n_sends_].data();
+  }
+
+  auto len = answer(data, size, buf, MAX_UDP_SIZE, options_.n_addresses, options_.ttl);
+  if (len == 0) {
+    DBG() << "fake responder: malformed query from " << remote;
+    if (delayed) {
+      delayed_.pop_back();
+    }
+    return;
+  }
+
+  if (roll(options_.truncation)) {
+    // Just the question, the client is to come back over TCP.
+    DnsMessage msg;
+    msg.parse(buf, len);
+    len = msg.records_offset();
+    buf[2] |= 0x02;
+    dns_put16(0, buf + 6);
+    truncated_.add();
+  }
+
+  if (roll(options_.id_mismatch)) {
+    dns_put16(dns_get16(buf) + 1, buf);
+    mismatched_.add();
+  }
+
+  if (delayed) {
+    delayed->due = Clock::now() + options_.delay;
+    delayed->remote = remote;
+    delayed->size = len;
+    return;
+  }
+
+  remotes_[n_sends_] = remote;
+  sends_[n_sends_] = UdpDatagram{buf, len, &remotes_[n_sends_]};
+  if (++n_sends_ == BATCH_SIZE) {
+    flush_sends();
+  }
+}
+
+void FakeResponder::flush_sends()
+{
+  if (n_sends_ == 0) {
+    return;
+  }
+
+  boost::system::error_code err;
+  auto sent = udp_send_batch(socket_, sends_.data(), n_sends_, err);
+  if (err && err != boost::asio::error::would_block) {
+    ERR() << "fake responder: sendmmsg: " << err.message();
+  }
+
+  // Whatever did not fit in the socket buffer is lost, like on a busy nameserver.
+  answered_.add(sent);
+  dropped_.add(n_sends_ - sent);
+  n_sends_ = 0;
+}
+
+void FakeResponder::arm_delay_timer()
+{
+  if (delayed_.empty() || delay_timer_armed_) {
+    return;
+  }
+
+  delay_timer_armed_ = true;
+  delay_timer_.expires_at(delayed_.front().due);
+  delay_timer_.async_wait([this](auto err) {
+    delay_timer_armed_ = false;
+    if (err) {
+      return;
+    }
+    send_delayed();
+    arm_delay_timer();
+  });
+}
+
+void FakeResponder::send_delayed()
+{
+  auto now = Clock::now();
+
+  while (!delayed_.empty() && delayed_.front().due <= now) {
+    std::size_t n = 0;
+    for (; n < BATCH_SIZE && n < delayed_.size() && delayed_[n].due <= now; ++n) {
+      const auto& delayed = delayed_[n];
+      sends_[n] = UdpDatagram{delayed.data.data(), delayed.size, &delayed.remote};
+    }
+
+    boost::system::error_code err;
+    auto sent = udp_send_batch(socket_, sends_.data(), n, err);
+    if (err && err != boost::asio::error::would_block) {
+      ERR() << "fake responder: sendmmsg: " << err.message();
+    }
+    answered_.add(sent);
+    dropped_.add(n - sent);
+
+    delayed_.erase(delayed_.begin(), delayed_.begin() + n);
+  }
+}
+
+void FakeResponder::start_accepting()
+{
+  auto conn = std::make_shared<TcpConnection>(io_);
+
+  acceptor_.async_accept(conn->socket, [this, conn](auto err) {
+    if (err) {
+      if (err != boost::asio::error::operation_aborted) {
+        ERR() << "fake responder: accept: " << err.message();
+      }
+      return;
+    }
+
+    connections_.insert(conn);
+    tcp_read(conn);
+    start_accepting();
+  });
+}
+
+void FakeResponder::tcp_read(const std::shared_ptr<TcpConnection>& conn)
+{
+  boost::asio::async_read(conn->socket, boost::asio::buffer(conn->length), [this, conn](auto err, auto) {
+    if (err) {
+      tcp_close(conn);
+      return;
+    }
+
+    std::size_t length = dns_get16(conn->length.data());
+    if (length > conn->request.size()) {
+      ERR() << "fake responder: tcp query of " << length << " bytes";
+      tcp_close(conn);
+      return;
+    }
+
+    boost::asio::async_read(conn->socket, boost::asio::buffer(conn->request, length),
+                            [this, conn](auto err, std::size_t length) {
+      if (err) {
+        tcp_close(conn);
+        return;
+      }
+
+      auto len = answer(conn->request.data(), length, conn->response.data() + 2, MAX_TCP_SIZE,
+                        options_.n_addresses, options_.ttl);
+      if (len == 0) {
+        tcp_close(conn);
+        return;
+      }
+      dns_put16(len, conn->response.data());
+
+      boost::asio::async_write(conn->socket, boost::asio::buffer(conn->response, 2 + len),
+                               [this, conn](auto err, auto) {
+        if (err) {
+          tcp_close(conn);
+          return;
+        }
+        tcp_answered_.add();
+        tcp_read(conn);
+      });
+    });
+  });
+}
+
+void FakeResponder::tcp_close(const std::shared_ptr<TcpConnection>& conn)
+{
+  boost::system::error_code ignored;
+  conn->socket.close(ignored);
+  connections_.erase(conn);
+}
@@ -0,0 +1,156 @@
+// fake-responder.hpp
+
+#pragma once
+
+#include "stats.hpp"
+#include "udp-batch.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <random>
+#include <unordered_set>
+
+
+//
+// Fake authoritative nameserver of a synthetic zone
+//
+// Meant for reproducible benchmarks: it answers any name right away, without
+// a zone file, so the client is measured rather than a real resolver. The
+// zone is made up of the names themselves:
+//
+//   nx*.<anything>     NXDOMAIN
+//   cname*.<name>      CNAME to <name> (chains, e.g. cname.cname.www.test)
+//   <anything else>    A 10.x.y.z and AAAA fd00::x:y, derived from the name;
+//                      NODATA for the other types
+//
+// Loss, delay, truncation (TC=1 with no answers) and ID mismatches can be
+// injected into the UDP responses. A truncated query retried over TCP gets
+// the complete answer, TCP is never subject to the injections. A mismatched
+// ID is the ID of the query plus one, so it may hit another query of the
+// client in flight.
+//
+// The responder runs on the io_context of the caller, which is to run it by
+// a single thread (that is plenty, the datagrams are received and sent in
+// batches).
+//
+class FakeResponder
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options
+  {
+    // Probabilities (0..1) of the injections, rolled for each UDP response.
+    double loss = 0;
+    double truncation = 0;
+    double id_mismatch = 0;
+
+    // Every UDP response is held back for this long.
+    std::chrono::microseconds delay{0};
+
+    // Addresses in an A or AAAA answer.
+    std::size_t n_addresses = 1;
+
+    std::uint32_t ttl = 300;
+
+    // Seed of the injections (0 == random).
+    unsigned int seed = 1;
+  };
+
+  // Binds both UDP and TCP to the endpoint, port 0 picks a free port (see endpoint()).
+  FakeResponder(boost::asio::io_context& io,
+                const boost::asio::ip::udp::endpoint& endpoint,
+                const Options& options);
+
+  FakeResponder(const FakeResponder&) = delete;
+  FakeResponder& operator=(const FakeResponder&) = delete;
+
+  const boost::asio::ip::udp::endpoint& endpoint() const { return endpoint_; }
+
+  void start();
+
+  // Closes the sockets from within the io_context (safe to call from any thread), so the run()
+  // of the io_context returns once done.
+  void stop();
+
+  // Writes the answer of the zone to the query into buf, no injections applied. Returns its size
+  // or 0 if the query is malformed. An answer not fitting in buf is truncated (TC=1). Any OPT RR
+  // of the query is left out.
+  static std::size_t answer(const unsigned char* query, std::size_t len,
+                            unsigned char* buf, std::size_t size,
+                            std::size_t n_addresses = 1, std::uint32_t ttl = 300);
+
+  std::uint64_t received() const { return received_.get(); }
+  std::uint64_t answered() const { return answered_.get(); }
+  std::uint64_t dropped() const { return dropped_.get(); }  // lost on purpose or not sent
+  std::uint64_t truncated() const { return truncated_.get(); }
+  std::uint64_t mismatched() const { return mismatched_.get(); }
+  std::uint64_t tcp_answered() const { return tcp_answered_.get(); }
+
+private:
+  static constexpr std::size_t BATCH_SIZE = 64;
+  static constexpr std::size_t MAX_UDP_SIZE = 512;
+  static constexpr std::size_t MAX_TCP_SIZE = 4096;
+
+  struct Delayed
+  {
+    Clock::time_point due;
+    boost::asio::ip::udp::endpoint remote;
+    std::size_t size;
+    std::array<unsigned char, MAX_UDP_SIZE> data;
+  };
+
+  struct TcpConnection;
+
+  void start_receiving();
+  void handle_query(const unsigned char* data, std::size_t size, const boost::asio::ip::udp::endpoint& remote);
+  void flush_sends();
+  void arm_delay_timer();
+  void send_delayed();
+
+  void start_accepting();
+  void tcp_read(const std::shared_ptr<TcpConnection>& conn);
+  void tcp_close(const std::shared_ptr<TcpConnection>& conn);
+
+  bool roll(double probability) { return probability > 0 && uniform_(rng_) < probability; }
+
+  boost::asio::io_context& io_;
+  const Options options_;
+  boost::asio::ip::udp::socket socket_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  boost::asio::ip::udp::endpoint endpoint_;
+
+  UdpReceiveBatch receives_;
+
+  // The responses of the batch being handled.
+  std::array<std::array<unsigned char, MAX_UDP_SIZE>, BATCH_SIZE> responses_;
+  std::array<boost::asio::ip::udp::endpoint, BATCH_SIZE> remotes_;
+  std::array<UdpDatagram, BATCH_SIZE> sends_;
+  std::size_t n_sends_ = 0;
+
+  // The delay is the same for all, so the responses held back are due in order.
+  std::deque<Delayed> delayed_;
+  boost::asio::steady_timer delay_timer_;
+  bool delay_timer_armed_ = false;
+
+  std::unordered_set<std::shared_ptr<TcpConnection>> connections_;
+
+  std::mt19937 rng_;
+  std::uniform_real_distribution<double> uniform_{0, 1};
+
+  Counter received_;
+  Counter answered_;
+  Counter dropped_;
+  Counter truncated_;
+  Counter mismatched_;
+  Counter tcp_answered_;
+};
@@ -0,0 +1,237 @@
+// logging.cpp
+
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cstring>  // std::memcpy
+#include <ctime>
+#include <sstream>
+
+
+namespace {
+
+// Records queued per thread (a power of 2).
+constexpr std::size_t RING_SIZE = 1024;
+
+// Flushes of the background thread while idle.
+constexpr std::chrono::milliseconds FLUSH_INTERVAL(1);
+
+// The text of the ID of the calling thread, e.g. "7f91e7d1c6c0".
+const std::string& thread_name()
+{
+  thread_local const std::string name = []() {
+    std::ostringstream os;
+    os << std::hex << std::this_thread::get_id();
+    return os.str();
+  }();
+  return name;
+}
+
+// Appends the line of the message to the output.
+void render(std::string& out,
+            const std::string& thread, Logger::Level level,
+            std::chrono::system_clock::time_point time,
+            const char* text, std::size_t size, bool truncated)
+{
+  // The timestamp is formatted once per millisecond (per rendering thread).
+  thread_local std::int64_t cached_ms = -1;
+  thread_local char cached[32];
+  thread_local std::size_t cached_size = 0;
+
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+  if (ms != cached_ms) {
+    auto time_t = std::time_t(ms / 1000);
+    struct tm tm;
+    localtime_r(&time_t, &tm);
+
+    auto n = std::strftime(cached, sizeof(cached), "%b %d %T", &tm);
+    cached[n++] = '.';
+    cached[n++] = '0' + ms % 1000 / 100;
+    cached[n++] = '0' + ms % 100 / 10;
+    cached[n++] = '0' + ms % 10;
+    cached_size = n;
+    cached_ms = ms;
+  }
+
+  static const char* names[] = { "FATAL", "ERROR", "WARNING", "INFO", "DEBUG" };
+
+  out.append(cached, cached_size);
+  out.append(" [").append(thread).append("] ");
+  out.append(names[std::min<std::size_t>(std::size_t(level), std::size(names) - 1)]).append(": ");
+  out.append(text, size);
+  if (truncated) {
+    out.append("...");
+  }
+  out.push_back('\n');
+}
+
+}  // namespace
+
+
+//
+// Single-producer single-consumer ring of the messages of a thread
+//
+// The ring is shared by the thread and the logger, so either may go first.
+//
+struct Logger::Ring
+{
+  Ring() : records(new Record[RING_SIZE]), thread(thread_name()) {}
+
+  const std::unique_ptr<Record[]> records;
+  const std::string thread;
+  std::atomic<std::size_t> head{0};  // next to read
+  std::atomic<std::size_t> tail{0};  // next to write
+  std::atomic<bool> orphaned{false};  // the thread is gone
+};
+
+void Logger::start_async()
+{
+  std::lock_guard<std::mutex> lock(thread_mutex_);
+
+  if (thread_.joinable()) {
+    return;
+  }
+  stopping_ = false;
+  thread_ = std::thread([this]() { run(); });
+  async_.store(true, std::memory_order_release);
+}
+
+void Logger::stop_async()
+{
+  std::unique_lock<std::mutex> lock(thread_mutex_);
+
+  if (!thread_.joinable()) {
+    return;
+  }
+  async_.store(false, std::memory_order_release);
+  stopping_ = true;
+  lock.unlock();
+  thread_cv_.notify_one();
+
+  thread_.join();
+}
+
+void Logger::write(Level level, std::chrono::system_clock::time_point time, const Buffer& buffer)
+{
+  if (async_.load(std::memory_order_acquire)) {
+    auto& ring = thread_ring();
+
+    auto tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == RING_SIZE) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    auto& record = ring.records[tail % RING_SIZE];
+    record.time = time;
+    record.level = level;
+    record.size = buffer.size();
+    record.truncated = buffer.truncated();
+    std::memcpy(record.text, buffer.data(), buffer.size());
+    ring.tail.store(tail + 1, std::memory_order_release);
+    return;
+  }
+
+  // The line is rendered first, so that it takes a single write.
+  thread_local std::string line;
+  line.clear();
+  render(line, thread_name(), level, time, buffer.data(), buffer.size(), buffer.truncated());
+
+  std::lock_guard<std::mutex> lock(os_mutex_);
+  os_.write(line.data(), line.size());
+}
+
+Logger::Ring& Logger::thread_ring()
+{
+  // Owned by the thread, but handed over to the logger when the thread exits.
+  struct Holder
+  {
+    ~Holder()
+    {
+      if (ring) {
+        ring->orphaned.store(true, std::memory_order_release);
+      }
+    }
+
+    Logger* logger = nullptr;
+    std::shared_ptr<Ring> ring;
+  };
+
+  thread_local Holder holder;
+
+  if (holder.logger != this) {
+    if (holder.ring) {
+      holder.ring->orphaned.store(true, std::memory_order_release);
+    }
+    holder.logger = this;
+    holder.ring = std::make_shared<Ring>();
+
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.push_back(holder.ring);
+  }
+  return *holder.ring;
+}
+
+void Logger::run()
+{
+  std::string out;
+
+  for (;;) {
+    bool flushed = flush_rings(out);
+
+    std::unique_lock<std::mutex> lock(thread_mutex_);
+    if (stopping_) {
+      lock.unlock();
+      // Whatever got queued while stopping.
+      while (flush_rings(out)) {}
+      return;
+    }
+    if (!flushed) {
+      thread_cv_.wait_for(lock, FLUSH_INTERVAL);
+    }
+  }
+}
+
+bool Logger::flush_rings(std::string& out)
+{
+  std::vector<std::shared_ptr<Ring>> rings;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings = rings_;
+  }
+
+  out.clear();
+
+  for (auto&& ring: rings) {
+    // The rings of the threads gone are dropped once drained.
+    bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+
+    auto head = ring->head.load(std::memory_order_relaxed);
+    auto tail = ring->tail.load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+      const auto& record = ring->records[head % RING_SIZE];
+      render(out, ring->thread, record.level, record.time, record.text, record.size, record.truncated);
+    }
+    ring->head.store(head, std::memory_order_release);
+
+    if (orphaned) {
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      rings_.erase(std::remove(rings_.begin(), rings_.end(), ring), rings_.end());
+    }
+  }
+
+  if (auto dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+    auto text = std::to_string(dropped) + " log messages dropped";
+    render(out, thread_name(), Level::WARNING, std::chrono::system_clock::now(),
+           text.data(), text.size(), false);
+  }
+
+  if (out.empty()) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(os_mutex_);
+  os_.write(out.data(), out.size());
+  os_.flush();
+  return true;
+}
@@ -2,18 +2,35 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <ctime>
-#include <thread>
-#include <string>
-#include <sstream>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
-#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
 
 
+// Messages of the levels above it are compiled out, e.g. -DLOG_MAX_LEVEL=3 removes DBG(). So
+// they are in the release builds (NDEBUG), unless -DLOG_MAX_LEVEL=4 brings them back.
+#ifndef LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define LOG_MAX_LEVEL 3  // Logger::Level::INFO
+#else
+#define LOG_MAX_LEVEL 4  // Logger::Level::DEBUG
+#endif
+#endif
+
+// The empty branches keep an else following the macro from binding to its ifs.
 #define LOG(LEVEL) \
-        if (Logger::instance().get_threshold() >= (LEVEL)) \
-          Logger::Message(Logger::instance(), (LEVEL))
+        if constexpr (int(LEVEL) > LOG_MAX_LEVEL) {} \
+        else if (!Logger::instance().enabled(LEVEL)) {} \
+        else Logger::Message(Logger::instance(), (LEVEL))
 
 #define DBG()   LOG(Logger::Level::DEBUG)
 #define INFO()  LOG(Logger::Level::INFO)
@@ -29,6 +46,13 @@
 //   INFO() << ...;
 // Do not add trailing '\n' or std::endl.
 //
+// A message is formatted into a fixed buffer (longer ones are truncated), so
+// logging does not allocate. By default the message is written right away,
+// the lines of concurrent messages do not interleave. In the asynchronous
+// mode the messages are queued into lock-free rings of their threads instead
+// and written by a background thread; a message not fitting in the ring of
+// its thread is dropped (the drops get reported).
+//
 class Logger
 {
 public:
@@ -37,45 +61,47 @@ public:
   // Required as forward declaration of the operator as it is used in Message.
   friend std::ostream& operator<<(std::ostream& os, const Logger::Level& level);
 
+  // Text of a message.
+  class Buffer : public std::streambuf
+  {
+  public:
+    static constexpr std::size_t SIZE = 464;
+
+    Buffer() { setp(data_, data_ + SIZE); }
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return pptr() - pbase(); }
+    bool truncated() const { return truncated_; }
+
+  protected:
+    int_type overflow(int_type ch) override
+    {
+      // Swallow the rest, so that the stream does not fail.
+      truncated_ = true;
+      return traits_type::not_eof(ch);
+    }
+
+  private:
+    char data_[SIZE];
+    bool truncated_ = false;
+  };
+
   struct Message
   {
     Logger& logger_;
     const Level level_;
-    mutable std::ostringstream oss_;
+    const std::chrono::system_clock::time_point time_;
+    Buffer buffer_;
+    mutable std::ostream os_;
 
     Message(Logger& logger, Level level)
-       : logger_(logger), level_(level)
-    {
-      //XXX insane way of formatting std::chrono::time_point (...before C++20)
-      const auto now = std::chrono::system_clock::now();
-      const auto now_ms =
-          std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch());
-      const auto now_time_t = std::chrono::system_clock::to_time_t(now);
-      struct tm now_tm;
-      localtime_r(&now_time_t, &now_tm);
-
-      std::ios old_state(nullptr);
-      old_state.copyfmt(oss_);
-
-#ifdef USE_STRFTIME
-      char buf[80];
-      std::strftime(buf, sizeof(buf), "%b %d %T", &now_tm);
-      oss_ << buf << "."
-#else
-      oss_ << std::put_time(&now_tm, "%b %d %T") << "."
-#endif
-           << std::setfill('0') << std::setw(3) << now_ms.count() % 1000
-           << " [" << std::hex << std::this_thread::get_id() << "] "
-           << level_ << ": ";
-       oss_.copyfmt(old_state);
-    }
+      : logger_(logger),
+        level_(level),
+        time_(std::chrono::system_clock::now()),
+        os_(&buffer_)
+    {}
 
-    ~Message()
-    {
-      // Not quite atomic but usually good enough.
-      oss_ << "\n";
-      logger_.os() << oss_.str();
-    }
+    ~Message() { logger_.write(level_, time_, buffer_); }
   };
 
   static Logger& instance() {
@@ -87,14 +113,50 @@ public:
       : threshold_(threshold), os_(use_stderr ? std::cerr : std::cout)
   {}
 
-  void set_threshold(Level threshold) { threshold_ = threshold; }
-  Level get_threshold() const { return threshold_; }
+  ~Logger() { stop_async(); }
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  void set_threshold(Level threshold) { threshold_.store(threshold, std::memory_order_relaxed); }
+  Level get_threshold() const { return threshold_.load(std::memory_order_relaxed); }
+  bool enabled(Level level) const { return get_threshold() >= level; }
+
+  // Switches to the asynchronous mode and back. Stopping writes out the messages queued, but
+  // a message logged concurrently with stopping may be lost.
+  void start_async();
+  void stop_async();
 
 private:
-  std::ostream& os() const { return os_; }
+  // Queued message.
+  struct Record
+  {
+    std::chrono::system_clock::time_point time;
+    Level level;
+    std::uint16_t size;
+    bool truncated;
+    char text[Buffer::SIZE];
+  };
+
+  struct Ring;
+
+  void write(Level level, std::chrono::system_clock::time_point time, const Buffer& buffer);
+  Ring& thread_ring();
+  void run();
+  bool flush_rings(std::string& out);
 
-  Level threshold_;
+  std::atomic<Level> threshold_;
   std::ostream& os_;
+  std::mutex os_mutex_;
+
+  std::atomic<bool> async_{false};
+  std::mutex rings_mutex_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+  std::atomic<std::uint64_t> dropped_{0};
+  std::thread thread_;
+  std::mutex thread_mutex_;
+  std::condition_variable thread_cv_;
+  bool stopping_ = false;
 };
 
 inline std::ostream& operator<<(std::ostream& os, const Logger::Level& level)
@@ -106,6 +168,6 @@ inline std::ostream& operator<<(std::ostream& os, const Logger::Level& level)
 template<typename T>
 const Logger::Message& operator<<(const Logger::Message& msg, const T& t)
 {
-  msg.oss_ << t;
+  msg.os_ << t;
   return msg;
 }
@@ -3,8 +3,13 @@
 #include "logging.hpp"
 #include "async-dns-client.hpp"
 
+#include <atomic>
 #include <future>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
 
 #include <unistd.h>  // getopt
 
@@ -14,44 +19,146 @@ void usage(const char* prog)
   std::cout << "Usage: " << prog << " [OPTION...] HOST...\n"
             << "    Options:\n"
                "      -h       This help\n"
-               "      -s IP    Nameserver IP (default: 127.0.0.1)\n"
+               "      -s IP    Nameserver IP, may be repeated (default: 127.0.0.1)\n"
                "      -p PORT  Nameserver port (default: 53)\n"
                "      -w N     Number of thread workers (0 == #cores, default: 0)\n"
+               "      -S N     Number of socket shards (0 == #workers, default: 0)\n"
                "      -t MS    Query timeout in milliseconds (default: 2000)\n"
+               "      -c N     Cache up to N responses (default: 0 == no cache)\n"
+               "      -m N     Max queries in flight per shard (default: 0 == 65536)\n"
+               "      -q N     Max queries queued per shard (default: unlimited)\n"
+               "      -e SIZE  EDNS UDP payload size (0 == no EDNS, default: 1232)\n"
+               "      -D       Set the EDNS DO bit\n"
+               "      -E NET   EDNS Client Subnet, e.g. 192.0.2.0/24\n"
                "      -6       Make AAAA query rather than A\n"
-               "      -v       Verbose logging (use multiple times)\n";
+               "      -T TYPE  Make query of the type, e.g. MX or 257\n"
+               "      -a       Make both A and AAAA query\n"
+               "      -U       Use io_uring for UDP (Linux 6.0+)\n"
+               "      -A       Run a shard per worker on an io_context of its own, pinned to a CPU\n"
+               "      -v       Verbose logging (use multiple times)\n"
+               "      -L       Log asynchronously\n"
+               "      -P       Print statistics (in Prometheus format) to stderr at exit\n";
+}
+
+// Prints the rdata of the RRs other than A, AAAA and CNAME.
+void print_rdata(std::ostream& os, const DnsRecord& rr)
+{
+  if (auto target = rr.target()) {
+    os << target->to_string();
+  }
+  else if (auto mx = rr.mx()) {
+    os << mx->preference << " " << mx->exchange.to_string();
+  }
+  else if (auto srv = rr.srv()) {
+    os << srv->priority << " " << srv->weight << " " << srv->port << " " << srv->target.to_string();
+  }
+  else if (auto soa = rr.soa()) {
+    os << soa->mname.to_string() << " " << soa->rname.to_string() << " " << soa->serial << " "
+       << soa->refresh << " " << soa->retry << " " << soa->expire << " " << soa->minimum;
+  }
+  else if (auto txt = rr.txt()) {
+    const char* sep = "";
+    for (auto&& str: *txt) {
+      os << sep << std::quoted(str);
+      sep = " ";
+    }
+  }
+  else if (auto svcb = rr.svcb()) {
+    os << svcb->priority << " " << svcb->target.to_string();
+    for (auto&& param: svcb->params) {
+      os << " key" << param.key << "=(" << param.length << " bytes)";
+    }
+  }
+  else {
+    // RFC 3597
+    os << "\\# " << rr.rdlength;
+  }
 }
 
 int main(int argc, char* argv[])
 {
-  std::string ns_ip = "127.0.0.1";
+  std::vector<std::string> ns_ips;
   unsigned short ns_port = 53;
-  std::size_t n_workers = 0;
-  unsigned int timeout_ms = 2000;
+  AsyncDnsClient::Options options;
+  options.n_workers = 0;
+  options.timeout_ms = 2000;
   bool ipv6 = false;
+  std::optional<AsyncDnsClient::QueryType> qtype;
+  bool addresses = false;
   unsigned int verbose = 0;
+  bool async_logging = false;
+  bool print_stats = false;
 
   int opt;
-  while ((opt = getopt(argc, argv, "s:p:w:t:6vh")) != -1) {
+  while ((opt = getopt(argc, argv, "s:p:w:S:t:c:m:q:e:DE:6T:aUAvLPh")) != -1) {
     switch (opt) {
       case 's':
-        ns_ip = optarg;
+        ns_ips.push_back(optarg);
         break;
       case 'p':
         ns_port = std::atoi(optarg);
         break;
       case 'w':
-        n_workers = std::atoi(optarg);
+        options.n_workers = std::atoi(optarg);
+        break;
+      case 'S':
+        options.n_shards = std::atoi(optarg);
         break;
       case 't':
-        timeout_ms = std::atoi(optarg);
+        options.timeout_ms = std::atoi(optarg);
+        break;
+      case 'c':
+        options.cache_size = std::atoi(optarg);
+        break;
+      case 'm':
+        options.max_inflight = std::atoi(optarg);
+        break;
+      case 'q':
+        options.max_queued = std::atoi(optarg);
+        break;
+      case 'e':
+        options.edns.udp_size = std::atoi(optarg);
         break;
+      case 'D':
+        options.edns.dnssec_ok = true;
+        break;
+      case 'E': {
+        std::string_view subnet(optarg);
+        auto slash = subnet.find('/');
+        options.edns.client_subnet = boost::asio::ip::make_address(subnet.substr(0, slash));
+        options.edns.client_subnet_prefix =
+            slash != subnet.npos ? std::atoi(optarg + slash + 1) : (options.edns.client_subnet.is_v4() ? 32 : 128);
+        break;
+      }
       case '6':
         ipv6 = true;
         break;
+      case 'T':
+        qtype = parse_query_type(optarg);
+        if (!qtype) {
+          std::cerr << "invalid query type: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'a':
+        addresses = true;
+        break;
+      case 'U':
+        options.io_uring = true;
+        break;
+      case 'A':
+        options.per_core = true;
+        options.numa_local = true;
+        break;
       case 'v':
         ++verbose;
         break;
+      case 'L':
+        async_logging = true;
+        break;
+      case 'P':
+        print_stats = true;
+        break;
       case 'h':
         usage(argv[0]);
         return 0;
@@ -68,49 +175,108 @@ int main(int argc, char* argv[])
 
   // Set the logging threshold to ERROR.
   Logger::instance().set_threshold(Logger::Level((unsigned int)Logger::Level::ERROR + verbose));
+  if (async_logging) {
+    Logger::instance().start_async();
+  }
+
+  if (ns_ips.empty()) {
+    ns_ips.push_back("127.0.0.1");
+  }
 
-  if (n_workers == 0) {
-    n_workers = std::thread::hardware_concurrency();
+  std::vector<boost::asio::ip::udp::endpoint> nameservers;
+  for (auto&& ns_ip: ns_ips) {
+    nameservers.emplace_back(boost::asio::ip::make_address(ns_ip), ns_port);
   }
 
-  INFO() << "nameserver=" << ns_ip << ":" << ns_port
-         << ", workers=" << n_workers
-         << ", timeout=" << timeout_ms
+  if (options.n_workers == 0) {
+    options.n_workers = std::thread::hardware_concurrency();
+  }
+
+  INFO() << "nameservers=" << nameservers.size()
+         << ", workers=" << options.n_workers
+         << ", shards=" << options.n_shards
+         << ", timeout=" << options.timeout_ms
+         << ", cache=" << options.cache_size
          << ", ipv6=" << ipv6;
 
-  AsyncDnsClient dns(ns_ip, ns_port, n_workers, timeout_ms);
+  AsyncDnsClient dns(nameservers, options);
   dns.start();
 
+  // Callbacks of queries landing on different shards may run concurrently.
+  std::mutex mutex;
   std::promise<void> done;
-  std::size_t n = argc - optind;
-
-  auto on_finished = [&done, &n](AsyncDnsClient::QueryResult result,
-                                 std::string_view name,
-                                 AsyncDnsClient::QueryType type,
-                                 int rcode,
-                                 std::vector<std::pair<std::string, boost::asio::ip::address>>&& addrs,
-                                 std::vector<std::pair<std::string, std::string>>&& cnames) {
-    std::cout << name << ": " << result << "\n"
-              << "  rcode=" << rcode << "\n";
-    for (auto&& [name, ip]: addrs) {
-      std::cout << "  " << name << " " << type << " " << ip << std::endl;
+
+  auto print_records = [](const DnsResponseView& response) {
+    for (auto&& rr: response.answers()) {
+      if (rr.type == ns_t_a || rr.type == ns_t_aaaa) {
+        std::cout << "  " << rr.name.to_string() << " " << AsyncDnsClient::QueryType(rr.type) << " "
+                  << rr.address() << std::endl;
+      }
     }
 
-    for (auto&& [name, cname]: cnames) {
-      std::cout << "  " << name << " CNAME " << cname << std::endl;
+    for (auto&& rr: response.answers()) {
+      if (rr.type != ns_t_a && rr.type != ns_t_aaaa && rr.type != ns_t_cname) {
+        std::cout << "  " << rr.name.to_string() << " " << AsyncDnsClient::QueryType(rr.type) << " ";
+        print_rdata(std::cout, rr);
+        std::cout << std::endl;
+      }
     }
 
-    if (--n == 0) {
-      done.set_value();
+    for (auto&& rr: response.answers()) {
+      if (rr.type == ns_t_cname) {
+        std::cout << "  " << rr.name.to_string() << " CNAME " << rr.rdata_name().to_string() << std::endl;
+      }
     }
   };
 
-  for (int i = optind; i < argc; ++i) {
-    dns.async_query(
-        argv[i], ipv6 ? AsyncDnsClient::TYPE_AAAA : AsyncDnsClient::TYPE_A, on_finished);
+  auto on_response = [&mutex, &print_records](AsyncDnsClient::QueryResult result,
+                                              std::string_view name,
+                                              AsyncDnsClient::QueryType type,
+                                              const DnsResponseView& response) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::cout << name << ": " << result << "\n"
+              << "  rcode=" << response.rcode() << "\n";
+    print_records(response);
+  };
+
+  std::vector<std::string_view> names(argv + optind, argv + argc);
+
+  std::atomic<std::size_t> remaining(names.size());
+
+  if (addresses) {
+    for (auto&& name: names) {
+      dns.async_query_addresses(
+          name,
+          [&](AsyncDnsClient::QueryResult result, std::string_view name,
+              const DnsResponseView& a_response, const DnsResponseView& aaaa_response) {
+            {
+              std::lock_guard<std::mutex> lock(mutex);
+
+              std::cout << name << ": " << result << "\n"
+                        << "  rcode=" << a_response.rcode() << "/" << aaaa_response.rcode() << "\n";
+              print_records(a_response);
+              print_records(aaaa_response);
+            }
+            if (--remaining == 0) {
+              done.set_value();
+            }
+          });
+    }
+  }
+  else {
+    auto type = qtype ? *qtype : ipv6 ? AsyncDnsClient::TYPE_AAAA : AsyncDnsClient::TYPE_A;
+
+    dns.async_query_batch(
+        names, type,
+        on_response,
+        [&done]() { done.set_value(); });
   }
 
   done.get_future().wait();
+  if (print_stats) {
+    dns.stats().write_prometheus(std::cerr);
+  }
   dns.stop();
 
   return 0;
@@ -0,0 +1,109 @@
+// mpmc-ring.hpp
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+//
+// Bounded lock-free multi-producer multi-consumer ring
+//
+// MpscRing with the pops claiming their cells by a CAS on the head too (D. Vyukov's bounded
+// queue as published), so any thread may push and pop. Meant for passing things back and forth
+// between threads that all may be both, e.g. a free list.
+//
+template<typename T>
+class MpmcRing
+{
+public:
+  // The size must be a power of 2.
+  explicit MpmcRing(std::size_t size)
+    : mask_(size - 1),
+      cells_(new Cell[size])
+  {
+    for (std::size_t i = 0; i < size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpmcRing(const MpmcRing&) = delete;
+  MpmcRing& operator=(const MpmcRing&) = delete;
+
+  std::size_t capacity() const { return mask_ + 1; }
+
+  // Moves the value in unless the ring is full, in which case the value is left alone.
+  bool try_push(T&& value)
+  {
+    auto pos = tail_.load(std::memory_order_relaxed);
+
+    for (;;) {
+      auto& cell = cells_[pos & mask_];
+      auto seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = std::intptr_t(seq) - std::intptr_t(pos);
+
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0) {
+        // The cell of the previous round was not popped yet.
+        return false;
+      }
+      else {
+        // Claimed by another producer meanwhile.
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Returns false if there is no value to pop (yet).
+  bool try_pop(T& value)
+  {
+    auto pos = head_.load(std::memory_order_relaxed);
+
+    for (;;) {
+      auto& cell = cells_[pos & mask_];
+      auto seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = std::intptr_t(seq) - std::intptr_t(pos + 1);
+
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.value = T();
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0) {
+        // Not pushed (yet).
+        return false;
+      }
+      else {
+        // Claimed by another consumer meanwhile.
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+private:
+  // Keeps the producers and the consumers off each other's cache lines.
+  static constexpr std::size_t CACHE_LINE = 64;
+
+  struct Cell
+  {
+    std::atomic<std::size_t> sequence;
+    T value{};
+  };
+
+  const std::size_t mask_;
+  const std::unique_ptr<Cell[]> cells_;
+  alignas(CACHE_LINE) std::atomic<std::size_t> tail_{0};
+  alignas(CACHE_LINE) std::atomic<std::size_t> head_{0};
+};
@@ -0,0 +1,99 @@
+// mpsc-ring.hpp
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+//
+// Bounded lock-free multi-producer single-consumer ring
+//
+// Any thread may push, only one at a time may pop. Each cell carries a sequence number telling
+// whether it is free for the push of the round or holds a value for the pop (D. Vyukov's bounded
+// queue), so a push is a CAS on the tail plus two stores and a pop never writes shared state but
+// the cell. The ring does not block nor wake anyone up, that is up to the owner.
+//
+// A value being pushed is claimed before it is published, so a pop may see the ring empty for
+// a moment even though a push of a later cell already finished.
+//
+template<typename T>
+class MpscRing
+{
+public:
+  // The size must be a power of 2.
+  explicit MpscRing(std::size_t size)
+    : mask_(size - 1),
+      cells_(new Cell[size])
+  {
+    for (std::size_t i = 0; i < size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscRing(const MpscRing&) = delete;
+  MpscRing& operator=(const MpscRing&) = delete;
+
+  std::size_t capacity() const { return mask_ + 1; }
+
+  // Moves the value in unless the ring is full, in which case the value is left alone.
+  bool try_push(T&& value)
+  {
+    auto pos = tail_.load(std::memory_order_relaxed);
+
+    for (;;) {
+      auto& cell = cells_[pos & mask_];
+      auto seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = std::intptr_t(seq) - std::intptr_t(pos);
+
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0) {
+        // The cell of the previous round was not popped yet.
+        return false;
+      }
+      else {
+        // Claimed by another producer meanwhile.
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Consumer only. Returns false if there is no value to pop (yet).
+  bool try_pop(T& value)
+  {
+    auto& cell = cells_[head_ & mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+
+    value = std::move(cell.value);
+    cell.value = T();
+    cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+private:
+  // Keeps the producers and the consumer off each other's cache lines.
+  static constexpr std::size_t CACHE_LINE = 64;
+
+  struct Cell
+  {
+    std::atomic<std::size_t> sequence;
+    T value{};
+  };
+
+  const std::size_t mask_;
+  const std::unique_ptr<Cell[]> cells_;
+  alignas(CACHE_LINE) std::atomic<std::size_t> tail_{0};
+  alignas(CACHE_LINE) std::size_t head_ = 0;
+};
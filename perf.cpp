@@ -0,0 +1,455 @@
+// perf.cpp
+//
+// Load generator in the vein of dnsperf: resolves the names of a file over and
+// over, either at a target rate or keeping a number of queries outstanding,
+// and reports the throughput, the loss and the latency percentiles, possibly
+// for several numbers of workers in a row.
+
+#include "logging.hpp"
+#include "async-dns-client.hpp"
+#include "stats.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>  // getopt
+
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Queries issued from within the callback of another one (a cache hit calls the callback right
+// away) before the rest is left to the generator, so that the stack does not grow unbounded.
+constexpr unsigned int MAX_NESTED_ISSUES = 8;
+
+struct QuerySpec
+{
+  std::string name;
+  AsyncDnsClient::QueryType type;
+};
+
+struct Settings
+{
+  double qps = 0;  // 0 == as fast as the window allows
+  std::size_t window = 100;  // queries outstanding
+  std::chrono::milliseconds duration{10000};
+  bool prepare = false;  // the queries, see AsyncDnsClient::prepare()
+};
+
+struct Result
+{
+  std::size_t workers = 0;
+  std::size_t shards = 0;
+  std::uint64_t sent = 0;
+  std::uint64_t answered = 0;
+  std::uint64_t timeouts = 0;
+  std::uint64_t errors = 0;
+  std::chrono::duration<double> elapsed{0};
+  LatencyHistogram::Snapshot latencies;  // of the answered queries, in microseconds
+};
+
+//
+// State of a run
+//
+// The callbacks run concurrently on the shards, so the latencies are collected into histograms
+// per thread and merged once the run is over.
+//
+class Run
+{
+public:
+  Run(AsyncDnsClient& dns, const std::vector<QuerySpec>& queries, const Settings& settings);
+
+  Result operator()();
+
+private:
+  void issue();
+  void complete(AsyncDnsClient::QueryResult result, Clock::time_point start);
+  LatencyHistogram::Snapshot& latencies();
+
+  AsyncDnsClient& dns_;
+  const std::vector<QuerySpec>& queries_;
+  std::vector<AsyncDnsClient::PreparedQuery> prepared_;  // by the index of the query, if prepared
+  const Settings& settings_;
+  const unsigned int id_;
+
+  std::atomic<bool> running_{true};
+  std::atomic<std::size_t> next_{0};
+  std::atomic<std::size_t> outstanding_{0};
+  std::atomic<std::size_t> deferred_{0};
+  std::atomic<std::uint64_t> sent_{0};
+  std::atomic<std::uint64_t> answered_{0};
+  std::atomic<std::uint64_t> timeouts_{0};
+  std::atomic<std::uint64_t> errors_{0};
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<LatencyHistogram::Snapshot>> latencies_;
+
+  static std::atomic<unsigned int> last_id_;
+};
+
+std::atomic<unsigned int> Run::last_id_{0};
+
+Run::Run(AsyncDnsClient& dns, const std::vector<QuerySpec>& queries, const Settings& settings)
+  : dns_(dns), queries_(queries), settings_(settings), id_(++last_id_)
+{
+  if (settings_.prepare) {
+    // The invalid names are left to fail as they would.
+    prepared_.resize(queries_.size());
+    for (std::size_t i = 0; i < queries_.size(); ++i) {
+      try {
+        prepared_[i] = dns_.prepare(queries_[i].name, queries_[i].type);
+      }
+      catch (const std::invalid_argument&) {}
+    }
+  }
+}
+
+Result Run::operator()()
+{
+  auto start = Clock::now();
+  auto end = start + settings_.duration;
+
+  if (settings_.qps == 0) {
+    // Each completion issues the next query.
+    for (std::size_t i = 0; i < settings_.window; ++i) {
+      issue();
+    }
+  }
+
+  std::uint64_t issued = 0;
+  for (auto now = start; now < end; now = Clock::now()) {
+    if (settings_.qps > 0) {
+      auto due = std::uint64_t(settings_.qps * std::chrono::duration<double>(now - start).count());
+      for (; issued < due && outstanding_.load(std::memory_order_relaxed) < settings_.window; ++issued) {
+        issue();
+      }
+      // Whatever did not fit in the window is skipped rather than sent in a burst later.
+      issued = std::max(issued, due);
+    }
+    else {
+      for (auto n = deferred_.exchange(0, std::memory_order_relaxed); n > 0; --n) {
+        issue();
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(500));
+  }
+
+  Result result;
+  result.elapsed = Clock::now() - start;
+
+  // The queries outstanding finish within the timeout.
+  running_ = false;
+  while (outstanding_.load(std::memory_order_acquire) > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  result.sent = sent_;
+  result.answered = answered_;
+  result.timeouts = timeouts_;
+  result.errors = errors_;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto&& latencies: latencies_) {
+    result.latencies += *latencies;
+  }
+  return result;
+}
+
+void Run::issue()
+{
+  auto i = next_.fetch_add(1, std::memory_order_relaxed) % queries_.size();
+
+  outstanding_.fetch_add(1, std::memory_order_relaxed);
+  sent_.fetch_add(1, std::memory_order_relaxed);
+
+  AsyncDnsClient::OnResponseCallback cb(
+      [this, start = Clock::now()](AsyncDnsClient::QueryResult result, std::string_view,
+                                   AsyncDnsClient::QueryType, const DnsResponseView&) {
+        complete(result, start);
+      });
+
+  if (!prepared_.empty() && prepared_[i]) {
+    dns_.async_query(prepared_[i], std::move(cb));
+  }
+  else {
+    dns_.async_query(queries_[i].name, queries_[i].type, std::move(cb));
+  }
+}
+
+void Run::complete(AsyncDnsClient::QueryResult result, Clock::time_point start)
+{
+  switch (result) {
+    case AsyncDnsClient::RESULT_SUCCESS:
+      latencies().record(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+      answered_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    case AsyncDnsClient::RESULT_TIMEOUT:
+      timeouts_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    default:
+      errors_.fetch_add(1, std::memory_order_relaxed);
+      break;
+  }
+
+  if (settings_.qps == 0 && running_.load(std::memory_order_relaxed)) {
+    thread_local unsigned int depth = 0;
+    if (depth < MAX_NESTED_ISSUES) {
+      ++depth;
+      issue();
+      --depth;
+    }
+    else {
+      deferred_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // The last thing, as the run may be over right after.
+  outstanding_.fetch_sub(1, std::memory_order_release);
+}
+
+LatencyHistogram::Snapshot& Run::latencies()
+{
+  // The run, rather than its address, as a later run may get the same one.
+  thread_local unsigned int owner = 0;
+  thread_local LatencyHistogram::Snapshot* latencies = nullptr;
+
+  if (owner != id_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    latencies_.push_back(std::make_unique<LatencyHistogram::Snapshot>());
+    latencies = latencies_.back().get();
+    owner = id_;
+  }
+  return *latencies;
+}
+
+bool read_queries(std::istream& is, AsyncDnsClient::QueryType default_type, std::vector<QuerySpec>& queries)
+{
+  std::string line;
+  for (std::size_t n = 1; std::getline(is, line); ++n) {
+    std::istringstream fields(line);
+    std::string name, type;
+    if (!(fields >> name) || name[0] == '#') {
+      continue;
+    }
+
+    std::optional<AsyncDnsClient::QueryType> qtype = default_type;
+    if (fields >> type) {
+      qtype = parse_query_type(type);
+    }
+    if (!qtype) {
+      std::cerr << "line " << n << ": invalid query type: " << type << std::endl;
+      return false;
+    }
+    queries.push_back({name, *qtype});
+  }
+  return true;
+}
+
+void print_header()
+{
+  std::printf("%7s %6s %10s %10s %9s %8s %10s %6s %8s %8s %8s %8s\n",
+              "workers", "shards", "sent", "answered", "timeouts", "errors", "qps", "lost%",
+              "p50ms", "p90ms", "p99ms", "p99.9ms");
+}
+
+void print_result(const Result& result)
+{
+  auto completed = result.answered + result.timeouts + result.errors;
+  auto ms = [&result](double q) { return result.latencies.quantile(q) / 1000.0; };
+
+  std::printf("%7zu %6zu %10llu %10llu %9llu %8llu %10.0f %6.2f %8.3f %8.3f %8.3f %8.3f\n",
+              result.workers, result.shards,
+              (unsigned long long)result.sent, (unsigned long long)result.answered,
+              (unsigned long long)result.timeouts, (unsigned long long)result.errors,
+              result.answered / result.elapsed.count(),
+              completed ? 100.0 * result.timeouts / completed : 0.0,
+              ms(0.5), ms(0.9), ms(0.99), ms(0.999));
+  std::fflush(stdout);
+}
+
+void usage(const char* prog)
+{
+  std::cout << "Usage: " << prog << " [OPTION...] -f FILE\n"
+            << "    Options:\n"
+               "      -h       This help\n"
+               "      -f FILE  Queries to send, one per line: NAME [TYPE] (- == stdin)\n"
+               "      -s IP    Nameserver IP, may be repeated (default: 127.0.0.1)\n"
+               "      -p PORT  Nameserver port (default: 53)\n"
+               "      -w LIST  Numbers of thread workers to run with, e.g. 1,2,4 (default: #cores)\n"
+               "      -S N     Number of socket shards (0 == #workers, default: 0; ignored with -A)\n"
+               "      -t MS    Query timeout in milliseconds (default: 2000)\n"
+               "      -c N     Cache up to N responses (default: 0 == no cache)\n"
+               "      -R PCT   Refresh the cache entries hit within the last PCT% of their TTL\n"
+               "      -X SEC   Serve the cache entries expired up to SEC seconds ago if failing\n"
+               "      -T TYPE  Query type of the lines without one (default: A)\n"
+               "      -Q QPS   Target queries per second (default: 0 == no limit)\n"
+               "      -C N     Max queries outstanding (default: 100)\n"
+               "      -l SEC   Duration of each run in seconds (default: 10)\n"
+               "      -U       Use io_uring for UDP (Linux 6.0+)\n"
+               "      -A       Run a shard per worker on an io_context of its own, pinned to a CPU\n"
+               "      -P       Prepare the queries once rather than encode each one\n"
+               "      -v       Verbose logging (use multiple times)\n";
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+  std::vector<std::string> ns_ips;
+  unsigned short ns_port = 53;
+  AsyncDnsClient::Options options;
+  options.timeout_ms = 2000;
+  std::vector<std::size_t> workers;
+  const char* file = nullptr;
+  AsyncDnsClient::QueryType default_type = AsyncDnsClient::TYPE_A;
+  Settings settings;
+  unsigned int verbose = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:s:p:w:S:t:c:T:Q:C:l:R:X:UAPvh")) != -1) {
+    switch (opt) {
+      case 'f':
+        file = optarg;
+        break;
+      case 's':
+        ns_ips.push_back(optarg);
+        break;
+      case 'p':
+        ns_port = std::atoi(optarg);
+        break;
+      case 'w': {
+        std::istringstream list(optarg);
+        std::string n;
+        while (std::getline(list, n, ',')) {
+          workers.push_back(std::atoi(n.c_str()));
+        }
+        break;
+      }
+      case 'S':
+        options.n_shards = std::atoi(optarg);
+        break;
+      case 't':
+        options.timeout_ms = std::atoi(optarg);
+        break;
+      case 'c':
+        options.cache_size = std::atoi(optarg);
+        break;
+      case 'T': {
+        auto type = parse_query_type(optarg);
+        if (!type) {
+          std::cerr << "invalid query type: " << optarg << std::endl;
+          return 1;
+        }
+        default_type = *type;
+        break;
+      }
+      case 'Q':
+        settings.qps = std::atof(optarg);
+        break;
+      case 'C':
+        settings.window = std::max(std::atoi(optarg), 1);
+        break;
+      case 'l':
+        settings.duration = std::chrono::milliseconds(std::int64_t(std::atof(optarg) * 1000));
+        break;
+      case 'R':
+        options.cache_refresh_ahead = std::atoi(optarg);
+        break;
+      case 'X':
+        options.cache_max_stale = std::atoi(optarg);
+        break;
+      case 'U':
+        options.io_uring = true;
+        break;
+      case 'A':
+        options.per_core = true;
+        options.numa_local = true;
+        break;
+      case 'P':
+        settings.prepare = true;
+        break;
+      case 'v':
+        ++verbose;
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (!file || optind != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Set the logging threshold to ERROR.
+  Logger::instance().set_threshold(Logger::Level((unsigned int)Logger::Level::ERROR + verbose));
+
+  std::vector<QuerySpec> queries;
+  if (std::string_view(file) == "-") {
+    if (!read_queries(std::cin, default_type, queries)) {
+      return 1;
+    }
+  }
+  else {
+    std::ifstream is(file);
+    if (!is) {
+      std::cerr << file << ": cannot open" << std::endl;
+      return 1;
+    }
+    if (!read_queries(is, default_type, queries)) {
+      return 1;
+    }
+  }
+  if (queries.empty()) {
+    std::cerr << file << ": no queries" << std::endl;
+    return 1;
+  }
+
+  if (ns_ips.empty()) {
+    ns_ips.push_back("127.0.0.1");
+  }
+
+  std::vector<boost::asio::ip::udp::endpoint> nameservers;
+  for (auto&& ns_ip: ns_ips) {
+    nameservers.emplace_back(boost::asio::ip::make_address(ns_ip), ns_port);
+  }
+
+  if (workers.empty()) {
+    workers.push_back(std::thread::hardware_concurrency());
+  }
+
+  print_header();
+
+  for (auto n_workers: workers) {
+    options.n_workers = std::max<std::size_t>(n_workers, 1);
+
+    AsyncDnsClient dns(nameservers, options);
+    dns.start();
+
+    auto result = Run(dns, queries, settings)();
+    result.workers = options.n_workers;
+    result.shards = dns.n_shards();
+
+    dns.stop();
+    print_result(result);
+  }
+
+  return 0;
+}
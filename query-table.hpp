@@ -0,0 +1,109 @@
+// query-table.hpp
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <utility>
+#include <vector>
+
+
+//
+// Table of in-flight queries indexed directly by the 16-bit DNS ID
+//
+// The table owns the ID space: a query is registered under a randomly chosen
+// unused ID (to make spoofing answers harder), so two in-flight queries never
+// share an ID. The slots and the free list are preallocated, so registering,
+// looking up and unregistering a query is O(1) and never allocates.
+//
+// Each slot carries a generation counter bumped whenever the slot is reused,
+// so a stale reference (e.g. held by a timeout handler) can tell that the
+// slot now belongs to someone else.
+//
+// T must be default constructible and contextually convertible to bool
+// (false == empty slot), e.g. a smart pointer.
+//
+template<typename T>
+class QueryTable
+{
+public:
+  static constexpr std::size_t SIZE = 1 << 16;
+
+  struct Key
+  {
+    std::uint16_t id;
+    std::uint32_t generation;
+  };
+
+  QueryTable()
+    : slots_(SIZE),
+      rng_(std::random_device()())
+  {
+    free_.reserve(SIZE);
+    for (std::size_t id = 0; id < SIZE; ++id) {
+      free_.push_back(id);
+    }
+  }
+
+  // Stores the value under a random unused ID. Returns nullopt if all the IDs
+  // are in use.
+  std::optional<Key> insert(T value)
+  {
+    if (free_.empty()) {
+      return std::nullopt;
+    }
+
+    // Pick a random free ID and fill the hole with the last one.
+    auto i = (std::uint64_t(rng_()) * free_.size()) >> 32;
+    auto id = free_[i];
+    free_[i] = free_.back();
+    free_.pop_back();
+
+    auto& slot = slots_[id];
+    slot.value = std::move(value);
+    return Key{id, ++slot.generation};
+  }
+
+  // Returns the value stored in the slot or nullptr if the slot is empty.
+  T* find(std::uint16_t id)
+  {
+    auto& slot = slots_[id];
+    return slot.value ? &slot.value : nullptr;
+  }
+
+  // Returns the value only if the slot was not reused since the generation.
+  T* find(std::uint16_t id, std::uint32_t generation)
+  {
+    auto& slot = slots_[id];
+    return slot.value && slot.generation == generation ? &slot.value : nullptr;
+  }
+
+  // Empties the slot and releases the ID if the slot was not reused since
+  // the generation.
+  bool erase(std::uint16_t id, std::uint32_t generation)
+  {
+    auto& slot = slots_[id];
+    if (!slot.value || slot.generation != generation) {
+      return false;
+    }
+    slot.value = T();
+    free_.push_back(id);
+    return true;
+  }
+
+  std::size_t size() const { return SIZE - free_.size(); }
+  bool full() const { return free_.empty(); }
+
+private:
+  struct Slot
+  {
+    T value{};
+    std::uint32_t generation = 0;
+  };
+
+  std::vector<Slot> slots_;
+  std::vector<std::uint16_t> free_;
+  std::mt19937 rng_;
+};
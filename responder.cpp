@@ -0,0 +1,128 @@
+// responder.cpp
+//
+// Standalone fake nameserver, e.g. as the target of adc-perf: answers from the
+// synthetic zone of FakeResponder until interrupted.
+
+#include "fake-responder.hpp"
+#include "logging.hpp"
+
+#include <boost/asio/signal_set.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include <unistd.h>  // getopt
+
+
+namespace {
+
+void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " [OPTIONS]\n"
+               "\n"
+               "  Options:\n"
+               "      -a IP    Address to listen on (default: 127.0.0.1)\n"
+               "      -p PORT  Port to listen on, UDP and TCP (default: 5353)\n"
+               "      -l P     Probability of losing a response (default: 0)\n"
+               "      -d MS    Delay of the responses in milliseconds (default: 0)\n"
+               "      -t P     Probability of truncating a response (default: 0)\n"
+               "      -i P     Probability of mismatching the ID of a response (default: 0)\n"
+               "      -n N     Addresses per A/AAAA answer (default: 1)\n"
+               "      -T TTL   TTL of the answers (default: 300)\n"
+               "      -r SEED  Seed of the injections, 0 == random (default: 1)\n"
+               "      -v       Verbose logging (use multiple times)\n";
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+  const char* ip = "127.0.0.1";
+  unsigned short port = 5353;
+  FakeResponder::Options options;
+  unsigned int verbose = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:l:d:t:i:n:T:r:vh")) != -1) {
+    switch (opt) {
+      case 'a':
+        ip = optarg;
+        break;
+      case 'p':
+        port = std::atoi(optarg);
+        break;
+      case 'l':
+        options.loss = std::atof(optarg);
+        break;
+      case 'd':
+        options.delay = std::chrono::microseconds(std::int64_t(std::atof(optarg) * 1000));
+        break;
+      case 't':
+        options.truncation = std::atof(optarg);
+        break;
+      case 'i':
+        options.id_mismatch = std::atof(optarg);
+        break;
+      case 'n':
+        options.n_addresses = std::max(std::atoi(optarg), 1);
+        break;
+      case 'T':
+        options.ttl = std::atoi(optarg);
+        break;
+      case 'r':
+        options.seed = std::atoi(optarg);
+        break;
+      case 'v':
+        ++verbose;
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Set the logging threshold to ERROR.
+  Logger::instance().set_threshold(Logger::Level((unsigned int)Logger::Level::ERROR + verbose));
+
+  boost::asio::io_context io;
+
+  std::unique_ptr<FakeResponder> responder;
+  try {
+    responder = std::make_unique<FakeResponder>(
+        io, boost::asio::ip::udp::endpoint(boost::asio::ip::make_address(ip), port), options);
+  }
+  catch (const std::exception& e) {
+    std::cerr << ip << ":" << port << ": " << e.what() << std::endl;
+    return 1;
+  }
+
+  boost::asio::signal_set signals(io, SIGINT, SIGTERM);
+  signals.async_wait([&responder](auto err, auto) {
+    if (!err) {
+      responder->stop();
+    }
+  });
+
+  INFO() << "answering at " << responder->endpoint();
+  responder->start();
+  io.run();
+
+  std::cout << "received=" << responder->received()
+            << " answered=" << responder->answered()
+            << " dropped=" << responder->dropped()
+            << " truncated=" << responder->truncated()
+            << " mismatched=" << responder->mismatched()
+            << " tcp=" << responder->tcp_answered() << std::endl;
+  return 0;
+}
@@ -0,0 +1,142 @@
+// stats.hpp
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+//
+// Counter written by a single thread and read by any
+//
+// Unlike an atomic increment, add() is just a plain load and store, so it
+// costs next to nothing on the writer's side.
+//
+class Counter
+{
+public:
+  void add(std::uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+  std::uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<std::uint64_t> value_{0};
+};
+
+//
+// Histogram of latencies with HDR-like log-linear buckets
+//
+// Values below SUB_BUCKETS are counted exactly, the larger ones in buckets
+// of 1/SUB_BUCKETS of their power of 2, so the relative error is below
+// 1/SUB_BUCKETS at any magnitude. The values are meant to be microseconds;
+// anything from 2^32 up is counted in the last bucket.
+//
+// Like Counter, a histogram is written by a single thread, but any thread
+// may take a snapshot (not necessarily consistent across the buckets).
+//
+class LatencyHistogram
+{
+public:
+  static constexpr unsigned int SUB_BUCKET_BITS = 4;
+  static constexpr std::size_t SUB_BUCKETS = std::size_t(1) << SUB_BUCKET_BITS;
+  static constexpr unsigned int MAX_BITS = 32;
+  static constexpr std::size_t N_BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static std::size_t bucket(std::uint64_t value)
+  {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    if (value >> MAX_BITS) {
+      return N_BUCKETS - 1;
+    }
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+  }
+
+  // The lowest value of the bucket.
+  static std::uint64_t lower_bound(std::size_t bucket)
+  {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    auto shift = bucket / SUB_BUCKETS - 1;
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  }
+
+  // The highest value of the bucket.
+  static std::uint64_t upper_bound(std::size_t bucket) { return lower_bound(bucket + 1) - 1; }
+
+  struct Snapshot
+  {
+    std::array<std::uint64_t, N_BUCKETS> counts{};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+
+    // Snapshots may be filled directly too (by a single thread).
+    void record(std::uint64_t value)
+    {
+      ++counts[bucket(value)];
+      ++count;
+      sum += value;
+    }
+
+    Snapshot& operator+=(const Snapshot& other)
+    {
+      for (std::size_t i = 0; i < N_BUCKETS; ++i) {
+        counts[i] += other.counts[i];
+      }
+      count += other.count;
+      sum += other.sum;
+      return *this;
+    }
+
+    // The highest value of the bucket of the quantile (0..1), i.e. an upper estimate, or 0 if empty.
+    std::uint64_t quantile(double q) const
+    {
+      auto rank = std::uint64_t(q * count);
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < N_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen > rank || (seen == count && counts[i] > 0)) {
+          return upper_bound(i);
+        }
+      }
+      return 0;
+    }
+
+    // The number of the values up to the bound (to the precision of the buckets).
+    std::uint64_t count_up_to(std::uint64_t bound) const
+    {
+      std::uint64_t n = 0;
+      for (std::size_t i = 0; i < N_BUCKETS && lower_bound(i) <= bound; ++i) {
+        n += counts[i];
+      }
+      return n;
+    }
+  };
+
+  void record(std::uint64_t value)
+  {
+    auto& bucket_count = counts_[bucket(value)];
+    bucket_count.store(bucket_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum_.store(sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const
+  {
+    Snapshot snapshot;
+    for (std::size_t i = 0; i < N_BUCKETS; ++i) {
+      snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+      snapshot.count += snapshot.counts[i];
+    }
+    snapshot.sum = sum_.load(std::memory_order_relaxed);
+    return snapshot;
+  }
+
+private:
+  std::array<std::atomic<std::uint64_t>, N_BUCKETS> counts_{};
+  std::atomic<std::uint64_t> sum_{0};
+};
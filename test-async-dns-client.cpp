@@ -0,0 +1,724 @@
+// test-async-dns-client.cpp
+//
+// Unit tests (Google Test) of the client against nameservers on the loopback:
+// the in-process FakeResponder, or a scripted one answering as told.
+
+#include "async-dns-client.hpp"
+#include "dns-message.hpp"
+#include "fake-responder.hpp"
+#include "logging.hpp"
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+using namespace std::chrono_literals;
+
+using Datagram = std::vector<unsigned char>;
+
+//
+// Nameserver answering each query by the datagrams the script makes of it, in order (none ==
+// not answering), on a thread of its own.
+//
+class ScriptedResponder
+{
+public:
+  using Script = std::function<std::vector<Datagram>(const unsigned char* query, std::size_t len)>;
+
+  explicit ScriptedResponder(Script script)
+    : script_(std::move(script)),
+      socket_(io_, {boost::asio::ip::make_address("127.0.0.1"), 0})
+  {
+    receive();
+    thread_ = std::thread([this]() { io_.run(); });
+  }
+
+  ~ScriptedResponder()
+  {
+    boost::asio::post(io_, [this]() { socket_.close(); });
+    thread_.join();
+  }
+
+  boost::asio::ip::udp::endpoint endpoint() const { return socket_.local_endpoint(); }
+
+  std::size_t received() const { return received_.load(); }
+
+private:
+  void receive()
+  {
+    socket_.async_receive_from(boost::asio::buffer(query_), remote_, [this](auto err, std::size_t len) {
+      if (err) {
+        return;
+      }
+      ++received_;
+      for (auto&& datagram: script_(query_.data(), len)) {
+        boost::system::error_code ec;
+        socket_.send_to(boost::asio::buffer(datagram), remote_, 0, ec);
+      }
+      receive();
+    });
+  }
+
+  Script script_;
+  boost::asio::io_context io_;
+  boost::asio::ip::udp::socket socket_;
+  boost::asio::ip::udp::endpoint remote_;
+  std::array<unsigned char, 512> query_;
+  std::atomic<std::size_t> received_{0};
+  std::thread thread_;
+};
+
+// FakeResponder running on a thread of its own.
+class ThreadedResponder
+{
+public:
+  explicit ThreadedResponder(const FakeResponder::Options& options)
+    : responder_(io_, {boost::asio::ip::make_address("127.0.0.1"), 0}, options)
+  {
+    responder_.start();
+    thread_ = std::thread([this]() { io_.run(); });
+  }
+
+  ~ThreadedResponder()
+  {
+    responder_.stop();
+    thread_.join();
+  }
+
+  boost::asio::ip::udp::endpoint endpoint() const { return responder_.endpoint(); }
+
+  const FakeResponder& responder() const { return responder_; }
+
+private:
+  boost::asio::io_context io_;
+  FakeResponder responder_;
+  std::thread thread_;
+};
+
+// The results of the queries, by the index of the query.
+class Results
+{
+public:
+  struct Result
+  {
+    unsigned int calls = 0;
+    AsyncDnsClient::QueryResult result = AsyncDnsClient::RESULT_ERROR;
+    DnsResponse response;
+  };
+
+  explicit Results(std::size_t n) : results_(n) {}
+
+  AsyncDnsClient::OnResponseCallback callback(std::size_t i)
+  {
+    return [this, i](auto result, auto, auto, const DnsResponseView& response) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& r = results_[i];
+      ++r.calls;
+      r.result = result;
+      r.response = DnsResponse(response);
+      ++n_calls_;
+      cv_.notify_all();
+    };
+  }
+
+  // Waits for n callbacks in all (of all the queries by default).
+  bool wait(std::chrono::steady_clock::duration timeout, std::size_t n = SIZE_MAX)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    n = std::min(n, results_.size());
+    return cv_.wait_for(lock, timeout, [this, n]() { return n_calls_ >= n; });
+  }
+
+  Result operator[](std::size_t i) const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return results_[i];
+  }
+
+  std::size_t size() const { return results_.size(); }
+
+private:
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Result> results_;
+  std::size_t n_calls_ = 0;
+};
+
+std::string name(std::size_t i)
+{
+  return "host" + std::to_string(i) + ".test.example.com";
+}
+
+// The addresses of the answer section.
+std::vector<boost::asio::ip::address> addresses(const DnsResponse& response)
+{
+  std::vector<boost::asio::ip::address> addrs;
+  for (auto&& rr: response.answers()) {
+    if (rr.type == ns_t_a || rr.type == ns_t_aaaa) {
+      addrs.push_back(rr.address());
+    }
+  }
+  return addrs;
+}
+
+// The answer of the fake zone to the query.
+Datagram answer(const unsigned char* query, std::size_t len, std::uint32_t ttl = 300)
+{
+  Datagram response(NS_PACKETSZ);
+  response.resize(FakeResponder::answer(query, len, response.data(), response.size(), 1, ttl));
+  return response;
+}
+
+class AsyncDnsClientTest : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    Logger::instance().set_threshold(Logger::Level::FATAL);
+  }
+};
+
+//
+// Shards
+//
+
+// One shard per worker by default and per core (whatever n_shards), else as many as asked for.
+TEST_F(AsyncDnsClientTest, Shards)
+{
+  auto endpoint = boost::asio::ip::udp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 53);
+
+  AsyncDnsClient::Options options;
+  options.n_workers = 2;
+  EXPECT_EQ(AsyncDnsClient({endpoint}, options).n_shards(), 2u);
+
+  options.n_shards = 3;
+  EXPECT_EQ(AsyncDnsClient({endpoint}, options).n_shards(), 3u);
+
+  options.per_core = true;
+  EXPECT_EQ(AsyncDnsClient({endpoint}, options).n_shards(), 2u);
+}
+
+//
+// Responses
+//
+
+// Responses to other than the question of the query are dropped, not finishing the query, so the
+// real response still gets through, and into the cache.
+TEST_F(AsyncDnsClientTest, ResponseToAnotherQuestion)
+{
+  ScriptedResponder server([](const unsigned char* query, std::size_t len) {
+    const auto real = answer(query, len);
+    const auto qtype = dns_skip_name(real.data(), real.size(), NS_HFIXEDSZ);
+
+    auto other_name = real;
+    other_name[NS_HFIXEDSZ + 1] ^= 1;
+    auto other_type = real;
+    dns_put16(ns_t_aaaa, &other_type[qtype]);
+    auto other_class = real;
+    dns_put16(ns_c_chaos, &other_class[qtype + 2]);
+    auto no_qr = real;
+    no_qr[2] &= ~0x80;
+    auto no_question = real;
+    dns_put16(0, &no_question[4]);
+
+    // The name in another case is still the question.
+    auto upper = real;
+    for (std::size_t i = NS_HFIXEDSZ; i < qtype; ++i) {
+      upper[i] = std::toupper(upper[i]);
+    }
+
+    return std::vector<Datagram>{other_name, other_type, other_class, no_qr, no_question, upper};
+  });
+
+  AsyncDnsClient::Options options;
+  options.cache_size = 16;
+  options.max_retransmissions = 0;
+  AsyncDnsClient dns({server.endpoint()}, options);
+  dns.start();
+
+  Results results(2);
+  dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(0));
+  ASSERT_TRUE(results.wait(5s, 1));
+
+  auto r = results[0];
+  EXPECT_EQ(r.result, AsyncDnsClient::RESULT_SUCCESS);
+  ASSERT_EQ(addresses(r.response).size(), 1u);
+  EXPECT_TRUE(addresses(r.response)[0].is_v4());
+
+  // From the cache.
+  dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(1));
+  ASSERT_TRUE(results.wait(5s));
+  EXPECT_EQ(results[1].result, AsyncDnsClient::RESULT_SUCCESS);
+  EXPECT_EQ(addresses(results[1].response), addresses(r.response));
+
+  auto stats = dns.stats();
+  EXPECT_EQ(stats.malformed, 5u);
+  EXPECT_EQ(stats.cache_hits, 1u);
+  EXPECT_EQ(server.received(), 1u);
+
+  dns.stop();
+}
+
+// Nor do they get into the cache when there is no real response.
+TEST_F(AsyncDnsClientTest, ResponseToAnotherQuestionOnly)
+{
+  ScriptedResponder server([](const unsigned char* query, std::size_t len) {
+    auto spoofed = answer(query, len);
+    spoofed[NS_HFIXEDSZ + 1] ^= 1;
+    return std::vector<Datagram>{spoofed};
+  });
+
+  AsyncDnsClient::Options options;
+  options.cache_size = 16;
+  options.timeout_ms = 100;
+  options.max_retransmissions = 0;
+  AsyncDnsClient dns({server.endpoint()}, options);
+  dns.start();
+
+  Results results(2);
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(i));
+    ASSERT_TRUE(results.wait(5s, i + 1));
+    EXPECT_EQ(results[i].result, AsyncDnsClient::RESULT_TIMEOUT);
+  }
+  EXPECT_EQ(server.received(), 2u);
+  EXPECT_EQ(dns.stats().cache_hits, 0u);
+
+  dns.stop();
+}
+
+//
+// Coalescing
+//
+
+// The lookups of a name in flight join it, whatever the spelling of the name: with or without
+// the trailing dot, in any case. Over several shards, so the spellings must land on the same one.
+TEST_F(AsyncDnsClientTest, CoalescedSpellings)
+{
+  ScriptedResponder server([](const unsigned char* query, std::size_t len) {
+    // Long enough for the other lookups to join.
+    std::this_thread::sleep_for(100ms);
+    return std::vector<Datagram>{answer(query, len)};
+  });
+
+  AsyncDnsClient::Options options;
+  options.n_shards = 4;
+  options.max_retransmissions = 0;
+  options.timeout_ms = 5000;
+  AsyncDnsClient dns({server.endpoint()}, options);
+  dns.start();
+
+  constexpr std::size_t N_NAMES = 8;
+  Results results(3 * N_NAMES);
+  for (std::size_t i = 0; i < N_NAMES; ++i) {
+    auto upper = name(i) + ".";
+    std::transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) { return std::toupper(c); });
+
+    dns.async_query(name(i), AsyncDnsClient::TYPE_A, results.callback(3 * i));
+    dns.async_query(name(i) + ".", AsyncDnsClient::TYPE_A, results.callback(3 * i + 1));
+    dns.async_query(upper, AsyncDnsClient::TYPE_A, results.callback(3 * i + 2));
+  }
+  ASSERT_TRUE(results.wait(10s));
+
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    EXPECT_EQ(results[i].result, AsyncDnsClient::RESULT_SUCCESS) << i;
+    EXPECT_EQ(addresses(results[i].response), addresses(results[i - i % 3].response)) << i;
+  }
+  EXPECT_EQ(server.received(), N_NAMES);
+  EXPECT_EQ(dns.stats().coalesced, 2 * N_NAMES);
+
+  dns.stop();
+}
+
+//
+// Admission control
+//
+
+// The queue is bounded by the queries queued and not finished: the queued queries timing out
+// (with the one in flight, here) give their places back, round after round.
+TEST_F(AsyncDnsClientTest, QueuedBounded)
+{
+  ScriptedResponder server([](const unsigned char*, std::size_t) { return std::vector<Datagram>(); });
+
+  AsyncDnsClient::Options options;
+  options.n_shards = 1;
+  options.max_inflight = 1;
+  options.max_queued = 2;
+  options.timeout_ms = 100;
+  options.max_retransmissions = 0;
+  AsyncDnsClient dns({server.endpoint()}, options);
+  dns.start();
+
+  for (std::size_t round = 1; round <= 3; ++round) {
+    Results results(4);
+    for (std::size_t i = 0; i < results.size(); ++i) {
+      dns.async_query(name(i), AsyncDnsClient::TYPE_A, results.callback(i));
+    }
+    ASSERT_TRUE(results.wait(5s)) << round;
+
+    // One in flight, two queued, the last one refused.
+    for (std::size_t i = 0; i < 3; ++i) {
+      EXPECT_EQ(results[i].result, AsyncDnsClient::RESULT_TIMEOUT) << round << " " << i;
+    }
+    EXPECT_EQ(results[3].result, AsyncDnsClient::RESULT_OVERLOADED) << round;
+    EXPECT_EQ(dns.stats().overloaded, round);
+  }
+
+  dns.stop();
+}
+
+//
+// Retransmissions
+//
+
+// The attempts of a query are bounded however they are taken: here by the retransmissions, the
+// hedge and, once all but one are taken, the retry without EDNS.
+TEST_F(AsyncDnsClientTest, AttemptsBounded)
+{
+  struct Counted
+  {
+    std::atomic<std::size_t> received{0};
+    ScriptedResponder::Script script()
+    {
+      return [this](const unsigned char* query, std::size_t len) {
+        if (++received != 7) {
+          return std::vector<Datagram>();
+        }
+        // FORMERR without an OPT RR: the nameserver does not support EDNS.
+        auto formerr = answer(query, len);
+        formerr[3] = (formerr[3] & 0xf0) | ns_r_formerr;
+        return std::vector<Datagram>{formerr};
+      };
+    }
+  } counted;
+  ScriptedResponder server1(counted.script());
+  ScriptedResponder server2(counted.script());
+
+  AsyncDnsClient::Options options;
+  options.timeout_ms = 1000;
+  options.max_retransmissions = 6;
+  options.hedge = true;
+  options.initial_rto_ms = 10;
+  options.min_rto_ms = 10;
+  options.max_rto_ms = 40;
+  AsyncDnsClient dns({server1.endpoint(), server2.endpoint()}, options);
+  dns.start();
+
+  Results results(1);
+  dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(0));
+  ASSERT_TRUE(results.wait(5s));
+  EXPECT_EQ(results[0].result, AsyncDnsClient::RESULT_TIMEOUT);
+
+  // AsyncDnsClient::MAX_ATTEMPTS
+  EXPECT_EQ(counted.received.load(), 8u);
+  EXPECT_EQ(dns.stats().sent, 8u);
+
+  dns.stop();
+}
+
+//
+// Cache
+//
+
+// Serve-stale and refresh-ahead are off without the cache, so the queries timing out just do.
+TEST_F(AsyncDnsClientTest, ServeStaleWithoutCache)
+{
+  ScriptedResponder server([](const unsigned char*, std::size_t) { return std::vector<Datagram>(); });
+
+  AsyncDnsClient::Options options;
+  options.cache_max_stale = 60;
+  options.cache_refresh_ahead = 50;
+  options.timeout_ms = 100;
+  options.max_retransmissions = 0;
+  AsyncDnsClient dns({server.endpoint()}, options);
+  dns.start();
+
+  Results results(8);
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    dns.async_query(name(i), AsyncDnsClient::TYPE_A, results.callback(i));
+  }
+  ASSERT_TRUE(results.wait(5s));
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    EXPECT_EQ(results[i].result, AsyncDnsClient::RESULT_TIMEOUT) << i;
+    EXPECT_TRUE(results[i].response.empty()) << i;
+  }
+
+  auto stats = dns.stats();
+  EXPECT_EQ(stats.timeouts, results.size());
+  EXPECT_EQ(stats.stale_answers, 0u);
+  EXPECT_EQ(stats.cache_refreshes, 0u);
+
+  dns.stop();
+}
+
+// With the cache, a query timing out is answered by the entry expired, its TTLs at most 30s.
+TEST_F(AsyncDnsClientTest, ServeStale)
+{
+  std::atomic<bool> answering{true};
+  ScriptedResponder server([&answering](const unsigned char* query, std::size_t len) {
+    return answering ? std::vector<Datagram>{answer(query, len, 1)} : std::vector<Datagram>();
+  });
+
+  AsyncDnsClient::Options options;
+  options.cache_size = 16;
+  options.cache_max_stale = 60;
+  options.timeout_ms = 100;
+  options.max_retransmissions = 0;
+  AsyncDnsClient dns({server.endpoint()}, options);
+  dns.start();
+
+  Results results(2);
+  dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(0));
+  ASSERT_TRUE(results.wait(5s, 1));
+  ASSERT_EQ(results[0].result, AsyncDnsClient::RESULT_SUCCESS);
+
+  // Expired (the TTL is 1s) and not answered any more.
+  answering = false;
+  std::this_thread::sleep_for(1100ms);
+  dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(1));
+  ASSERT_TRUE(results.wait(5s));
+
+  auto r = results[1];
+  EXPECT_EQ(r.result, AsyncDnsClient::RESULT_SUCCESS);
+  EXPECT_EQ(addresses(r.response), addresses(results[0].response));
+  for (auto&& rr: r.response.answers()) {
+    EXPECT_LE(rr.ttl, 30u);
+  }
+
+  auto stats = dns.stats();
+  EXPECT_EQ(stats.timeouts, 1u);
+  EXPECT_EQ(stats.stale_answers, 1u);
+  EXPECT_EQ(server.received(), 2u);
+
+  dns.stop();
+}
+
+//
+// Draining and stopping
+//
+
+// Every query in flight (or queued) gets its callback exactly once. Over io_uring, if the param.
+class DrainTest : public AsyncDnsClientTest, public ::testing::WithParamInterface<bool>
+{
+protected:
+  static constexpr std::size_t N_QUERIES = 100;
+
+  // The responses take delay to arrive.
+  void start(std::chrono::milliseconds delay)
+  {
+    FakeResponder::Options responder_options;
+    responder_options.delay = delay;
+    responder_ = std::make_unique<ThreadedResponder>(responder_options);
+
+    AsyncDnsClient::Options options;
+    options.n_workers = 2;
+    options.timeout_ms = 5000;
+    options.max_inflight = N_QUERIES / 2;  // the rest queued
+    options.io_uring = GetParam();
+    dns_ = std::make_unique<AsyncDnsClient>(std::vector<boost::asio::ip::udp::endpoint>{responder_->endpoint()},
+                                            options);
+    dns_->start();
+
+    for (std::size_t i = 0; i < N_QUERIES; ++i) {
+      dns_->async_query(name(i), AsyncDnsClient::TYPE_A, results_.callback(i));
+    }
+  }
+
+  void TearDown() override
+  {
+    if (dns_) {
+      dns_->stop();
+    }
+  }
+
+  // Checks that every query was called back once, with the result.
+  void expect_results(AsyncDnsClient::QueryResult result)
+  {
+    for (std::size_t i = 0; i < N_QUERIES; ++i) {
+      auto r = results_[i];
+      EXPECT_EQ(r.calls, 1u) << i;
+      EXPECT_EQ(r.result, result) << i;
+    }
+  }
+
+  // A query made now finishes right away, with RESULT_CANCELLED.
+  void expect_refused()
+  {
+    Results late(1);
+    dns_->async_query(name(N_QUERIES), AsyncDnsClient::TYPE_A, late.callback(0));
+    ASSERT_TRUE(late.wait(0s));
+    EXPECT_EQ(late[0].result, AsyncDnsClient::RESULT_CANCELLED);
+  }
+
+  std::unique_ptr<ThreadedResponder> responder_;
+  std::unique_ptr<AsyncDnsClient> dns_;
+  Results results_{N_QUERIES};
+};
+
+TEST_P(DrainTest, CancelledAtDeadline)
+{
+  start(1000ms);
+
+  std::promise<void> drained;
+  dns_->async_drain(std::chrono::steady_clock::now() + 50ms, [&drained]() { drained.set_value(); });
+  ASSERT_EQ(drained.get_future().wait_for(5s), std::future_status::ready);
+
+  // All finished by the time the drain is done.
+  EXPECT_TRUE(results_.wait(0s));
+  expect_results(AsyncDnsClient::RESULT_CANCELLED);
+  expect_refused();
+
+  EXPECT_EQ(dns_->stats().timeouts, 0u);
+
+  // Nor called back again by the responses arriving late, or by stop().
+  std::this_thread::sleep_for(1100ms);
+  dns_->stop();
+  expect_results(AsyncDnsClient::RESULT_CANCELLED);
+}
+
+TEST_P(DrainTest, FinishedBeforeDeadline)
+{
+  start(50ms);
+
+  std::promise<void> drained;
+  dns_->async_drain(std::chrono::steady_clock::now() + 5s, [&drained]() { drained.set_value(); });
+  ASSERT_EQ(drained.get_future().wait_for(10s), std::future_status::ready);
+
+  EXPECT_TRUE(results_.wait(0s));
+  expect_results(AsyncDnsClient::RESULT_SUCCESS);
+  expect_refused();
+
+  dns_->stop();
+  expect_results(AsyncDnsClient::RESULT_SUCCESS);
+}
+
+TEST_P(DrainTest, Idle)
+{
+  start(0ms);
+  ASSERT_TRUE(results_.wait(5s));
+
+  std::promise<void> drained;
+  dns_->async_drain(std::chrono::steady_clock::now() + 5s, [&drained]() { drained.set_value(); });
+  ASSERT_EQ(drained.get_future().wait_for(1s), std::future_status::ready);
+  expect_results(AsyncDnsClient::RESULT_SUCCESS);
+}
+
+// The queries submitted as the drain begins either go out and are waited for, or are cancelled:
+// none goes out once the drain is done. Racy by nature, hence the rounds.
+TEST_P(DrainTest, ConcurrentQueries)
+{
+  ThreadedResponder responder(FakeResponder::Options{});
+
+  AsyncDnsClient::Options options;
+  options.n_workers = 2;
+  options.timeout_ms = 5000;
+  options.max_inflight = 100;  // not to flood the responder, the rest overloaded
+  options.max_queued = 100;
+  options.io_uring = GetParam();
+
+  for (std::size_t round = 0; round < 20; ++round) {
+    AsyncDnsClient dns({responder.endpoint()}, options);
+    dns.start();
+
+    std::atomic<bool> submitting{true};
+    std::atomic<std::size_t> submitted{0};
+    std::atomic<std::size_t> finished{0};
+    std::atomic<std::size_t> cancelled{0};
+    std::atomic<std::size_t> failed{0};
+    auto cb = [&](auto result, auto, auto, const DnsResponseView&) {
+      (result == AsyncDnsClient::RESULT_SUCCESS || result == AsyncDnsClient::RESULT_OVERLOADED ? finished :
+       result == AsyncDnsClient::RESULT_CANCELLED ? cancelled : failed)++;
+    };
+
+    std::vector<std::thread> submitters;
+    for (std::size_t t = 0; t < 2; ++t) {
+      submitters.emplace_back([&, t]() {
+        for (std::size_t i = 0; submitting; ++i) {
+          dns.async_query(name(2 * i + t), AsyncDnsClient::TYPE_A, cb);
+          ++submitted;
+        }
+      });
+    }
+
+    std::this_thread::sleep_for(5ms);
+    std::promise<std::uint64_t> drained;
+    dns.async_drain(std::chrono::steady_clock::now() + 5s, [&dns, &drained]() {
+      drained.set_value(dns.stats().sent);
+    });
+    auto future = drained.get_future();
+    auto status = future.wait_for(10s);
+
+    submitting = false;
+    for (auto&& submitter: submitters) {
+      submitter.join();
+    }
+    if (status != std::future_status::ready) {
+      dns.stop();
+      FAIL() << "round " << round << " not drained";
+    }
+    auto sent = future.get();
+
+    for (auto until = std::chrono::steady_clock::now() + 5s;
+         finished + cancelled + failed < submitted && std::chrono::steady_clock::now() < until;) {
+      std::this_thread::sleep_for(1ms);
+    }
+
+    EXPECT_EQ(finished + cancelled + failed, submitted.load()) << round;
+    EXPECT_EQ(failed.load(), 0u) << round;
+    EXPECT_EQ(dns.stats().sent, sent) << round;
+
+    dns.stop();
+  }
+}
+
+TEST_P(DrainTest, CancelledByStop)
+{
+  start(1000ms);
+
+  // All finished by the time stop() returns.
+  dns_->stop();
+  EXPECT_TRUE(results_.wait(0s));
+  expect_results(AsyncDnsClient::RESULT_CANCELLED);
+  expect_refused();
+}
+
+INSTANTIATE_TEST_SUITE_P(, DrainTest, ::testing::Values(false, true),
+                         [](const auto& info) { return info.param ? "IoUring" : "Reactor"; });
+
+// The queries of a client never started are cancelled by stop() too.
+TEST_F(AsyncDnsClientTest, CancelledByStopNotStarted)
+{
+  ThreadedResponder responder(FakeResponder::Options{});
+  AsyncDnsClient dns({responder.endpoint()}, AsyncDnsClient::Options());
+
+  Results results(2);
+  dns.async_query(name(0), AsyncDnsClient::TYPE_A, results.callback(0));
+  dns.async_query(name(1), AsyncDnsClient::TYPE_A, results.callback(1));
+
+  dns.stop();
+  ASSERT_TRUE(results.wait(0s));
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    EXPECT_EQ(results[i].calls, 1u) << i;
+    EXPECT_EQ(results[i].result, AsyncDnsClient::RESULT_CANCELLED) << i;
+  }
+}
+
+}  // namespace
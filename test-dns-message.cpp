@@ -0,0 +1,532 @@
+// test-dns-message.cpp
+//
+// Unit tests (Google Test) of the wire format: the encoder, and the decoder
+// against malformed input, as the responses come off the network.
+
+#include "dns-message.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+//
+// Message builder
+//
+
+struct Message
+{
+  std::vector<unsigned char> data;
+
+  // A response header with the counts of the sections.
+  Message(std::uint16_t qd, std::uint16_t an, std::uint16_t ns = 0, std::uint16_t ar = 0)
+    : data(NS_HFIXEDSZ)
+  {
+    dns_put16(0x1234, &data[0]);
+    data[2] = 0x81;  // QR=1, RD=1
+    data[3] = 0x80;  // RA=1
+    dns_put16(qd, &data[4]);
+    dns_put16(an, &data[6]);
+    dns_put16(ns, &data[8]);
+    dns_put16(ar, &data[10]);
+  }
+
+  std::size_t size() const { return data.size(); }
+
+  Message& bytes(std::initializer_list<unsigned char> bytes)
+  {
+    data.insert(data.end(), bytes);
+    return *this;
+  }
+
+  Message& u16(std::uint16_t v)
+  {
+    return bytes({static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)});
+  }
+
+  Message& u32(std::uint32_t v)
+  {
+    return u16(v >> 16).u16(v);
+  }
+
+  // The labels of a name as given (e.g. {"www", "example", "com"}), to be ended by the root
+  // label or a pointer.
+  Message& labels(std::initializer_list<std::string> labels)
+  {
+    for (auto&& label: labels) {
+      data.push_back(label.size());
+      data.insert(data.end(), label.begin(), label.end());
+    }
+    return *this;
+  }
+
+  // An uncompressed name.
+  Message& name(std::initializer_list<std::string> labels)
+  {
+    return this->labels(labels).bytes({0});
+  }
+
+  Message& pointer(std::uint16_t offset)
+  {
+    return u16(0xc000 | offset);
+  }
+
+  // TYPE, CLASS, TTL and RDLENGTH of an RR, the rdata to follow.
+  Message& rr(std::uint16_t type, std::uint16_t rdlength, std::uint32_t ttl = 300)
+  {
+    return u16(type).u16(ns_c_in).u32(ttl).u16(rdlength);
+  }
+
+  bool parse(DnsMessage& msg) const { return msg.parse(data.data(), data.size()); }
+};
+
+std::string decode(const Message& m, std::size_t offset)
+{
+  char buf[NS_MAXDNAME];
+  return std::string(buf, DnsName(m.data.data(), m.size(), offset).decode(buf, sizeof(buf)));
+}
+
+// Reads all the RRs, returns the number read.
+std::size_t read_all(const DnsMessage& msg, bool& error)
+{
+  DnsRecordReader reader(msg);
+  DnsRecord rr;
+  std::size_t n = 0;
+  while (reader.next(rr)) {
+    ++n;
+  }
+  error = reader.error();
+  return n;
+}
+
+//
+// Encoder
+//
+
+TEST(DnsEncode, Name)
+{
+  unsigned char buf[NS_MAXCDNAME];
+  ASSERT_EQ(dns_encode_name(buf, sizeof(buf), "www.example.com"), 17u);
+  EXPECT_EQ(std::memcmp(buf, "\3www\7example\3com", 17), 0);
+
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), "www.example.com."), 17u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), "."), 1u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), ""), 1u);
+
+  ASSERT_EQ(dns_encode_name(buf, sizeof(buf), "a\\.b\\065"), 6u);
+  EXPECT_EQ(std::memcmp(buf, "\4a.bA", 6), 0);
+}
+
+TEST(DnsEncode, NameMalformed)
+{
+  unsigned char buf[NS_MAXCDNAME];
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), "www..example.com"), 0u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), ".www"), 0u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), "www\\"), 0u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), "www\\25"), 0u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), "www\\256"), 0u);
+  EXPECT_EQ(dns_encode_name(buf, 4, "www.example.com"), 0u);
+}
+
+TEST(DnsEncode, NameLimits)
+{
+  unsigned char buf[2 * NS_MAXCDNAME];
+
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), std::string(63, 'a')), 65u);
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), std::string(64, 'a')), 0u);
+
+  // 3 labels of 63 octets and one of 61: 255 octets in the wire format, the most allowed.
+  const std::string label(63, 'a');
+  const std::string longest = label + "." + label + "." + label + "." + std::string(61, 'b');
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), longest), std::size_t(NS_MAXCDNAME));
+  EXPECT_EQ(dns_encode_name(buf, sizeof(buf), longest + "b"), 0u);
+}
+
+TEST(DnsEncode, Query)
+{
+  unsigned char buf[NS_PACKETSZ];
+  auto len = dns_encode_query(buf, sizeof(buf), 0xabcd, "www.example.com", ns_t_aaaa);
+  ASSERT_EQ(len, std::size_t(NS_HFIXEDSZ + 17 + NS_QFIXEDSZ));
+
+  DnsMessage msg;
+  ASSERT_TRUE(msg.parse(buf, len));
+  EXPECT_EQ(msg.id(), 0xabcd);
+  EXPECT_FALSE(msg.qr());
+  EXPECT_TRUE(msg.rd());
+  EXPECT_EQ(msg.count(ns_s_qd), 1);
+  EXPECT_EQ(msg.records_offset(), len);
+  EXPECT_EQ(DnsName(buf, len, NS_HFIXEDSZ).to_string(), "www.example.com");
+  EXPECT_EQ(dns_get16(buf + len - 4), ns_t_aaaa);
+  EXPECT_EQ(dns_get16(buf + len - 2), ns_c_in);
+
+  EXPECT_EQ(dns_encode_query(buf, NS_HFIXEDSZ + 10, 1, "www.example.com", ns_t_a), 0u);
+}
+
+//
+// Header and question
+//
+
+TEST(DnsMessage, Header)
+{
+  DnsMessage msg;
+  Message m(0, 0);
+  ASSERT_TRUE(m.parse(msg));
+  EXPECT_TRUE(msg.qr());
+  EXPECT_TRUE(msg.rd());
+  EXPECT_TRUE(msg.ra());
+  EXPECT_EQ(msg.rcode(), 0u);
+
+  EXPECT_FALSE(msg.parse(m.data.data(), NS_HFIXEDSZ - 1));
+}
+
+TEST(DnsMessage, QuestionTruncated)
+{
+  DnsMessage msg;
+
+  // No QTYPE and QCLASS.
+  EXPECT_FALSE(Message(1, 0).name({"www", "example"}).parse(msg));
+
+  // QCLASS cut short.
+  EXPECT_FALSE(Message(1, 0).name({"www"}).u16(ns_t_a).bytes({0}).parse(msg));
+
+  // A label past the end.
+  EXPECT_FALSE(Message(1, 0).bytes({10, 'w', 'w', 'w'}).parse(msg));
+
+  // One more question than there is.
+  EXPECT_FALSE(Message(2, 0).name({"www"}).u16(ns_t_a).u16(ns_c_in).parse(msg));
+
+  // A pointer cut short.
+  EXPECT_FALSE(Message(1, 0).bytes({0xc0}).parse(msg));
+}
+
+TEST(DnsMessage, ReservedLabelTypes)
+{
+  DnsMessage msg;
+  EXPECT_FALSE(Message(1, 0).bytes({0x40, 0}).u16(ns_t_a).u16(ns_c_in).parse(msg));
+  EXPECT_FALSE(Message(1, 0).bytes({0x80, 0}).u16(ns_t_a).u16(ns_c_in).parse(msg));
+}
+
+TEST(DnsMessage, MatchesQuestion)
+{
+  unsigned char query[NS_PACKETSZ];
+  auto len = dns_encode_query(query, sizeof(query), 1, "www.Example.com", ns_t_a);
+  len = dns_encode_opt(query, sizeof(query), len, DnsEdns());
+  ASSERT_GT(len, 0u);
+
+  DnsMessage msg;
+  auto same = Message(1, 0).name({"WWW", "example", "COM"}).u16(ns_t_a).u16(ns_c_in);
+  ASSERT_TRUE(same.parse(msg));
+  EXPECT_TRUE(msg.matches_question(query, len));
+
+  auto other_name = Message(1, 0).name({"www", "example", "org"}).u16(ns_t_a).u16(ns_c_in);
+  ASSERT_TRUE(other_name.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+
+  auto other_type = Message(1, 0).name({"www", "example", "com"}).u16(ns_t_aaaa).u16(ns_c_in);
+  ASSERT_TRUE(other_type.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+
+  auto other_class = Message(1, 0).name({"www", "example", "com"}).u16(ns_t_a).u16(ns_c_chaos);
+  ASSERT_TRUE(other_class.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+
+  // A suffix or a prefix of the name.
+  auto suffix = Message(1, 0).name({"example", "com"}).u16(ns_t_a).u16(ns_c_in);
+  ASSERT_TRUE(suffix.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+  auto prefix = Message(1, 0).name({"www", "example"}).u16(ns_t_a).u16(ns_c_in);
+  ASSERT_TRUE(prefix.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+
+  // The same labels, "www.example" "com" as one ("www.example.com" with an escaped dot).
+  auto dotted = Message(1, 0).name({"www.example", "com"}).u16(ns_t_a).u16(ns_c_in);
+  ASSERT_TRUE(dotted.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+
+  // No question, or more than one.
+  Message none(0, 0);
+  ASSERT_TRUE(none.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+  auto two = Message(2, 0).name({"www", "example", "com"}).u16(ns_t_a).u16(ns_c_in);
+  two.name({"www", "example", "com"}).u16(ns_t_a).u16(ns_c_in);
+  ASSERT_TRUE(two.parse(msg));
+  EXPECT_FALSE(msg.matches_question(query, len));
+}
+
+//
+// RRs
+//
+
+TEST(DnsRecordReader, Records)
+{
+  Message m(1, 1, 0, 1);
+  m.name({"www", "example", "com"}).u16(ns_t_a).u16(ns_c_in);
+  m.pointer(NS_HFIXEDSZ).rr(ns_t_a, 4, 60).bytes({10, 0, 0, 1});
+  m.bytes({0}).rr(ns_t_opt, 0);
+
+  DnsMessage msg;
+  ASSERT_TRUE(m.parse(msg));
+
+  DnsRecordReader reader(msg);
+  DnsRecord rr;
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_EQ(reader.section(), ns_s_an);
+  EXPECT_EQ(rr.name.to_string(), "www.example.com");
+  EXPECT_EQ(rr.type, ns_t_a);
+  EXPECT_EQ(rr.ttl, 60u);
+  EXPECT_EQ(rr.address(), boost::asio::ip::make_address("10.0.0.1"));
+
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_EQ(reader.section(), ns_s_ar);
+  EXPECT_EQ(rr.type, ns_t_opt);
+  EXPECT_EQ(rr.name.to_string(), ".");
+
+  EXPECT_FALSE(reader.next(rr));
+  EXPECT_FALSE(reader.error());
+  EXPECT_TRUE(msg.has_opt());
+}
+
+TEST(DnsRecordReader, HeaderTruncated)
+{
+  // The fixed part of the RR cut short, at each length.
+  for (std::size_t n = 0; n < NS_RRFIXEDSZ; ++n) {
+    Message m(0, 1);
+    m.name({"www"});
+    m.data.resize(m.size() + n);
+
+    DnsMessage msg;
+    ASSERT_TRUE(m.parse(msg));
+    bool error;
+    EXPECT_EQ(read_all(msg, error), 0u) << n;
+    EXPECT_TRUE(error) << n;
+  }
+
+  // The owner name cut short.
+  Message m(0, 1);
+  m.bytes({3, 'w', 'w'});
+  DnsMessage msg;
+  ASSERT_TRUE(m.parse(msg));
+  bool error;
+  EXPECT_EQ(read_all(msg, error), 0u);
+  EXPECT_TRUE(error);
+}
+
+TEST(DnsRecordReader, RdlengthPastEnd)
+{
+  Message m(0, 2);
+  m.name({"a"}).rr(ns_t_a, 4).bytes({10, 0, 0, 1});
+  m.name({"b"}).rr(ns_t_a, 5).bytes({10, 0, 0, 2});
+
+  DnsMessage msg;
+  ASSERT_TRUE(m.parse(msg));
+  bool error;
+  EXPECT_EQ(read_all(msg, error), 1u);
+  EXPECT_TRUE(error);
+
+  // Nor past the end of a message of more RRs than there are.
+  Message more(0, 2);
+  more.name({"a"}).rr(ns_t_a, 4).bytes({10, 0, 0, 1});
+  ASSERT_TRUE(more.parse(msg));
+  EXPECT_EQ(read_all(msg, error), 1u);
+  EXPECT_TRUE(error);
+}
+
+TEST(DnsRecordReader, AnswersOfSection)
+{
+  Message m(0, 2, 1, 0);
+  m.name({"a"}).rr(ns_t_a, 4, 100).bytes({10, 0, 0, 1});
+  m.name({"a"}).rr(ns_t_a, 4, 10).bytes({10, 0, 0, 2});
+  m.name({"ns"}).rr(ns_t_ns, 3).name({"a"});
+
+  DnsMessage msg;
+  ASSERT_TRUE(m.parse(msg));
+
+  // With an age of 20s, the TTLs go down by it, till 0.
+  DnsResponseView view(msg, 20);
+  std::vector<std::uint32_t> ttls;
+  for (auto&& rr: view.answers()) {
+    ttls.push_back(rr.ttl);
+  }
+  EXPECT_EQ(ttls, (std::vector<std::uint32_t>{80, 0}));
+
+  std::size_t n = 0;
+  for (auto&& rr: view.records(ns_s_ns)) {
+    ASSERT_TRUE(rr.target());
+    EXPECT_EQ(rr.target()->to_string(), "a");
+    ++n;
+  }
+  EXPECT_EQ(n, 1u);
+  EXPECT_TRUE(view.records(ns_s_ar).empty());
+}
+
+//
+// Names
+//
+
+TEST(DnsName, Compressed)
+{
+  Message m(0, 0);
+  m.name({"example", "com"});  // at 12
+  m.bytes({3, 'w', 'w', 'w'}).pointer(NS_HFIXEDSZ);  // at 25
+  m.bytes({4, 'm', 'a', 'i', 'l'}).pointer(25);  // at 31, a pointer to a pointer
+
+  EXPECT_EQ(decode(m, NS_HFIXEDSZ), "example.com");
+  EXPECT_EQ(decode(m, 25), "www.example.com");
+  EXPECT_EQ(decode(m, 31), "mail.www.example.com");
+  EXPECT_EQ(dns_skip_name(m.data.data(), m.size(), 25), 31u);
+}
+
+TEST(DnsName, PointerLoops)
+{
+  // A pointer to itself.
+  Message self(0, 0);
+  self.pointer(NS_HFIXEDSZ);
+  EXPECT_EQ(decode(self, NS_HFIXEDSZ), "");
+
+  // A label and a pointer back to it: pointing back at every jump, the name grows till too long.
+  Message back(0, 0);
+  back.bytes({1, 'a'}).pointer(NS_HFIXEDSZ);
+  EXPECT_EQ(decode(back, NS_HFIXEDSZ), "");
+
+  // Two pointers to each other.
+  Message pair(0, 0);
+  pair.pointer(NS_HFIXEDSZ + 2).pointer(NS_HFIXEDSZ);
+  EXPECT_EQ(decode(pair, NS_HFIXEDSZ), "");
+  EXPECT_EQ(decode(pair, NS_HFIXEDSZ + 2), "");
+}
+
+TEST(DnsName, ForwardPointer)
+{
+  Message m(0, 0);
+  m.pointer(NS_HFIXEDSZ + 2).name({"www"});
+  EXPECT_EQ(decode(m, NS_HFIXEDSZ), "");
+  EXPECT_EQ(decode(m, NS_HFIXEDSZ + 2), "www");
+
+  // Past the end of the message.
+  Message past(0, 0);
+  past.pointer(0x3fff);
+  EXPECT_EQ(decode(past, NS_HFIXEDSZ), "");
+}
+
+TEST(DnsName, Malformed)
+{
+  // A label past the end.
+  Message label(0, 0);
+  label.bytes({5, 'w', 'w', 'w'});
+  EXPECT_EQ(decode(label, NS_HFIXEDSZ), "");
+
+  // No terminating root label.
+  Message unterminated(0, 0);
+  unterminated.bytes({3, 'w', 'w', 'w'});
+  EXPECT_EQ(decode(unterminated, NS_HFIXEDSZ), "");
+  EXPECT_EQ(dns_skip_name(unterminated.data.data(), unterminated.size(), NS_HFIXEDSZ), 0u);
+
+  // Reserved label types.
+  Message reserved(0, 0);
+  reserved.bytes({0x41, 'a', 0});
+  EXPECT_EQ(decode(reserved, NS_HFIXEDSZ), "");
+}
+
+TEST(DnsName, TooLong)
+{
+  const std::string label(63, 'a');
+
+  // 255 octets in the wire format, the most allowed.
+  Message longest(0, 0);
+  longest.name({label, label, label, std::string(61, 'b')});
+  EXPECT_EQ(decode(longest, NS_HFIXEDSZ).size(), 3 * 64 + 61u);
+
+  Message too_long(0, 0);
+  too_long.name({label, label, label, std::string(62, 'b')});
+  EXPECT_EQ(decode(too_long, NS_HFIXEDSZ), "");
+
+  // Too long only by the pointers: 2 * 64 octets here, under a pointer to 3 * 64 there.
+  Message compressed(0, 0);
+  compressed.name({label, label, label});  // at 12
+  compressed.labels({label, label}).pointer(NS_HFIXEDSZ);
+  const std::size_t at = NS_HFIXEDSZ + 3 * 64 + 1;
+  EXPECT_EQ(decode(compressed, at), "");
+  EXPECT_EQ(decode(compressed, NS_HFIXEDSZ).size(), 3 * 64 - 1u);
+}
+
+TEST(DnsName, Escaping)
+{
+  Message m(0, 0);
+  m.bytes({5, 'a', '.', 'b', ' ', 0xff, 0});
+  EXPECT_EQ(decode(m, NS_HFIXEDSZ), "a\\.b\\032\\255");
+
+  // Too long for the buffer.
+  char buf[4];
+  EXPECT_EQ(DnsName(m.data.data(), m.size(), NS_HFIXEDSZ).decode(buf, sizeof(buf)), 0u);
+}
+
+//
+// Typed rdata
+//
+
+TEST(DnsRecord, TypedRdata)
+{
+  Message m(0, 4);
+  m.name({"a"}).rr(ns_t_mx, 2 + 4).u16(10).name({"mx"});
+  m.name({"a"}).rr(ns_t_txt, 6).bytes({2, 'h', 'i', 2, 'y', 'o'});
+  m.name({"a"}).rr(ns_t_cname, 2).pointer(NS_HFIXEDSZ);
+  m.name({"a"}).rr(ns_t_aaaa, 4).bytes({1, 2, 3, 4});
+
+  DnsMessage msg;
+  ASSERT_TRUE(m.parse(msg));
+  DnsRecordReader reader(msg);
+  DnsRecord rr;
+
+  ASSERT_TRUE(reader.next(rr));
+  auto mx = rr.mx();
+  ASSERT_TRUE(mx);
+  EXPECT_EQ(mx->preference, 10);
+  EXPECT_EQ(mx->exchange.to_string(), "mx");
+  EXPECT_FALSE(rr.txt());
+
+  ASSERT_TRUE(reader.next(rr));
+  auto txt = rr.txt();
+  ASSERT_TRUE(txt);
+  std::vector<std::string_view> strings(txt->begin(), txt->end());
+  EXPECT_EQ(strings, (std::vector<std::string_view>{"hi", "yo"}));
+
+  ASSERT_TRUE(reader.next(rr));
+  ASSERT_TRUE(rr.target());
+  EXPECT_EQ(rr.target()->to_string(), "a");
+
+  // An AAAA of the wrong length has no address.
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_TRUE(rr.address().is_unspecified());
+}
+
+TEST(DnsRecord, TypedRdataMalformed)
+{
+  Message m(0, 4);
+  m.name({"a"}).rr(ns_t_mx, 1).bytes({0});  // no room for the preference
+  m.name({"a"}).rr(ns_t_txt, 3).bytes({3, 'h', 'i'});  // a string past the rdata
+  m.name({"a"}).rr(ns_t_cname, 2).bytes({3, 'w'});  // the name past the rdata
+  m.name({"a"}).rr(ns_t_srv, 6).u16(1).u16(2).u16(53);  // no target
+
+  DnsMessage msg;
+  ASSERT_TRUE(m.parse(msg));
+  DnsRecordReader reader(msg);
+  DnsRecord rr;
+
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_FALSE(rr.mx());
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_FALSE(rr.txt());
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_FALSE(rr.target());
+  ASSERT_TRUE(reader.next(rr));
+  EXPECT_FALSE(rr.srv());
+  EXPECT_FALSE(reader.next(rr));
+  EXPECT_FALSE(reader.error());
+}
+
+}  // namespace
@@ -0,0 +1,70 @@
+// test-logging.cpp
+//
+// Unit tests (Google Test) of the logging macros: the levels compiled out and
+// the threshold at run time.
+
+#include "logging.hpp"
+
+#include <gtest/gtest.h>
+
+
+namespace {
+
+#ifdef NDEBUG
+static_assert(LOG_MAX_LEVEL == int(Logger::Level::INFO), "DBG() is compiled out of the release builds");
+#endif
+
+class LoggingTest : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    threshold_ = Logger::instance().get_threshold();
+  }
+
+  void TearDown() override
+  {
+    Logger::instance().set_threshold(threshold_);
+  }
+
+private:
+  Logger::Level threshold_;
+};
+
+// Counts its evaluations, i.e. the messages not compiled out nor filtered.
+struct Counted
+{
+  int& n;
+};
+
+std::ostream& operator<<(std::ostream& os, const Counted& counted)
+{
+  ++counted.n;
+  return os;
+}
+
+// Compiled out, the message is not even formatted, whatever the threshold.
+TEST_F(LoggingTest, CompiledOut)
+{
+  Logger::instance().set_threshold(Logger::Level::DEBUG);
+
+  int n = 0;
+  DBG() << "compiled in" << Counted{n};
+  EXPECT_EQ(n, LOG_MAX_LEVEL >= int(Logger::Level::DEBUG) ? 1 : 0);
+}
+
+// Below the threshold, neither.
+TEST_F(LoggingTest, Threshold)
+{
+  Logger::instance().set_threshold(Logger::Level::FATAL);
+
+  int n = 0;
+  ERR() << Counted{n};
+  EXPECT_EQ(n, 0);
+
+  Logger::instance().set_threshold(Logger::Level::ERROR);
+  ERR() << "not filtered" << Counted{n};
+  EXPECT_EQ(n, 1);
+}
+
+}  // namespace
@@ -0,0 +1,167 @@
+// timer-wheel.hpp
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+//
+// Hashed timing wheel
+//
+// Timers are intrusive: the objects to be timed out derive from
+// TimerWheel::Hook, so scheduling and cancelling a timer is O(1) and never
+// allocates. The wheel does not run on its own; the owner calls expire()
+// periodically (every resolution while the wheel is not empty) and gets the
+// timers expired since the last call in a batch.
+//
+// A timer never fires early, but may fire up to one resolution late (plus
+// however late expire() is called). Deadlines further away than the wheel's
+// span simply stay in their slot for more rounds.
+//
+class TimerWheel
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Hook
+  {
+    Hook* prev = nullptr;
+    Hook* next = nullptr;
+    std::uint64_t tick = 0;  // expiration
+
+    bool scheduled() const { return prev != nullptr; }
+  };
+
+  explicit TimerWheel(Clock::duration resolution = std::chrono::milliseconds(1),
+                      std::size_t n_slots = 4096)
+    : resolution_(resolution),
+      origin_(Clock::now()),
+      slots_(n_slots)
+  {
+    for (auto&& slot: slots_) {
+      slot.prev = slot.next = &slot;
+    }
+  }
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  Clock::duration resolution() const { return resolution_; }
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }
+
+  // (Re)schedules the timer.
+  void schedule(Hook& hook, Clock::time_point deadline)
+  {
+    cancel(hook);
+
+    // Round up so the timer does not fire early, and never schedule into a
+    // tick that was already processed.
+    std::int64_t tick = (deadline - origin_ + resolution_ - Clock::duration(1)) / resolution_;
+    hook.tick = tick > std::int64_t(current_) ? std::uint64_t(tick) : current_ + 1;
+    link(slots_[hook.tick % slots_.size()], hook);
+    ++size_;
+  }
+
+  void cancel(Hook& hook)
+  {
+    if (hook.scheduled()) {
+      unlink(hook);
+      --size_;
+    }
+  }
+
+  // Unschedules all the timers, then calls fn(Hook&) for each of them; fn
+  // may schedule timers again.
+  template<typename F>
+  void clear(F&& fn)
+  {
+    Hook all;
+    all.prev = all.next = &all;
+    for (auto&& slot: slots_) {
+      while (slot.next != &slot) {
+        auto* hook = slot.next;
+        unlink(*hook);
+        link(all, *hook);
+      }
+    }
+    size_ = 0;
+
+    while (all.next != &all) {
+      auto* hook = all.next;
+      unlink(*hook);
+      fn(*hook);
+    }
+  }
+
+  // Calls fn(Hook&) for every timer expired by now. The timers are
+  // unscheduled before the calls, and fn may schedule or cancel any timer.
+  template<typename F>
+  void expire(Clock::time_point now, F&& fn)
+  {
+    std::uint64_t now_tick = (now - origin_) / resolution_;
+    if (now_tick <= current_) {
+      return;
+    }
+    if (size_ == 0) {
+      current_ = now_tick;
+      return;
+    }
+
+    // Collect the expired timers first so that fn can't disturb the walk.
+    // They are still counted in size_ until handed over to fn.
+    Hook expired;
+    expired.prev = expired.next = &expired;
+    std::size_t n_expired = 0;
+
+    // A full turn of the wheel visits every slot.
+    auto first = std::max(current_ + 1, now_tick >= slots_.size() ? now_tick - slots_.size() + 1 : 0);
+    for (auto tick = first; tick <= now_tick && n_expired < size_; ++tick) {
+      auto& slot = slots_[tick % slots_.size()];
+
+      for (auto* hook = slot.next; hook != &slot;) {
+        auto* next = hook->next;
+        if (hook->tick <= now_tick) {
+          unlink(*hook);
+          link(expired, *hook);
+          ++n_expired;
+        }
+        hook = next;
+      }
+    }
+    current_ = now_tick;
+
+    while (expired.next != &expired) {
+      auto* hook = expired.next;
+      unlink(*hook);
+      --size_;
+      fn(*hook);
+    }
+  }
+
+private:
+  static void link(Hook& head, Hook& hook)
+  {
+    hook.prev = head.prev;
+    hook.next = &head;
+    head.prev->next = &hook;
+    head.prev = &hook;
+  }
+
+  static void unlink(Hook& hook)
+  {
+    hook.prev->next = hook.next;
+    hook.next->prev = hook.prev;
+    hook.prev = hook.next = nullptr;
+  }
+
+  const Clock::duration resolution_;
+  const Clock::time_point origin_;
+  std::vector<Hook> slots_;  // list heads
+  std::uint64_t current_ = 0;  // last processed tick
+  std::size_t size_ = 0;
+};
@@ -0,0 +1,164 @@
+// udp-batch.cpp
+
+#include "udp-batch.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>  // std::memset
+
+
+#ifdef __linux__
+
+namespace {
+
+constexpr std::size_t MAX_SEND_BATCH = 64;
+
+boost::system::error_code errno_error_code()
+{
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    return boost::asio::error::would_block;
+  }
+  return boost::system::error_code(errno, boost::asio::error::get_system_category());
+}
+
+}  // namespace
+
+std::size_t udp_send_batch(boost::asio::ip::udp::socket& socket,
+                           const UdpDatagram* datagrams, std::size_t n,
+                           boost::system::error_code& ec)
+{
+  mmsghdr msgs[MAX_SEND_BATCH];
+  iovec iovecs[MAX_SEND_BATCH];
+  std::size_t sent = 0;
+
+  ec.clear();
+
+  while (sent < n) {
+    std::size_t batch = std::min(n - sent, MAX_SEND_BATCH);
+
+    for (std::size_t i = 0; i < batch; ++i) {
+      const auto& datagram = datagrams[sent + i];
+
+      iovecs[i].iov_base = const_cast<unsigned char*>(datagram.data);
+      iovecs[i].iov_len = datagram.size;
+
+      std::memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>(datagram.remote->data());
+      msgs[i].msg_hdr.msg_namelen = datagram.remote->size();
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int res;
+    do {
+      res = ::sendmmsg(socket.native_handle(), msgs, batch, MSG_DONTWAIT);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+      ec = errno_error_code();
+      break;
+    }
+
+    // On a short count the next round finds out why the next datagram was not sent.
+    sent += res;
+  }
+
+  return sent;
+}
+
+UdpReceiveBatch::UdpReceiveBatch(std::size_t n, std::size_t buffer_size)
+  : n_(n),
+    buffer_size_(buffer_size),
+    buffers_(n * buffer_size),
+    sizes_(n),
+    remotes_(n),
+    truncated_(n),
+    msgs_(n),
+    iovecs_(n)
+{}
+
+std::size_t UdpReceiveBatch::receive(boost::asio::ip::udp::socket& socket, boost::system::error_code& ec)
+{
+  for (std::size_t i = 0; i < n_; ++i) {
+    iovecs_[i].iov_base = &buffers_[i * buffer_size_];
+    iovecs_[i].iov_len = buffer_size_;
+
+    std::memset(&msgs_[i], 0, sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_name = remotes_[i].data();
+    msgs_[i].msg_hdr.msg_namelen = remotes_[i].capacity();
+    msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int res;
+  do {
+    res = ::recvmmsg(socket.native_handle(), msgs_.data(), n_, MSG_DONTWAIT, nullptr);
+  } while (res < 0 && errno == EINTR);
+
+  if (res < 0) {
+    ec = errno_error_code();
+    return 0;
+  }
+
+  ec.clear();
+  for (int i = 0; i < res; ++i) {
+    sizes_[i] = msgs_[i].msg_len;
+    remotes_[i].resize(msgs_[i].msg_hdr.msg_namelen);
+    truncated_[i] = msgs_[i].msg_hdr.msg_flags & MSG_TRUNC;
+  }
+  return res;
+}
+
+#else  // __linux__
+
+std::size_t udp_send_batch(boost::asio::ip::udp::socket& socket,
+                           const UdpDatagram* datagrams, std::size_t n,
+                           boost::system::error_code& ec)
+{
+  std::size_t sent = 0;
+
+  ec.clear();
+
+  for (; sent < n; ++sent) {
+    const auto& datagram = datagrams[sent];
+    socket.send_to(boost::asio::buffer(datagram.data, datagram.size), *datagram.remote, 0, ec);
+    if (ec) {
+      break;
+    }
+  }
+
+  return sent;
+}
+
+UdpReceiveBatch::UdpReceiveBatch(std::size_t n, std::size_t buffer_size)
+  : n_(n),
+    buffer_size_(buffer_size),
+    buffers_(n * buffer_size),
+    sizes_(n),
+    remotes_(n),
+    truncated_(n)
+{}
+
+std::size_t UdpReceiveBatch::receive(boost::asio::ip::udp::socket& socket, boost::system::error_code& ec)
+{
+  std::size_t received = 0;
+
+  for (; received < n_; ++received) {
+    sizes_[received] = socket.receive_from(
+        boost::asio::buffer(&buffers_[received * buffer_size_], buffer_size_),
+        remotes_[received], 0, ec);
+    if (ec) {
+      break;
+    }
+
+    // Truncation is not reported, so a full buffer has to be taken for it.
+    truncated_[received] = sizes_[received] == buffer_size_;
+  }
+
+  if (received > 0) {
+    ec.clear();
+  }
+  return received;
+}
+
+#endif  // __linux__
@@ -0,0 +1,68 @@
+// udp-batch.hpp
+
+#pragma once
+
+#include <boost/asio/ip/udp.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+
+//
+// Batched non-blocking UDP I/O
+//
+// Uses sendmmsg(2)/recvmmsg(2) on Linux, so a whole batch of datagrams costs
+// a single syscall, and a loop of plain non-blocking calls elsewhere. The
+// socket must be in the non-blocking mode; running out of buffer space (or
+// data) is reported as boost::asio::error::would_block.
+//
+
+struct UdpDatagram
+{
+  const unsigned char* data;
+  std::size_t size;
+  const boost::asio::ip::udp::endpoint* remote;
+};
+
+// Sends the datagrams in order and returns the number of datagrams sent. If
+// not all of them were sent, ec tells why the next one was not.
+std::size_t udp_send_batch(boost::asio::ip::udp::socket& socket,
+                           const UdpDatagram* datagrams, std::size_t n,
+                           boost::system::error_code& ec);
+
+// Preallocated ring of receive buffers.
+class UdpReceiveBatch
+{
+public:
+  UdpReceiveBatch(std::size_t n, std::size_t buffer_size);
+
+  // Receives up to capacity() datagrams into the buffers (overwriting the
+  // previous batch) and returns the number of datagrams received. Returns 0
+  // and sets ec if there was nothing to receive or on error.
+  std::size_t receive(boost::asio::ip::udp::socket& socket, boost::system::error_code& ec);
+
+  std::size_t capacity() const { return n_; }
+
+  const unsigned char* data(std::size_t i) const { return &buffers_[i * buffer_size_]; }
+  std::size_t size(std::size_t i) const { return sizes_[i]; }
+  const boost::asio::ip::udp::endpoint& remote(std::size_t i) const { return remotes_[i]; }
+
+  // The datagram did not fit in the buffer and was cut.
+  bool truncated(std::size_t i) const { return truncated_[i]; }
+
+private:
+  const std::size_t n_;
+  const std::size_t buffer_size_;
+  std::vector<unsigned char> buffers_;
+  std::vector<std::size_t> sizes_;
+  std::vector<boost::asio::ip::udp::endpoint> remotes_;
+  std::vector<bool> truncated_;
+#ifdef __linux__
+  std::vector<mmsghdr> msgs_;
+  std::vector<iovec> iovecs_;
+#endif
+};
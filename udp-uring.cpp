@@ -0,0 +1,513 @@
+// udp-uring.cpp
+
+#include "udp-uring.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>  // std::memset, std::memcpy
+
+#include <netinet/in.h>  // sockaddr_in6
+
+#ifdef ADC_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+namespace {
+
+// The largest datagram sent (the queries are no larger).
+constexpr std::size_t MAX_SEND_SIZE = 512;
+
+// A received datagram is preceded by struct io_uring_recvmsg_out and the address of the sender.
+constexpr std::size_t RECEIVE_HEADER_SIZE = 16 + sizeof(sockaddr_in6);
+
+}  // namespace
+
+
+struct UdpUring::SendSlot
+{
+  msghdr msg;
+  iovec iov;
+  sockaddr_storage remote;
+  std::array<unsigned char, MAX_SEND_SIZE> data;
+};
+
+UdpUring::UdpUring(boost::asio::io_context& io,
+                   std::size_t capacity, std::size_t n_buffers, std::size_t datagram_size, std::size_t max_sends)
+  : capacity_(capacity),
+    n_buffers_(n_buffers),
+    buffer_size_(RECEIVE_HEADER_SIZE + datagram_size),
+    max_sends_(max_sends),
+    event_(io),
+    slots_(max_sends)
+{
+  ready_.reserve(n_buffers_);
+  batch_.reserve(capacity_);
+  free_slots_.reserve(max_sends_);
+  for (std::size_t i = max_sends_; i > 0; --i) {
+    free_slots_.push_back(i - 1);
+  }
+}
+
+void UdpUring::close()
+{
+  boost::system::error_code ignored;
+  event_.close(ignored);
+}
+
+#ifdef ADC_HAVE_IO_URING
+
+namespace {
+
+// The user_data of the requests other than the sends (which carry the index of their slot).
+constexpr std::uint64_t RECEIVE_TAG = ~std::uint64_t(0);
+constexpr std::uint64_t CANCEL_TAG = RECEIVE_TAG - 1;
+
+// The group of the provided buffers.
+constexpr std::uint16_t BUFFER_GROUP = 0;
+
+static_assert(RECEIVE_HEADER_SIZE == sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in6));
+
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+  return ::syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned n_args)
+{
+  return ::syscall(__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+boost::system::error_code errno_error_code()
+{
+  return boost::system::error_code(errno, boost::asio::error::get_system_category());
+}
+
+void* map(int fd, std::size_t size, off_t offset)
+{
+  auto* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+}  // namespace
+
+UdpUring::~UdpUring()
+{
+  if (fd_ < 0) {
+    return;
+  }
+
+  // The kernel must be done with the buffers before they are freed.
+  if (receiving_ || free_slots_.size() < max_sends_) {
+    if (auto* sqe = static_cast<io_uring_sqe*>(next_sqe())) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+      sqe->user_data = CANCEL_TAG;
+
+      while (submit() && (receiving_ || free_slots_.size() < max_sends_)) {
+        if (io_uring_enter(fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+          break;
+        }
+        ready_head_ = ready_.size();
+        reap();
+      }
+    }
+  }
+
+  unmap();
+}
+
+void UdpUring::unmap()
+{
+  if (buffer_ring_) {
+    ::munmap(buffer_ring_, buffer_ring_size_);
+  }
+  if (sqes_) {
+    ::munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ && cq_ring_ != sq_ring_) {
+    ::munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_) {
+    ::munmap(sq_ring_, sq_ring_size_);
+  }
+  buffer_ring_ = sqes_ = cq_ring_ = sq_ring_ = nullptr;
+
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+void UdpUring::open(boost::asio::ip::udp::socket& socket, boost::system::error_code& ec)
+{
+  ec.clear();
+
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  // Room for the completions of all the buffers and the sends, so the CQ never overflows.
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  params.cq_entries = 2 * (n_buffers_ + max_sends_);
+
+  fd_ = io_uring_setup(max_sends_ + 2, &params);
+  if (fd_ < 0) {
+    ec = errno == ENOSYS ? boost::asio::error::operation_not_supported : errno_error_code();
+    return;
+  }
+
+  const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+  if ((params.features & needed) != needed) {
+    ec = boost::asio::error::operation_not_supported;
+    unmap();
+    return;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+  sq_ring_ = cq_ring_ = map(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+  sqes_ = sq_ring_ ? map(fd_, sqes_size_, IORING_OFF_SQES) : nullptr;
+  if (!sqes_) {
+    ec = errno_error_code();
+    unmap();
+    return;
+  }
+
+  auto* sq = static_cast<unsigned char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  // An SQE always goes to the SQ entry of the same index.
+  auto* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i) {
+    sq_array[i] = i;
+  }
+
+  auto* cq = static_cast<unsigned char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  // The ring of the provided buffers (Linux 5.19).
+  buffer_ring_size_ = n_buffers_ * sizeof(io_uring_buf);
+  buffer_ring_ = ::mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer_ring_ == MAP_FAILED) {
+    buffer_ring_ = nullptr;
+    ec = errno_error_code();
+    unmap();
+    return;
+  }
+
+  io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<std::uintptr_t>(buffer_ring_);
+  reg.ring_entries = n_buffers_;
+  reg.bgid = BUFFER_GROUP;
+  if (io_uring_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    ec = errno == EINVAL ? boost::asio::error::operation_not_supported : errno_error_code();
+    unmap();
+    return;
+  }
+
+  buffers_.assign(n_buffers_ * buffer_size_, 0);
+  for (std::size_t i = 0; i < n_buffers_; ++i) {
+    give_back(i);
+  }
+
+  int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    ec = errno_error_code();
+    unmap();
+    return;
+  }
+  event_.assign(event_fd);
+  if (io_uring_register(fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+    ec = errno_error_code();
+    close();
+    unmap();
+    return;
+  }
+
+  // The layout of what the recvmsg puts in a buffer: struct io_uring_recvmsg_out, the address
+  // (of either family), the payload.
+  receive_msghdr_.msg_namelen = sizeof(sockaddr_in6);
+  socket_ = socket.native_handle();
+
+  // Multishot recvmsg (Linux 6.0) is told only by trying it; the probe gets cancelled right away.
+  if (!arm_receive()) {
+    ec = boost::asio::error::no_buffer_space;
+    close();
+    unmap();
+    return;
+  }
+  auto* sqe = static_cast<io_uring_sqe*>(next_sqe());
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = RECEIVE_TAG;
+  sqe->user_data = CANCEL_TAG;
+  submit();
+
+  int probed = 0;
+  while (receiving_) {
+    if (io_uring_enter(fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      break;
+    }
+    auto head = *cq_head_;
+    auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const auto& cqe = static_cast<io_uring_cqe*>(cqes_)[head & cq_mask_];
+      if (cqe.user_data == RECEIVE_TAG && !(cqe.flags & IORING_CQE_F_MORE)) {
+        probed = cqe.res;
+        receiving_ = false;
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  if (probed != -ECANCELED) {
+    ec = boost::asio::error::operation_not_supported;
+    close();
+    unmap();
+  }
+}
+
+void* UdpUring::next_sqe()
+{
+  if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+    return nullptr;
+  }
+
+  auto* sqe = static_cast<io_uring_sqe*>(sqes_) + (sqe_tail_++ & sq_mask_);
+  std::memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+bool UdpUring::arm_receive()
+{
+  auto* sqe = static_cast<io_uring_sqe*>(next_sqe());
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = socket_;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(&receive_msghdr_);
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->user_data = RECEIVE_TAG;
+
+  receiving_ = submit();
+  return receiving_;
+}
+
+bool UdpUring::submit()
+{
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+  // Whatever is left in the SQ after an error goes with the next submission.
+  for (;;) {
+    unsigned pending = sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (pending == 0) {
+      return true;
+    }
+    if (io_uring_enter(fd_, pending, 0, 0) < 0 && errno != EINTR) {
+      // Short of resources (e.g. the CQ overflowing): the rest goes with the next one.
+      return errno == EAGAIN || errno == EBUSY;
+    }
+  }
+}
+
+void UdpUring::give_back(std::uint16_t buffer)
+{
+  auto* ring = static_cast<io_uring_buf*>(buffer_ring_);
+  auto& entry = ring[buffer_tail_ & (n_buffers_ - 1)];
+  entry.addr = reinterpret_cast<std::uintptr_t>(&buffers_[buffer * buffer_size_]);
+  entry.len = buffer_size_;
+  entry.bid = buffer;
+  ++buffer_tail_;
+
+  // The tail overlays the resv of the first entry.
+  __atomic_store_n(&static_cast<io_uring_buf_ring*>(buffer_ring_)->tail, buffer_tail_, __ATOMIC_RELEASE);
+}
+
+void UdpUring::reap()
+{
+  // The completions over the CQ are flushed into it by entering the kernel.
+  if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+    io_uring_enter(fd_, 0, 0, IORING_ENTER_GETEVENTS);
+  }
+
+  // The datagrams handed over are gone from the ring.
+  if (ready_head_ > 0) {
+    ready_.erase(ready_.begin(), ready_.begin() + ready_head_);
+    ready_head_ = 0;
+  }
+
+  auto head = *cq_head_;
+  auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; ++head) {
+    const auto& cqe = static_cast<io_uring_cqe*>(cqes_)[head & cq_mask_];
+
+    if (cqe.user_data == RECEIVE_TAG) {
+      if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        // Out of buffers (re-armed once some are back) or cancelled.
+        receiving_ = false;
+      }
+      if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+        continue;
+      }
+
+      std::uint16_t buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe.res < 0) {
+        give_back(buffer);
+        continue;
+      }
+
+      const auto* p = &buffers_[buffer * buffer_size_];
+      io_uring_recvmsg_out out;
+      std::memcpy(&out, p, sizeof(out));
+
+      std::size_t offset = sizeof(out) + receive_msghdr_.msg_namelen + receive_msghdr_.msg_controllen;
+      Received received;
+      received.data = p + offset;
+      received.size = std::min<std::size_t>(out.payloadlen, cqe.res - std::min<std::size_t>(cqe.res, offset));
+      received.truncated = (out.flags & MSG_TRUNC) || received.size < out.payloadlen;
+      received.buffer = buffer;
+      std::memcpy(received.remote.data(), p + sizeof(out),
+                  std::min<std::size_t>(out.namelen, receive_msghdr_.msg_namelen));
+      received.remote.resize(std::min<std::size_t>(out.namelen, receive_msghdr_.msg_namelen));
+      ready_.push_back(received);
+    }
+    else if (cqe.user_data < slots_.size()) {
+      if (cqe.res < 0) {
+        ++send_errors_;
+      }
+      free_slots_.push_back(cqe.user_data);
+    }
+  }
+
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+std::size_t UdpUring::receive(boost::system::error_code& ec)
+{
+  for (auto&& received: batch_) {
+    give_back(received.buffer);
+  }
+  batch_.clear();
+
+  reap();
+
+  if (!receiving_ && !arm_receive()) {
+    ec = boost::asio::error::no_buffer_space;
+    return 0;
+  }
+
+  auto n = std::min(capacity_, ready_.size() - ready_head_);
+  batch_.assign(ready_.begin() + ready_head_, ready_.begin() + ready_head_ + n);
+  ready_head_ += n;
+
+  if (n == 0) {
+    ec = boost::asio::error::would_block;
+    return 0;
+  }
+  ec.clear();
+  return n;
+}
+
+std::size_t UdpUring::send(const UdpDatagram* datagrams, std::size_t n, boost::system::error_code& ec)
+{
+  ec.clear();
+
+  std::size_t sent = 0;
+  for (; sent < n; ++sent) {
+    const auto& datagram = datagrams[sent];
+    if (datagram.size > MAX_SEND_SIZE) {
+      ec = boost::asio::error::message_size;
+      break;
+    }
+
+    if (free_slots_.empty()) {
+      // The completions of the sends may be there already.
+      reap();
+      if (free_slots_.empty()) {
+        ec = boost::asio::error::would_block;
+        break;
+      }
+    }
+
+    // There is an SQ entry for each slot (and spares for the recvmsg and the cancel).
+    auto index = free_slots_.back();
+    free_slots_.pop_back();
+
+    auto& slot = slots_[index];
+    std::memcpy(slot.data.data(), datagram.data, datagram.size);
+    std::memcpy(&slot.remote, datagram.remote->data(), datagram.remote->size());
+    slot.iov.iov_base = slot.data.data();
+    slot.iov.iov_len = datagram.size;
+    std::memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_name = &slot.remote;
+    slot.msg.msg_namelen = datagram.remote->size();
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+
+    auto* sqe = static_cast<io_uring_sqe*>(next_sqe());
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket_;
+    sqe->addr = reinterpret_cast<std::uintptr_t>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = index;
+  }
+
+  if (sent > 0 && !submit() && !ec) {
+    ec = errno_error_code();
+  }
+  return sent;
+}
+
+#else  // ADC_HAVE_IO_URING
+
+UdpUring::~UdpUring() {}
+
+void UdpUring::unmap() {}
+
+void UdpUring::open(boost::asio::ip::udp::socket&, boost::system::error_code& ec)
+{
+  ec = boost::asio::error::operation_not_supported;
+}
+
+void* UdpUring::next_sqe() { return nullptr; }
+bool UdpUring::arm_receive() { return false; }
+void UdpUring::reap() {}
+bool UdpUring::submit() { return false; }
+void UdpUring::give_back(std::uint16_t) {}
+
+std::size_t UdpUring::receive(boost::system::error_code& ec)
+{
+  ec = boost::asio::error::operation_not_supported;
+  return 0;
+}
+
+std::size_t UdpUring::send(const UdpDatagram*, std::size_t, boost::system::error_code& ec)
+{
+  ec = boost::asio::error::operation_not_supported;
+  return 0;
+}
+
+#endif  // ADC_HAVE_IO_URING
@@ -0,0 +1,161 @@
+// udp-uring.hpp
+
+#pragma once
+
+#include "udp-batch.hpp"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ADC_HAVE_IO_URING 1
+#endif
+
+
+//
+// UDP I/O over io_uring
+//
+// The alternative to UdpReceiveBatch and udp_send_batch() for Linux 6.0 and
+// later: a multishot recvmsg keeps receiving into a ring of buffers provided
+// to the kernel, so receiving takes no syscall per datagram (nor per batch),
+// and the sends of a batch are submitted with a single io_uring_enter(2).
+// The completions are signalled through an eventfd, so the ring is driven by
+// the reactor of the io_context like a socket: async_wait(), then receive()
+// until would_block.
+//
+// The sends complete asynchronously. The datagrams are copied, so the
+// buffers of the caller may be reused right away, but a send failing is only
+// found out later (see take_send_errors()).
+//
+// The calls must be serialized (e.g. by a strand).
+//
+class UdpUring
+{
+public:
+  // receive() hands over up to capacity datagrams at once, received into n_buffers (a power of
+  // 2, at most 32768) buffers for datagrams of up to datagram_size bytes. Up to max_sends sends
+  // are in flight.
+  UdpUring(boost::asio::io_context& io,
+           std::size_t capacity, std::size_t n_buffers, std::size_t datagram_size, std::size_t max_sends);
+  ~UdpUring();
+
+  UdpUring(const UdpUring&) = delete;
+  UdpUring& operator=(const UdpUring&) = delete;
+
+  // Sets up the ring for the socket, which must stay open as long as the ring is used. Fails
+  // with operation_not_supported if the kernel lacks io_uring or any of the features needed, or
+  // with the error of the setup, e.g. EPERM if io_uring is disabled.
+  void open(boost::asio::ip::udp::socket& socket, boost::system::error_code& ec);
+
+  bool is_open() const { return fd_ >= 0; }
+
+  // Waits for completions; handler(const boost::system::error_code&), run by the executor
+  // associated with it (e.g. a strand).
+  template<typename Handler>
+  void async_wait(Handler&& handler)
+  {
+    auto executor = boost::asio::get_associated_executor(handler, event_.get_executor());
+    event_.async_read_some(
+        boost::asio::buffer(&event_count_, sizeof(event_count_)),
+        boost::asio::bind_executor(
+            executor,
+            [handler = std::forward<Handler>(handler)](const boost::system::error_code& err, std::size_t) mutable {
+              handler(err);
+            }));
+  }
+
+  // Cancels the wait. The requests in flight are cancelled by the destructor.
+  void close();
+
+  // Hands over up to capacity() datagrams received (giving the buffers of the previous batch
+  // back to the kernel). Returns 0 and sets ec to would_block if there was nothing to receive.
+  std::size_t receive(boost::system::error_code& ec);
+
+  std::size_t capacity() const { return capacity_; }
+
+  const unsigned char* data(std::size_t i) const { return batch_[i].data; }
+  std::size_t size(std::size_t i) const { return batch_[i].size; }
+  const boost::asio::ip::udp::endpoint& remote(std::size_t i) const { return batch_[i].remote; }
+  bool truncated(std::size_t i) const { return batch_[i].truncated; }
+
+  // Submits the datagrams in order and returns the number of datagrams submitted. Fewer than n
+  // are, with ec set to would_block, only if max_sends are in flight already.
+  std::size_t send(const UdpDatagram* datagrams, std::size_t n, boost::system::error_code& ec);
+
+  // The number of the sends failed since the last call.
+  std::size_t take_send_errors() { return std::exchange(send_errors_, 0); }
+
+private:
+  struct Received
+  {
+    const unsigned char* data;
+    std::size_t size;
+    bool truncated;
+    std::uint16_t buffer;
+    boost::asio::ip::udp::endpoint remote;
+  };
+
+  struct SendSlot;
+
+  void unmap();
+  void* next_sqe();  // an SQE cleared, nullptr if the SQ is full
+  bool arm_receive();
+  void reap();
+  bool submit();
+  void give_back(std::uint16_t buffer);
+
+  const std::size_t capacity_;
+  const std::size_t n_buffers_;
+  const std::size_t buffer_size_;  // the datagram and what the recvmsg puts before it
+  const std::size_t max_sends_;
+
+  boost::asio::posix::stream_descriptor event_;
+  std::uint64_t event_count_ = 0;
+
+  int fd_ = -1;
+  int socket_ = -1;
+
+  // The mmap()ed rings.
+  void* sq_ring_ = nullptr;
+  std::size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  std::size_t cq_ring_size_ = 0;
+  void* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  void* buffer_ring_ = nullptr;
+  std::size_t buffer_ring_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_flags_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_tail_ = 0;  // of the SQEs filled, submitted or not
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  void* cqes_ = nullptr;
+
+  std::uint16_t buffer_tail_ = 0;
+  std::vector<unsigned char> buffers_;
+
+  bool receiving_ = false;  // the multishot recvmsg is armed
+  msghdr receive_msghdr_{};  // of the recvmsg, tells the layout of the buffers
+  std::vector<Received> ready_;  // received, not handed over yet
+  std::size_t ready_head_ = 0;
+  std::vector<Received> batch_;  // handed over by the last receive()
+
+  std::vector<SendSlot> slots_;
+  std::vector<std::uint32_t> free_slots_;
+  std::size_t send_errors_ = 0;
+};
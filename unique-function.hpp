@@ -0,0 +1,148 @@
+// unique-function.hpp
+
+#pragma once
+
+#include <cstddef>
+#include <functional>  // std::invoke
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+//
+// Move-only replacement of std::function
+//
+// Callables of up to INLINE_SIZE bytes (e.g. lambdas capturing a few
+// pointers) are stored inline, so constructing and moving the function does
+// not allocate. Unlike std::function it also accepts move-only callables.
+//
+template<typename Signature>
+class UniqueFunction;
+
+template<typename R, typename... Args>
+class UniqueFunction<R(Args...)>
+{
+public:
+  static constexpr std::size_t INLINE_SIZE = 6 * sizeof(void*);
+
+  UniqueFunction() = default;
+  UniqueFunction(std::nullptr_t) {}
+
+  template<typename F,
+           typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, UniqueFunction> &&
+                                       std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  UniqueFunction(F&& f)
+  {
+    using Fn = std::decay_t<F>;
+
+    if constexpr (IS_INLINE<Fn>) {
+      ::new (static_cast<void*>(&storage_)) Fn(std::forward<F>(f));
+      ops_ = &InlineOps<Fn>::OPS;
+    }
+    else {
+      ::new (static_cast<void*>(&storage_)) Fn*(new Fn(std::forward<F>(f)));
+      ops_ = &HeapOps<Fn>::OPS;
+    }
+  }
+
+  UniqueFunction(UniqueFunction&& other) noexcept
+  {
+    move_from(other);
+  }
+
+  UniqueFunction& operator=(UniqueFunction&& other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      move_from(other);
+    }
+    return *this;
+  }
+
+  UniqueFunction& operator=(std::nullptr_t)
+  {
+    reset();
+    return *this;
+  }
+
+  ~UniqueFunction() { reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  R operator()(Args... args)
+  {
+    return ops_->invoke(&storage_, std::forward<Args>(args)...);
+  }
+
+private:
+  struct Ops
+  {
+    R (*invoke)(void* storage, Args&&... args);
+    void (*move)(void* dst, void* src);  // also destroys src
+    void (*destroy)(void* storage);
+  };
+
+  template<typename F>
+  static constexpr bool IS_INLINE =
+      sizeof(F) <= INLINE_SIZE &&
+      alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+  template<typename F>
+  struct InlineOps
+  {
+    static F& get(void* storage) { return *static_cast<F*>(storage); }
+
+    static R invoke(void* storage, Args&&... args)
+    {
+      return std::invoke(get(storage), std::forward<Args>(args)...);
+    }
+
+    static void move(void* dst, void* src)
+    {
+      ::new (dst) F(std::move(get(src)));
+      get(src).~F();
+    }
+
+    static void destroy(void* storage) { get(storage).~F(); }
+
+    static constexpr Ops OPS{&invoke, &move, &destroy};
+  };
+
+  template<typename F>
+  struct HeapOps
+  {
+    static F*& get(void* storage) { return *static_cast<F**>(storage); }
+
+    static R invoke(void* storage, Args&&... args)
+    {
+      return std::invoke(*get(storage), std::forward<Args>(args)...);
+    }
+
+    static void move(void* dst, void* src) { ::new (dst) F*(get(src)); }
+
+    static void destroy(void* storage) { delete get(storage); }
+
+    static constexpr Ops OPS{&invoke, &move, &destroy};
+  };
+
+  void move_from(UniqueFunction& other) noexcept
+  {
+    if (other.ops_) {
+      other.ops_->move(&storage_, &other.storage_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  void reset()
+  {
+    if (ops_) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  const Ops* ops_ = nullptr;
+  std::aligned_storage_t<INLINE_SIZE, alignof(std::max_align_t)> storage_;
+};